@@ -0,0 +1,521 @@
+#include "cache.h"
+#include "mappedfile.h"
+#include "parallel.h"
+#include "parameters.h"
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+namespace Mpcv {
+
+namespace {
+
+const uint32_t MAGIC = 0x5643504d; // "MPCV" in little endian
+
+const uint32_t OCTREE_MAGIC = 0x4f43504d; // "MPCO" in little endian
+
+/// Increment when the layout of the cache file (or of the cached types) changes.
+const uint32_t VERSION = 1;
+
+/// Returns the path of the cache file for the given source, or an empty string if the cache is disabled.
+std::string cachePath(const QFileInfo& info, const std::string& suffix = ".mpcv") {
+    const std::string& dir = Parameters::global().cacheDir;
+    if (dir == "off") {
+        return {};
+    } else if (dir == "source") {
+        return info.absoluteFilePath().toStdString() + suffix;
+    }
+    QString cacheDir = dir.empty() ? QDir::homePath() + "/.cache/mpcv" : QString::fromStdString(dir);
+    if (!QDir().mkpath(cacheDir)) {
+        std::cout << "Cannot create cache directory '" << cacheDir.toStdString() << "'" << std::endl;
+        return {};
+    }
+    // one cache file per source file; the file is overwritten if the source or parameters change
+    std::stringstream name;
+    name << std::hex << std::hash<std::string>()(info.absoluteFilePath().toStdString()) << "-"
+         << info.fileName().toStdString() << suffix;
+    return cacheDir.toStdString() + "/" + name.str();
+}
+
+/// Marks the cache file as recently used, so that it is removed last when the cache gets too large.
+void touch(const std::string& path) {
+    QFile file(QString::fromStdString(path));
+    if (file.open(QIODevice::ReadWrite)) {
+        file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+    }
+}
+
+/// Removes the least recently used files from the cache directory until it fits into the size limit. The
+/// file just written is kept even if it does not fit.
+void pruneCache(const std::string& written) {
+    const Parameters& params = Parameters::global();
+    if (params.cacheSizeLimit == 0 || params.cacheDir == "source") {
+        return;
+    }
+    const QFileInfo writtenInfo(QString::fromStdString(written));
+    QFileInfoList files = writtenInfo.absoluteDir().entryInfoList(
+        QStringList{ "*.mpcv", "*.octree" }, QDir::Files, QDir::Time | QDir::Reversed);
+    std::size_t totalSize = 0;
+    for (const QFileInfo& file : files) {
+        totalSize += file.size();
+    }
+    for (const QFileInfo& file : files) {
+        if (totalSize <= params.cacheSizeLimit) {
+            break;
+        }
+        if (file.absoluteFilePath() == writtenInfo.absoluteFilePath()) {
+            continue;
+        }
+        if (QFile::remove(file.absoluteFilePath())) {
+            std::cout << "Removed cache '" << file.absoluteFilePath().toStdString() << "'" << std::endl;
+            totalSize -= file.size();
+        }
+    }
+}
+
+/// Returns the string identifying the source file and all parameters affecting the loaded mesh.
+std::string cacheKey(const QFileInfo& info) {
+    const Parameters& params = Parameters::global();
+    std::stringstream key;
+    key << std::setprecision(17);
+    key << info.absoluteFilePath().toStdString() << "|" << info.lastModified().toMSecsSinceEpoch() << "|"
+        << info.size();
+    key << "|extents=" << params.extents.lower()[0] << "," << params.extents.lower()[1] << ","
+        << params.extents.lower()[2] << ":" << params.extents.upper()[0] << "," << params.extents.upper()[1]
+        << "," << params.extents.upper()[2];
+    key << "|stride=" << params.pointStride << "," << int(params.strideMode);
+    key << "|subset=" << int(params.subset) << "," << int(params.subsetRule.attribute) << ","
+        << params.subsetRule.from << "-" << params.subsetRule.to;
+    key << "|attributes=" << params.attributes;
+    key << "|textureScale=" << params.textureScale;
+    key << "|dsmResolution=" << params.dsmResolution;
+    key << "|scans=";
+    for (int scan : params.scans) {
+        key << scan << ",";
+    }
+    return key.str();
+}
+
+class CacheWriter {
+    std::ostream& out_;
+    ProgressCounter& counter_;
+
+public:
+    CacheWriter(std::ostream& out, ProgressCounter& counter)
+        : out_(out)
+        , counter_(counter) {}
+
+    template <typename T>
+    void write(const T& value) {
+        out_.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void write(const std::string& value) {
+        write<uint64_t>(value.size());
+        out_.write(value.data(), value.size());
+    }
+
+    template <typename T>
+    void write(const std::vector<T>& values) {
+        write<uint64_t>(values.size());
+        write<uint32_t>(sizeof(T));
+        writeBlocks(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+    }
+
+    void write(const std::unique_ptr<ITexture>& texture) {
+        write<uint8_t>(bool(texture));
+        if (!texture) {
+            return;
+        }
+        write<Pvl::Vec2i>(texture->size());
+        write<uint32_t>(uint32_t(texture->format()));
+        // same layout as std::vector<uint8_t>
+        write<uint64_t>(texture->dataSize());
+        write<uint32_t>(sizeof(uint8_t));
+        writeBlocks(reinterpret_cast<const char*>(texture->data()), texture->dataSize());
+    }
+
+private:
+    /// Writes the data in blocks to be able to report the progress and cancel the operation.
+    void writeBlocks(const char* data, const std::size_t size) {
+        const std::size_t BLOCK = 1 << 24;
+        for (std::size_t offset = 0; offset < size && !counter_.cancelled(); offset += BLOCK) {
+            const std::size_t count = std::min(BLOCK, size - offset);
+            out_.write(data + offset, count);
+            counter_.add(count);
+        }
+    }
+};
+
+class CacheReader {
+    const char* ptr_;
+    const char* end_;
+
+public:
+    CacheReader(const char* begin, const char* end)
+        : ptr_(begin)
+        , end_(end) {}
+
+    template <typename T>
+    T read() {
+        T value;
+        memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    std::string readString() {
+        const std::size_t size = read<uint64_t>();
+        return std::string(take(size), size);
+    }
+
+    template <typename T>
+    void read(std::vector<T>& values) {
+        const std::size_t count = read<uint64_t>();
+        if (read<uint32_t>() != sizeof(T)) {
+            throw std::runtime_error("Unexpected element size");
+        }
+        values.resize(count);
+        memcpy(values.data(), take(count * sizeof(T)), count * sizeof(T));
+    }
+
+    /// Returns the values stored in the file without copying them, or nullptr if there are no values.
+    /// The data are not aligned, they have to be copied before use.
+    template <typename T>
+    const char* view(std::size_t& count) {
+        count = read<uint64_t>();
+        if (read<uint32_t>() != sizeof(T)) {
+            throw std::runtime_error("Unexpected element size");
+        }
+        return count > 0 ? take(count * sizeof(T)) : nullptr;
+    }
+
+    std::unique_ptr<ITexture> readTexture() {
+        if (!read<uint8_t>()) {
+            return nullptr;
+        }
+        const Pvl::Vec2i size = read<Pvl::Vec2i>();
+        const ImageFormat format = ImageFormat(read<uint32_t>());
+        std::vector<uint8_t> data;
+        read(data);
+        return std::make_unique<RawTexture>(size, format, std::move(data));
+    }
+
+private:
+    const char* take(const std::size_t size) {
+        if (std::size_t(end_ - ptr_) < size) {
+            throw std::runtime_error("Unexpected end of file");
+        }
+        const char* ptr = ptr_;
+        ptr_ += size;
+        return ptr;
+    }
+};
+
+std::size_t textureSize(const std::unique_ptr<ITexture>& texture) {
+    return texture ? texture->dataSize() : 0;
+}
+
+} // namespace
+
+bool hasCachedMesh(const QString& file) {
+    const QFileInfo info(file);
+    const std::string path = cachePath(info);
+    if (path.empty() || !QFileInfo(QString::fromStdString(path)).exists()) {
+        return false;
+    }
+    try {
+        MappedFile mapped(path);
+        CacheReader reader(mapped.begin(), mapped.end());
+        return reader.read<uint32_t>() == MAGIC && reader.read<uint32_t>() == VERSION &&
+               reader.readString() == cacheKey(info);
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+bool loadCachedMesh(const QString& file, TexturedMesh& mesh) {
+    const QFileInfo info(file);
+    const std::string path = cachePath(info);
+    if (path.empty() || !QFileInfo(QString::fromStdString(path)).exists()) {
+        return false;
+    }
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    try {
+        MappedFile mapped(path);
+        CacheReader reader(mapped.begin(), mapped.end());
+        if (reader.read<uint32_t>() != MAGIC || reader.read<uint32_t>() != VERSION) {
+            std::cout << "Ignoring cache '" << path << "' of different version" << std::endl;
+            return false;
+        }
+        if (reader.readString() != cacheKey(info)) {
+            std::cout << "Cache '" << path << "' is out of date" << std::endl;
+            return false;
+        }
+        TexturedMesh cached;
+        reader.read(cached.vertices);
+        reader.read(cached.normals);
+        reader.read(cached.colors);
+        reader.read(cached.times);
+        reader.read(cached.faces);
+        reader.read(cached.uv);
+        reader.read(cached.texIds);
+        reader.read(cached.ao);
+        reader.read(cached.classes);
+        const std::size_t numScalars = reader.read<uint64_t>();
+        for (std::size_t i = 0; i < numScalars; ++i) {
+            std::string name = reader.readString();
+            reader.read(cached.scalars[name]);
+        }
+        cached.srs = Srs(reader.read<Coords>());
+        const std::size_t numClasses = reader.read<uint64_t>();
+        for (std::size_t i = 0; i < numClasses; ++i) {
+            const int cls = reader.read<int>();
+            cached.classToColor[cls] = reader.read<Color>();
+        }
+        cached.texture = reader.readTexture();
+        cached.materials.resize(reader.read<uint64_t>());
+        for (Material& material : cached.materials) {
+            material.name = reader.readString();
+            material.firstFace = reader.read<uint64_t>();
+            material.numFaces = reader.read<uint64_t>();
+            material.texture = reader.readTexture();
+        }
+        if (reader.read<uint32_t>() != MAGIC) {
+            throw std::runtime_error("Missing end marker");
+        }
+        mesh = std::move(cached);
+        touch(path);
+    } catch (const std::exception& e) {
+        std::cout << "Cannot read cache '" << path << "': " << e.what() << std::endl;
+        return false;
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    std::cout << "Loaded cached mesh '" << path << "' in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "ms"
+              << std::endl;
+    return true;
+}
+
+bool saveCachedMesh(const QString& file, const TexturedMesh& mesh, const Progress& prog) {
+    const QFileInfo info(file);
+    const std::string path = cachePath(info);
+    if (path.empty()) {
+        return false;
+    }
+    std::size_t totalSize = mesh.vertices.size() * sizeof(Pvl::Vec3f) +
+                            mesh.normals.size() * sizeof(Pvl::Vec3f) + mesh.colors.size() * sizeof(Color) +
+                            mesh.times.size() * sizeof(double) + mesh.faces.size() * sizeof(TexturedMesh::Face) +
+                            mesh.uv.size() * sizeof(Pvl::Vec2f) +
+                            mesh.texIds.size() * sizeof(TexturedMesh::Face) + mesh.ao.size() +
+                            mesh.classes.size() + textureSize(mesh.texture);
+    for (const auto& p : mesh.scalars) {
+        totalSize += p.second.size() * sizeof(float);
+    }
+    for (const Material& material : mesh.materials) {
+        totalSize += textureSize(material.texture);
+    }
+    const std::size_t limit = Parameters::global().cacheSizeLimit;
+    if (limit > 0 && totalSize > limit && Parameters::global().cacheDir != "source") {
+        std::cout << "Mesh is larger than the cache, not caching it" << std::endl;
+        return false;
+    }
+
+    // write into a temporary file first, so that an interrupted write never leaves a valid-looking cache
+    const std::string tempPath = path + ".tmp";
+    ProgressCounter counter(totalSize);
+    bool completed = false;
+    try {
+        completed = runWithProgress(counter, prog, [&] {
+            std::ofstream out(tempPath, std::ios::binary);
+            CacheWriter writer(out, counter);
+            writer.write<uint32_t>(MAGIC);
+            writer.write<uint32_t>(VERSION);
+            writer.write(cacheKey(info));
+            writer.write(mesh.vertices);
+            writer.write(mesh.normals);
+            writer.write(mesh.colors);
+            writer.write(mesh.times);
+            writer.write(mesh.faces);
+            writer.write(mesh.uv);
+            writer.write(mesh.texIds);
+            writer.write(mesh.ao);
+            writer.write(mesh.classes);
+            writer.write<uint64_t>(mesh.scalars.size());
+            for (const auto& p : mesh.scalars) {
+                writer.write(p.first);
+                writer.write(p.second);
+            }
+            writer.write(mesh.srs.center());
+            writer.write<uint64_t>(mesh.classToColor.size());
+            for (const auto& p : mesh.classToColor) {
+                writer.write<int>(p.first);
+                writer.write<Color>(p.second);
+            }
+            writer.write(mesh.texture);
+            writer.write<uint64_t>(mesh.materials.size());
+            for (const Material& material : mesh.materials) {
+                writer.write(material.name);
+                writer.write<uint64_t>(material.firstFace);
+                writer.write<uint64_t>(material.numFaces);
+                writer.write(material.texture);
+            }
+            writer.write<uint32_t>(MAGIC);
+            out.close();
+            if (!out) {
+                throw std::runtime_error("Cannot write file '" + tempPath + "'");
+            }
+        });
+    } catch (const std::exception& e) {
+        std::cout << "Cannot save cache '" << path << "': " << e.what() << std::endl;
+    }
+    if (!completed || std::rename(tempPath.c_str(), path.c_str()) != 0) {
+        std::remove(tempPath.c_str());
+        return false;
+    }
+    std::cout << "Saved mesh cache '" << path << "'" << std::endl;
+    pruneCache(path);
+    return true;
+}
+
+CachedOctree::CachedOctree(const std::string& path, const std::string& key) {
+    file_ = std::make_unique<MappedFile>(path);
+    CacheReader reader(file_->begin(), file_->end());
+    if (reader.read<uint32_t>() != OCTREE_MAGIC || reader.read<uint32_t>() != VERSION) {
+        throw std::runtime_error("Different version");
+    }
+    if (reader.readString() != key) {
+        throw std::runtime_error("Out of date");
+    }
+    srs_ = Srs(reader.read<Coords>());
+    extents_ = reader.read<Pvl::Box3f>();
+    const std::size_t numClasses = reader.read<uint64_t>();
+    for (std::size_t i = 0; i < numClasses; ++i) {
+        const int cls = reader.read<int>();
+        classToColor_[cls] = reader.read<Color>();
+    }
+    reader.read(nodes_);
+    vertices_ = reader.view<Pvl::Vec3f>(numPoints_);
+    std::size_t count = 0;
+    auto attribute = [&](const char* data) {
+        if (data != nullptr && count != numPoints_) {
+            throw std::runtime_error("Unexpected number of values");
+        }
+        return data;
+    };
+    normals_ = attribute(reader.view<Pvl::Vec3f>(count));
+    colors_ = attribute(reader.view<Color>(count));
+    classes_ = attribute(reader.view<uint8_t>(count));
+    if (reader.read<uint32_t>() != OCTREE_MAGIC) {
+        throw std::runtime_error("Missing end marker");
+    }
+    for (const OctreeNode& node : nodes_) {
+        if (node.first + node.count > numPoints_) {
+            throw std::runtime_error("Invalid octree node");
+        }
+    }
+}
+
+CachedOctree::~CachedOctree() = default;
+
+TexturedMesh CachedOctree::loadNode(const int index) const {
+    const OctreeNode& node = nodes_[index];
+    TexturedMesh mesh;
+    mesh.srs = srs_;
+    mesh.classToColor = classToColor_;
+    auto copy = [&node](auto& values, const char* data) {
+        using T = typename std::decay_t<decltype(values)>::value_type;
+        if (data != nullptr) {
+            values.resize(node.count);
+            memcpy(values.data(), data + node.first * sizeof(T), node.count * sizeof(T));
+        }
+    };
+    copy(mesh.vertices, vertices_);
+    copy(mesh.normals, normals_);
+    copy(mesh.colors, colors_);
+    copy(mesh.classes, classes_);
+    return mesh;
+}
+
+std::unique_ptr<CachedOctree> loadCachedOctree(const QString& file) {
+    const QFileInfo info(file);
+    const std::string path = cachePath(info, ".octree");
+    if (path.empty() || !QFileInfo(QString::fromStdString(path)).exists()) {
+        return nullptr;
+    }
+    try {
+        std::unique_ptr<CachedOctree> octree = std::make_unique<CachedOctree>(path, cacheKey(info));
+        touch(path);
+        std::cout << "Opened octree '" << path << "' with " << octree->numPoints() << " points" << std::endl;
+        return octree;
+    } catch (const std::exception& e) {
+        std::cout << "Cannot use octree '" << path << "': " << e.what() << std::endl;
+        return nullptr;
+    }
+}
+
+bool saveCachedOctree(const QString& file,
+    const TexturedMesh& cloud,
+    const PointOctree& octree,
+    const Progress& prog) {
+    const QFileInfo info(file);
+    const std::string path = cachePath(info, ".octree");
+    if (path.empty() || octree.empty()) {
+        return false;
+    }
+    const std::size_t totalSize = cloud.vertices.size() * sizeof(Pvl::Vec3f) +
+                                  cloud.normals.size() * sizeof(Pvl::Vec3f) +
+                                  cloud.colors.size() * sizeof(Color) + cloud.classes.size();
+
+    const std::string tempPath = path + ".tmp";
+    ProgressCounter counter(std::max(totalSize, std::size_t(1)));
+    bool completed = false;
+    try {
+        completed = runWithProgress(counter, prog, [&] {
+            std::ofstream out(tempPath, std::ios::binary);
+            CacheWriter writer(out, counter);
+            writer.write<uint32_t>(OCTREE_MAGIC);
+            writer.write<uint32_t>(VERSION);
+            writer.write(cacheKey(info));
+            writer.write(cloud.srs.center());
+            Pvl::Box3f extents;
+            for (const Pvl::Vec3f& p : cloud.vertices) {
+                extents.extend(p);
+            }
+            writer.write(extents);
+            writer.write<uint64_t>(cloud.classToColor.size());
+            for (const auto& p : cloud.classToColor) {
+                writer.write<int>(p.first);
+                writer.write<Color>(p.second);
+            }
+            writer.write(octree.nodes());
+            writer.write(cloud.vertices);
+            writer.write(cloud.normals);
+            writer.write(cloud.colors);
+            writer.write(cloud.classes);
+            writer.write<uint32_t>(OCTREE_MAGIC);
+            out.close();
+            if (!out) {
+                throw std::runtime_error("Cannot write file '" + tempPath + "'");
+            }
+        });
+    } catch (const std::exception& e) {
+        std::cout << "Cannot save octree '" << path << "': " << e.what() << std::endl;
+    }
+    if (!completed || std::rename(tempPath.c_str(), path.c_str()) != 0) {
+        std::remove(tempPath.c_str());
+        return false;
+    }
+    std::cout << "Saved octree '" << path << "'" << std::endl;
+    // streaming needs the octree, so it is stored even if it does not fit into the cache by itself
+    pruneCache(path);
+    return true;
+}
+
+} // namespace Mpcv
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "mesh.h"
+#include "octree.h"
+#include <map>
+
+namespace Mpcv {
+
+class MappedFile;
+
+/// \brief Loads the mesh previously cached for the given source file.
+///
+/// The cache is only used if it was created from the same file (same path, modification time and size)
+/// and with the same loading parameters. Returns false if there is no valid cache for the file.
+bool loadCachedMesh(const QString& file, TexturedMesh& mesh);
+
+/// Returns true if there is a valid cache for the file, i.e. loadCachedMesh will not need to read the file.
+/// Only the header of the cache is checked.
+bool hasCachedMesh(const QString& file);
+
+/// Stores the loaded mesh into the cache. Returns false if the cache is disabled, the cache file cannot
+/// be written or the operation has been cancelled.
+bool saveCachedMesh(const QString& file, const TexturedMesh& mesh, const Progress& prog);
+
+/// \brief Point cloud octree stored in the cache, with the points of the nodes read on demand.
+///
+/// The hierarchy is read when the file is opened; the points of all nodes follow the hierarchy in the order
+/// of the nodes and are read from the memory-mapped file only when a node is loaded.
+class CachedOctree {
+    std::unique_ptr<MappedFile> file_;
+    std::vector<OctreeNode> nodes_;
+    Srs srs_;
+    Pvl::Box3f extents_;
+    std::map<int, Color> classToColor_;
+
+    ///< Points of all nodes in the mapped file, nullptr for attributes the cloud does not have
+    const char* vertices_ = nullptr;
+    const char* normals_ = nullptr;
+    const char* colors_ = nullptr;
+    const char* classes_ = nullptr;
+    std::size_t numPoints_ = 0;
+
+public:
+    /// Opens the octree file; throws if the file is not a valid octree.
+    CachedOctree(const std::string& path, const std::string& key);
+
+    ~CachedOctree();
+
+    const std::vector<OctreeNode>& nodes() const {
+        return nodes_;
+    }
+
+    const Srs& srs() const {
+        return srs_;
+    }
+
+    /// Extents of the points in local coordinates.
+    const Pvl::Box3f& extents() const {
+        return extents_;
+    }
+
+    std::size_t numPoints() const {
+        return numPoints_;
+    }
+
+    /// Reads the points of the node; can be called from any thread.
+    TexturedMesh loadNode(int index) const;
+};
+
+/// Opens the octree previously converted from the given point cloud, or returns nullptr if there is no valid
+/// octree for the file.
+std::unique_ptr<CachedOctree> loadCachedOctree(const QString& file);
+
+/// Stores the point cloud, reordered into the nodes of the octree, into the cache. Only the attributes drawn
+/// by the viewer are stored. Returns false if the cache is disabled, the file cannot be written or the
+/// operation has been cancelled.
+bool saveCachedOctree(const QString& file, const TexturedMesh& cloud, const PointOctree& octree,
+    const Progress& prog);
+
+} // namespace Mpcv
@@ -80,6 +80,34 @@ Pvl::Optional<Pvl::Vec2f> Camera::unproject(const Pvl::Vec3f& r) const {
     return Pvl::Vec2f(x, y);
 }
 
+Frustum::Frustum(const Camera& camera, const float zNear, const float zFar) {
+    const Pvl::Vec3f eye = camera.eye();
+    const Pvl::Vec3f dir = camera.direction();
+    const Pvl::Vec3f left = camera.left();
+    const Pvl::Vec3f up = camera.up();
+    auto plane = [&eye](const Pvl::Vec3f& normal) { return Plane{ normal, -Pvl::dotProd(normal, eye) }; };
+    // side planes pass through the eye and contain the edges of the image
+    planes_[0] = plane(dir * Pvl::norm(left) - Pvl::normalize(left));
+    planes_[1] = plane(dir * Pvl::norm(left) + Pvl::normalize(left));
+    planes_[2] = plane(dir * Pvl::norm(up) - Pvl::normalize(up));
+    planes_[3] = plane(dir * Pvl::norm(up) + Pvl::normalize(up));
+    planes_[4] = Plane{ dir, -Pvl::dotProd(dir, eye) - zNear };
+    planes_[5] = Plane{ -dir, Pvl::dotProd(dir, eye) + zFar };
+}
+
+bool Frustum::intersects(const Pvl::Box3f& box) const {
+    for (const Plane& plane : planes_) {
+        // test the box corner farthest along the normal
+        Pvl::Vec3f p;
+        for (int i = 0; i < 3; ++i) {
+            p[i] = plane.normal[i] >= 0.f ? box.upper()[i] : box.lower()[i];
+        }
+        if (Pvl::dotProd(plane.normal, p) + plane.offset < 0.f) {
+            return false;
+        }
+    }
+    return true;
+}
 
 bool intersection(const CameraRay& ray, const Triangle& tri, float& t) {
     // https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm#C++_Implementation
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "coordinates.h"
+#include "pvl/Box.hpp"
 #include "pvl/Matrix.hpp"
 #include "pvl/Optional.hpp"
 #include <iostream>
@@ -39,6 +40,10 @@ public:
         return up_;
     }
 
+    Pvl::Vec3f left() const {
+        return left_;
+    }
+
     Pvl::Vec3f direction() const {
         return dir_;
     }
@@ -76,6 +81,23 @@ private:
 
 }; // namespace Mpcv
 
+/// View frustum of the camera, given by the planes bounding the visible space.
+class Frustum {
+    struct Plane {
+        ///< Normal pointing inside the frustum
+        Pvl::Vec3f normal;
+        float offset;
+    };
+    std::array<Plane, 6> planes_;
+
+public:
+    Frustum(const Camera& camera, float zNear, float zFar);
+
+    /// Returns false if the box is entirely outside the frustum; conservative, may return true for boxes
+    /// close to the corners of the frustum.
+    bool intersects(const Pvl::Box3f& box) const;
+};
+
 using Triangle = std::array<Pvl::Vec3f, 3>;
 
 bool intersection(const CameraRay& ray, const Triangle& tri, float& t);
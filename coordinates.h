@@ -25,6 +25,10 @@ public:
         return coords + center_;
     }
 
+    const Coords& center() const {
+        return center_;
+    }
+
     bool operator==(const Srs& other) const {
         return center_ == other.center_;
     }
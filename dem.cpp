@@ -1,11 +1,16 @@
 #include "dem.h"
+#include "parallel.h"
 #include "parameters.h"
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <mutex>
 #include <sys/stat.h>
 
 #ifdef HAS_GDAL
 #include "gdal_priv.h"
 #include "cpl_conv.h"
+#include <tbb/tbb.h>
 #endif
 
 namespace Mpcv {
@@ -21,6 +26,42 @@ std::string getDsmFile(const std::string& file) {
 }
 
 #ifdef HAS_GDAL
+namespace {
+
+void registerDrivers() {
+    // files may be loaded concurrently, register the drivers only once
+    static std::once_flag registered;
+    std::call_once(registered, [] { GDALAllRegister(); });
+}
+
+/// Returns the index of the coarsest overview still having at least the given resolution, or -1 if the
+/// full-resolution band should be used.
+int selectOverview(GDALRasterBand* band, const int width, const int height) {
+    int selected = -1;
+    for (int i = 0; i < band->GetOverviewCount(); ++i) {
+        GDALRasterBand* overview = band->GetOverview(i);
+        if (overview->GetXSize() >= width && overview->GetYSize() >= height &&
+            (selected < 0 || overview->GetXSize() < band->GetOverview(selected)->GetXSize())) {
+            selected = i;
+        }
+    }
+    return selected;
+}
+
+GDALRasterBand* getBand(GDALDataset* dataset, const int overview) {
+    GDALRasterBand* band = dataset->GetRasterBand(1);
+    return overview >= 0 ? band->GetOverview(overview) : band;
+}
+
+/// Rectangle [x0, x1) x [y0, y1) of the output grid, read by a single RasterIO call.
+struct DemTile {
+    uint32_t x0, y0, x1, y1;
+    std::vector<TexturedMesh::Face> faces;
+    float minHeight = std::numeric_limits<float>::max();
+};
+
+} // namespace
+
 TexturedMesh loadDem(std::string file, const Progress& progress) {
     std::string dsmFile = getDsmFile(file);
     std::string textureFile;
@@ -32,11 +73,7 @@ TexturedMesh loadDem(std::string file, const Progress& progress) {
         textured = true;
     }
 
-    static bool firstTime = true;
-    if (firstTime) {
-        GDALAllRegister();
-        firstTime = false;
-    }
+    registerDrivers();
     GDALDataset* dataset = (GDALDataset*)GDALOpen(file.c_str(), GA_ReadOnly);
     if (dataset == nullptr) {
         throw std::runtime_error("Cannot open GeoTIFF '" + file + "'");
@@ -73,14 +110,6 @@ TexturedMesh loadDem(std::string file, const Progress& progress) {
            GDALGetColorInterpretationName(
                rasterBand->GetColorInterpretation()));
 
-    int bGotMin, bGotMax;
-    double adfMinMax[2];
-    adfMinMax[0] = rasterBand->GetMinimum(&bGotMin);
-    adfMinMax[1] = rasterBand->GetMaximum(&bGotMax);
-    if (!(bGotMin && bGotMax)) {
-        GDALComputeRasterMinMax((GDALRasterBandH)rasterBand, TRUE, adfMinMax);
-    }
-    printf("Min=%.3fd, Max=%.3f\n", adfMinMax[0], adfMinMax[1]);
     if (rasterBand->GetOverviewCount() > 0) {
         printf("Band has %d overviews.\n", rasterBand->GetOverviewCount());
     }
@@ -102,73 +131,159 @@ TexturedMesh loadDem(std::string file, const Progress& progress) {
               << ":" << originX + pixelX * bandWidth << "," << originY
               << std::endl;
 
-    double nodata=  rasterBand->GetNoDataValue();
+    const float nodata = float(rasterBand->GetNoDataValue());
     std::cout << "No-data value = " << nodata << std::endl;
-    TexturedMesh mesh;
-    std::vector<float> scanline(bandWidth);
+
+    // grid of samples at the centers of step x step pixel cells
     Parameters& globals = Parameters::global();
-    int step = std::max(std::max(bandWidth, bandHeight) / globals.dsmResolution, 1u);
-    uint32_t width = (bandWidth + step - 1) / step;
-    uint32_t height = (bandHeight + step - 1) / step;
-    for (uint32_t y = 0; y <= height; ++y) {
-        CPLErr err = rasterBand->RasterIO(GF_Read,
-                                          0,
-                                          std::min(y * step, bandHeight-1),
-                                          bandWidth,
-                                          1,
-                                          scanline.data(),
-                                          bandWidth,
-                                          1,
-                                          GDT_Float32,
-                                          0,
-                                          0);
-        if (err != CPLE_None) {
-            throw std::runtime_error("Error reading file '" + file + "'");
-        }
-        for (uint32_t x = 0; x <= width; ++x) {
-            Pvl::Vec3f v(x * pixelX * step, y * pixelY * step, scanline[std::min(x * step, bandWidth - 1)]);
-            mesh.vertices.push_back(v);
-        }
-        if (textured) {
-            for (uint32_t x = 0; x <= width; ++x) {
-                Pvl::Vec2f v(float(x) / width, 1.f - float(y) / height);
-                mesh.uv.push_back(v);
-            }
-        }
-        if (progress(y * 100.f / height)) {
-            return {};
+    uint32_t step = std::max(std::max(bandWidth, bandHeight) / globals.dsmResolution, 1u);
+    const uint32_t width = std::max((bandWidth + step - 1) / step, 2u);
+    const uint32_t height = std::max((bandHeight + step - 1) / step, 2u);
+
+    // read from the coarsest overview that still has the resolution of the grid
+    const int overview = selectOverview(rasterBand, width, height);
+    GDALRasterBand* sourceBand = getBand(dataset, overview);
+    const double scaleX = double(sourceBand->GetXSize()) / width;
+    const double scaleY = double(sourceBand->GetYSize()) / height;
+    if (overview >= 0) {
+        std::cout << "Reading overview " << sourceBand->GetXSize() << "x" << sourceBand->GetYSize()
+                  << std::endl;
+    }
+    sourceBand->GetBlockSize(&blockXSize, &blockYSize);
+    GDALClose(dataset);
+
+    // tiles span whole native blocks of the source band, but at least 64 samples to limit the overhead
+    const uint32_t tileWidth = std::max(uint32_t(std::ceil(blockXSize / scaleX)), 64u);
+    const uint32_t tileHeight = std::max(uint32_t(std::ceil(blockYSize / scaleY)), 64u);
+    std::vector<DemTile> tiles;
+    for (uint32_t y0 = 0; y0 < height; y0 += tileHeight) {
+        for (uint32_t x0 = 0; x0 < width; x0 += tileWidth) {
+            DemTile tile;
+            tile.x0 = x0;
+            tile.y0 = y0;
+            tile.x1 = std::min(x0 + tileWidth, width);
+            tile.y1 = std::min(y0 + tileHeight, height);
+            tiles.push_back(std::move(tile));
         }
     }
-    uint32_t index = 0;
-    for (uint32_t y = 0; y <= height - 1; ++y, ++index) {
-        for (uint32_t x = 0; x <= width - 1; ++x, ++index) {
-            if (mesh.vertices[index][2] == nodata ||
-                mesh.vertices[index + 1][2] == nodata ||
-                mesh.vertices[index + width][2] == nodata ||
-                mesh.vertices[index + width + 1][2] == nodata) {
-                continue;
-            }
-            mesh.faces.emplace_back(TexturedMesh::Face{
-                index + 1,
-                index,
-                index + width + 1,
-            });
-            mesh.faces.emplace_back(TexturedMesh::Face{
-                index + 1,
-                index + width + 1,
-                index + width + 2,
-            });
+    std::cout << "Reading " << width << "x" << height << " samples in " << tiles.size() << " tiles"
+              << std::endl;
 
-            if (textured) {
-                mesh.texIds.push_back(mesh.faces[mesh.faces.size() - 2]);
-                mesh.texIds.push_back(mesh.faces[mesh.faces.size() - 1]);
-            }
+    TexturedMesh mesh;
+    mesh.vertices.resize(std::size_t(width) * height);
+    if (textured) {
+        mesh.uv.resize(mesh.vertices.size());
+    }
+    ProgressCounter counter(tiles.size());
+    // GDAL datasets cannot be shared between threads
+    tbb::enumerable_thread_specific<GDALDataset*> datasets(
+        [&file] { return (GDALDataset*)GDALOpen(file.c_str(), GA_ReadOnly); });
+    bool completed;
+    try {
+        completed = runWithProgress(counter, progress, [&] {
+            tbb::parallel_for(std::size_t(0), tiles.size(), [&](std::size_t ti) {
+                if (counter.cancelled()) {
+                    return;
+                }
+                GDALDataset* local = datasets.local();
+                if (local == nullptr) {
+                    throw std::runtime_error("Cannot open GeoTIFF '" + file + "'");
+                }
+                DemTile& tile = tiles[ti];
+                // one more row and column of samples to connect the tile with its neighbors
+                const uint32_t bufferWidth = std::min(tile.x1 + 1, width) - tile.x0;
+                const uint32_t bufferHeight = std::min(tile.y1 + 1, height) - tile.y0;
+                std::vector<float> buffer(std::size_t(bufferWidth) * bufferHeight);
+                // decimated read; samples of adjacent tiles are consistent thanks to floating-point windows
+                GDALRasterIOExtraArg extra;
+                INIT_RASTERIO_EXTRA_ARG(extra);
+                extra.eResampleAlg = GRIORA_NearestNeighbour;
+                extra.bFloatingPointWindowValidity = TRUE;
+                extra.dfXOff = tile.x0 * scaleX;
+                extra.dfYOff = tile.y0 * scaleY;
+                extra.dfXSize = bufferWidth * scaleX;
+                extra.dfYSize = bufferHeight * scaleY;
+                GDALRasterBand* band = getBand(local, overview);
+                const int xOff = int(std::floor(extra.dfXOff));
+                const int yOff = int(std::floor(extra.dfYOff));
+                const int xEnd = std::min(int(std::ceil(extra.dfXOff + extra.dfXSize)), band->GetXSize());
+                const int yEnd = std::min(int(std::ceil(extra.dfYOff + extra.dfYSize)), band->GetYSize());
+                CPLErr err = band->RasterIO(GF_Read,
+                    xOff,
+                    yOff,
+                    xEnd - xOff,
+                    yEnd - yOff,
+                    buffer.data(),
+                    bufferWidth,
+                    bufferHeight,
+                    GDT_Float32,
+                    0,
+                    0,
+                    &extra);
+                if (err != CE_None) {
+                    throw std::runtime_error("Error reading file '" + file + "'");
+                }
+
+                auto sample = [&](const uint32_t x, const uint32_t y) {
+                    return buffer[std::size_t(y - tile.y0) * bufferWidth + x - tile.x0];
+                };
+                for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+                    for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+                        const std::size_t index = std::size_t(y) * width + x;
+                        const float h = sample(x, y);
+                        mesh.vertices[index] = Pvl::Vec3f((x + 0.5) * bandWidth / width * pixelX,
+                            (y + 0.5) * bandHeight / height * pixelY,
+                            h);
+                        if (textured) {
+                            mesh.uv[index] = Pvl::Vec2f((x + 0.5f) / width, 1.f - (y + 0.5f) / height);
+                        }
+                        if (h != nodata) {
+                            tile.minHeight = std::min(tile.minHeight, h);
+                        }
+                        if (x + 1 == width || y + 1 == height || h == nodata || sample(x + 1, y) == nodata ||
+                            sample(x, y + 1) == nodata || sample(x + 1, y + 1) == nodata) {
+                            continue;
+                        }
+                        const uint32_t i = uint32_t(index);
+                        tile.faces.emplace_back(TexturedMesh::Face{ i + 1, i, i + width });
+                        tile.faces.emplace_back(TexturedMesh::Face{ i + 1, i + width, i + width + 1 });
+                    }
+                }
+                counter.add(1);
+            });
+        });
+    } catch (...) {
+        for (GDALDataset* local : datasets) {
+            GDALClose(local);
         }
+        throw;
+    }
+    for (GDALDataset* local : datasets) {
+        GDALClose(local);
+    }
+    if (!completed) {
+        return {};
+    }
+
+    float minHeight = std::numeric_limits<float>::max();
+    std::size_t numFaces = 0;
+    for (const DemTile& tile : tiles) {
+        minHeight = std::min(minHeight, tile.minHeight);
+        numFaces += tile.faces.size();
+    }
+    printf("Min=%.3f\n", minHeight);
+    mesh.faces.reserve(numFaces);
+    for (DemTile& tile : tiles) {
+        mesh.faces.insert(mesh.faces.end(), tile.faces.begin(), tile.faces.end());
+        tile.faces = {};
+    }
+    if (textured) {
+        mesh.texIds = mesh.faces;
     }
 
     for (std::size_t vi = 0; vi < mesh.vertices.size(); ++vi) {
         if (mesh.vertices[vi][2] == nodata) {
-            mesh.vertices[vi][2] = adfMinMax[0];
+            mesh.vertices[vi][2] = minHeight;
         }
     }
 
@@ -180,11 +295,282 @@ TexturedMesh loadDem(std::string file, const Progress& progress) {
     return mesh;
 }
 
+namespace {
+
+/// Number of samples of the grid covering size pixels with given step.
+int gridSize(const int size, const int step) {
+    return (size + step - 1) / step;
+}
+
+} // namespace
+
+DemTerrain::DemTerrain(std::string file) {
+    std::string dsmFile = getDsmFile(file);
+    if (fileExists(dsmFile)) {
+        std::cout << "Found DSM file " << dsmFile << std::endl;
+        textureFile_ = file;
+        file = dsmFile;
+    }
+    registerDrivers();
+    dataset_ = (GDALDataset*)GDALOpen(file.c_str(), GA_ReadOnly);
+    if (dataset_ == nullptr) {
+        throw std::runtime_error("Cannot open GeoTIFF '" + file + "'");
+    }
+    double geoTransform[6];
+    if (dataset_->GetGeoTransform(geoTransform) != CE_None) {
+        GDALClose(dataset_);
+        throw std::runtime_error("GeoTIFF '" + file + "' has no geotransform");
+    }
+    GDALRasterBand* band = dataset_->GetRasterBand(1);
+    bandWidth_ = band->GetXSize();
+    bandHeight_ = band->GetYSize();
+    pixelX_ = geoTransform[1];
+    pixelY_ = geoTransform[5];
+    nodata_ = float(band->GetNoDataValue());
+    if (bandWidth_ < 2 || bandHeight_ < 2) {
+        GDALClose(dataset_);
+        throw std::runtime_error("GeoTIFF '" + file + "' is too small");
+    }
+
+    // the root tile covers the whole raster
+    while (gridSize(std::max(bandWidth_, bandHeight_), step(0)) > TILE_SIZE + 1) {
+        ++levels_;
+    }
+    double minMax[2];
+    band->ComputeRasterMinMax(TRUE, minMax);
+    extents_.extend(Pvl::Vec3f(0.f, 0.f, float(minMax[0])));
+    extents_.extend(Pvl::Vec3f(bandWidth_ * pixelX_, bandHeight_ * pixelY_, float(minMax[1])));
+    srs_ = Srs(Coords(geoTransform[0], geoTransform[3], 0.));
+    std::cout << "Terrain " << bandWidth_ << "x" << bandHeight_ << " with " << levels_ << " levels"
+              << std::endl;
+}
+
+DemTerrain::~DemTerrain() {
+    GDALClose(dataset_);
+}
+
+float DemTerrain::error(const int level) const {
+    return step(level) * float(std::max(std::abs(pixelX_), std::abs(pixelY_)));
+}
+
+bool DemTerrain::exists(const TerrainTileId& id) const {
+    // tile must have at least one cell, i.e. samples beyond the first one
+    const int gridWidth = gridSize(bandWidth_, step(id.level));
+    const int gridHeight = gridSize(bandHeight_, step(id.level));
+    return id.x * TILE_SIZE < std::max(gridWidth - 1, 1) && id.y * TILE_SIZE < std::max(gridHeight - 1, 1);
+}
+
+std::vector<TerrainTileId> DemTerrain::children(const TerrainTileId& id) const {
+    std::vector<TerrainTileId> children;
+    if (id.level + 1 >= levels_) {
+        return children;
+    }
+    for (int y = 2 * id.y; y <= 2 * id.y + 1; ++y) {
+        for (int x = 2 * id.x; x <= 2 * id.x + 1; ++x) {
+            TerrainTileId child{ id.level + 1, x, y };
+            if (exists(child)) {
+                children.push_back(child);
+            }
+        }
+    }
+    return children;
+}
+
+TexturedMesh DemTerrain::loadTile(const TerrainTileId& id) const {
+    const int step = this->step(id.level);
+    const int gridWidth = gridSize(bandWidth_, step);
+    const int gridHeight = gridSize(bandHeight_, step);
+    // samples on the borders are shared with the neighboring tiles of the same level
+    const int x0 = id.x * TILE_SIZE;
+    const int y0 = id.y * TILE_SIZE;
+    const int numX = std::min(x0 + TILE_SIZE, gridWidth - 1) - x0 + 1;
+    const int numY = std::min(y0 + TILE_SIZE, gridHeight - 1) - y0 + 1;
+    // raster pixel of the sample, clamped to the last pixel
+    auto pixel = [step](const int s, const int size) { return std::min(s * step + step / 2, size - 1); };
+
+    const int overview = selectOverview(dataset_->GetRasterBand(1), gridWidth, gridHeight);
+    GDALRasterBand* band = getBand(dataset_, overview);
+    const double scaleX = double(band->GetXSize()) / bandWidth_;
+    const double scaleY = double(band->GetYSize()) / bandHeight_;
+    // Floating-point window of count samples starting at sample s, beginning half a sample before the center
+    // of pixel(s). The sample centers then fall on the centers of pixels pixel(s + k), so the samples do not
+    // depend on the tile and neighbors share their borders. The last sample of the grid can be clamped, it is
+    // read as a single pixel instead.
+    struct Window {
+        double offset;
+        double size;
+    };
+    auto window = [step, &pixel](const int s, const int count, const int size, const double scale) {
+        const double offset = pixel(s, size) + 0.5 - 0.5 * step;
+        if (offset + count * step <= size) {
+            return Window{ offset * scale, count * step * scale };
+        }
+        return Window{ std::floor((pixel(s, size) + 0.5) * scale), 1. };
+    };
+    std::vector<float> buffer(std::size_t(numX) * numY);
+    // reads samples [x, x + countX) x [y, y + countY) of the tile into the buffer
+    auto read = [&](const int x, const int countX, const int y, const int countY) {
+        if (countX == 0 || countY == 0) {
+            return;
+        }
+        const Window wx = window(x0 + x, countX, bandWidth_, scaleX);
+        const Window wy = window(y0 + y, countY, bandHeight_, scaleY);
+        GDALRasterIOExtraArg extra;
+        INIT_RASTERIO_EXTRA_ARG(extra);
+        extra.eResampleAlg = GRIORA_NearestNeighbour;
+        extra.bFloatingPointWindowValidity = TRUE;
+        extra.dfXOff = wx.offset;
+        extra.dfYOff = wy.offset;
+        extra.dfXSize = wx.size;
+        extra.dfYSize = wy.size;
+        const int xOff = int(std::floor(extra.dfXOff));
+        const int yOff = int(std::floor(extra.dfYOff));
+        const int xEnd = std::min(int(std::ceil(extra.dfXOff + extra.dfXSize)), band->GetXSize());
+        const int yEnd = std::min(int(std::ceil(extra.dfYOff + extra.dfYSize)), band->GetYSize());
+        CPLErr err = band->RasterIO(GF_Read,
+            xOff,
+            yOff,
+            xEnd - xOff,
+            yEnd - yOff,
+            buffer.data() + std::size_t(y) * numX + x,
+            countX,
+            countY,
+            GDT_Float32,
+            0,
+            numX * sizeof(float),
+            &extra);
+        if (err != CE_None) {
+            throw std::runtime_error("Error reading terrain tile");
+        }
+    };
+    // only the last column and row of the grid can be clamped
+    const int innerX = numX - int(x0 + numX == gridWidth);
+    const int innerY = numY - int(y0 + numY == gridHeight);
+    read(0, innerX, 0, innerY);
+    if (innerX < numX) {
+        read(innerX, 1, 0, innerY);
+    }
+    if (innerY < numY) {
+        read(0, innerX, innerY, 1);
+    }
+    if (innerX < numX && innerY < numY) {
+        read(innerX, 1, innerY, 1);
+    }
+
+    float minHeight = std::numeric_limits<float>::max();
+    float maxHeight = std::numeric_limits<float>::lowest();
+    for (const float h : buffer) {
+        if (h != nodata_) {
+            minHeight = std::min(minHeight, h);
+            maxHeight = std::max(maxHeight, h);
+        }
+    }
+    TexturedMesh mesh;
+    mesh.srs = srs_;
+    if (minHeight > maxHeight) {
+        // no data in the tile
+        return mesh;
+    }
+    const bool textured = !textureFile_.empty();
+    const std::size_t numSamples = buffer.size();
+    const std::size_t numSkirts = 2 * (numX + numY);
+    mesh.vertices.reserve(numSamples + numSkirts);
+    if (textured) {
+        mesh.uv.reserve(numSamples + numSkirts);
+    }
+    for (int y = 0; y < numY; ++y) {
+        for (int x = 0; x < numX; ++x) {
+            const int px = pixel(x0 + x, bandWidth_);
+            const int py = pixel(y0 + y, bandHeight_);
+            const float h = buffer[std::size_t(y) * numX + x];
+            mesh.vertices.emplace_back(
+                (px + 0.5) * pixelX_, (py + 0.5) * pixelY_, h != nodata_ ? h : minHeight);
+            if (textured) {
+                mesh.uv.emplace_back((px + 0.5f) / bandWidth_, 1.f - (py + 0.5f) / bandHeight_);
+            }
+        }
+    }
+    auto valid = [&buffer, this](const uint32_t i) { return buffer[i] != nodata_; };
+    for (int y = 0; y < numY - 1; ++y) {
+        for (int x = 0; x < numX - 1; ++x) {
+            const uint32_t i = uint32_t(y * numX + x);
+            if (!valid(i) || !valid(i + 1) || !valid(i + numX) || !valid(i + numX + 1)) {
+                continue;
+            }
+            mesh.faces.emplace_back(TexturedMesh::Face{ i + 1, i, i + numX });
+            mesh.faces.emplace_back(TexturedMesh::Face{ i + 1, i + numX, i + numX + 1 });
+        }
+    }
+
+    // skirts hanging down from the borders, deep enough to cover the height differences to the neighbors
+    const float depth = std::max(maxHeight - minHeight, error(id.level));
+    auto addSkirt = [&](const uint32_t first, const uint32_t count, const uint32_t stride) {
+        const uint32_t lowered = uint32_t(mesh.vertices.size());
+        for (uint32_t k = 0; k < count; ++k) {
+            const uint32_t i = first + k * stride;
+            mesh.vertices.push_back(mesh.vertices[i] - Pvl::Vec3f(0.f, 0.f, depth));
+            if (textured) {
+                mesh.uv.push_back(mesh.uv[i]);
+            }
+        }
+        for (uint32_t k = 0; k + 1 < count; ++k) {
+            const uint32_t i = first + k * stride;
+            if (!valid(i) || !valid(i + stride)) {
+                continue;
+            }
+            mesh.faces.emplace_back(TexturedMesh::Face{ i, lowered + k, i + stride });
+            mesh.faces.emplace_back(TexturedMesh::Face{ i + stride, lowered + k, lowered + k + 1 });
+        }
+    };
+    addSkirt(0, numX, 1);
+    addSkirt(uint32_t((numY - 1) * numX), numX, 1);
+    addSkirt(0, numY, numX);
+    addSkirt(uint32_t(numX - 1), numY, numX);
+    if (textured) {
+        mesh.texIds = mesh.faces;
+    }
+    return mesh;
+}
+
+std::unique_ptr<ITexture> DemTerrain::loadTexture() const {
+    if (textureFile_.empty()) {
+        return nullptr;
+    }
+    return makeTexture(textureFile_.c_str());
+}
+
 #else
 TexturedMesh loadDem(std::string, const Progress&) {
     throw std::runtime_error(
         "MPCV not linked with GDAL, please recompile with WITH_GDAL=ON");
 }
+
+DemTerrain::DemTerrain(std::string) {
+    throw std::runtime_error(
+        "MPCV not linked with GDAL, please recompile with WITH_GDAL=ON");
+}
+
+DemTerrain::~DemTerrain() = default;
+
+float DemTerrain::error(int) const {
+    return 0.f;
+}
+
+bool DemTerrain::exists(const TerrainTileId&) const {
+    return false;
+}
+
+std::vector<TerrainTileId> DemTerrain::children(const TerrainTileId&) const {
+    return {};
+}
+
+TexturedMesh DemTerrain::loadTile(const TerrainTileId&) const {
+    return {};
+}
+
+std::unique_ptr<ITexture> DemTerrain::loadTexture() const {
+    return nullptr;
+}
 #endif
 
 
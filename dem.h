@@ -1,9 +1,87 @@
 #pragma once
 
 #include "mesh.h"
+#include "pvl/Box.hpp"
+#include <tuple>
+
+class GDALDataset;
 
 namespace Mpcv {
 
 TexturedMesh loadDem(std::string file, const Progress& prog);
 
-}
+/// Tile of the terrain quadtree. Level 0 is a single tile covering the whole raster, each level doubles the
+/// resolution of the previous one.
+struct TerrainTileId {
+    int level = 0;
+    int x = 0;
+    int y = 0;
+
+    bool operator<(const TerrainTileId& other) const {
+        return std::tie(level, x, y) < std::tie(other.level, other.x, other.y);
+    }
+};
+
+/// \brief DEM kept open to load the tiles of the terrain on demand.
+///
+/// All tiles have the same number of samples, read from the coarsest overview that still has the resolution
+/// of the level. Tiles have skirts along their borders to hide the cracks between tiles of different levels.
+class DemTerrain {
+    GDALDataset* dataset_ = nullptr;
+    std::string textureFile_;
+    int bandWidth_ = 0;
+    int bandHeight_ = 0;
+    double pixelX_ = 1.;
+    double pixelY_ = 1.;
+    float nodata_ = 0.f;
+    int levels_ = 1;
+    Srs srs_;
+    Pvl::Box3f extents_;
+
+public:
+    /// Number of cells in each dimension of a tile
+    static constexpr int TILE_SIZE = 64;
+
+    explicit DemTerrain(std::string file);
+
+    DemTerrain(const DemTerrain&) = delete;
+
+    DemTerrain& operator=(const DemTerrain&) = delete;
+
+    ~DemTerrain();
+
+    const Srs& srs() const {
+        return srs_;
+    }
+
+    /// Extents of the terrain in local coordinates.
+    const Pvl::Box3f& extents() const {
+        return extents_;
+    }
+
+    int levels() const {
+        return levels_;
+    }
+
+    /// Distance between the samples of tiles at given level, in local units.
+    float error(int level) const;
+
+    /// Returns the tiles of the next level covering the given tile.
+    std::vector<TerrainTileId> children(const TerrainTileId& id) const;
+
+    /// Reads the tile from the raster; not thread-safe.
+    TexturedMesh loadTile(const TerrainTileId& id) const;
+
+    /// Loads the orthophoto draped over the terrain, or returns nullptr if there is none.
+    std::unique_ptr<ITexture> loadTexture() const;
+
+private:
+    /// Number of raster pixels per sample at given level
+    int step(int level) const {
+        return 1 << (levels_ - 1 - level);
+    }
+
+    bool exists(const TerrainTileId& id) const;
+};
+
+} // namespace Mpcv
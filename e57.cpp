@@ -1,67 +1,299 @@
 #include "e57.h"
 #include "E57SimpleReader.h"
+#include "parallel.h"
+#include "parameters.h"
+#include <algorithm>
 #include <iostream>
+#include <tbb/tbb.h>
 
 namespace Mpcv {
 
-TexturedMesh loadE57(std::string file, const Progress& prog) {
-    e57::Reader reader(file);
-    int scanIndex = 0;
-    e57::Data3D scanHeader;
-    reader.ReadData3D(scanIndex, scanHeader);
-    const auto& tr = scanHeader.pose.translation;
-    std::cout << "Translation = " << tr.x << "," << tr.y << "," << tr.z << std::endl;
-
-    int64_t column = 0;
-    int64_t row = 0;
-    int64_t pointsSize = 0;
-    int64_t groupsSize = 0;
-    int64_t countsSize = 0;
-    bool columnIndex;
-    reader.GetData3DSizes(scanIndex, row, column, pointsSize, groupsSize, countsSize, columnIndex);
-    std::cout << "Loading E57 with " << pointsSize << " points" << std::endl;
-    int64_t rowSize = (row > 0) ? row : 1024;
-
-    std::vector<float> x(rowSize), y(rowSize), z(rowSize);
-    std::vector<uint8_t> r(rowSize), g(rowSize), b(rowSize);
+namespace {
+
+/// Scan read into its range of the presized mesh arrays.
+struct E57Scan {
+    int64_t index = 0;
+    int64_t numPoints = 0;
+    e57::RigidBody pose;
+    bool spherical = false;
+    bool hasInvalidState = false;
+    bool hasColors = false;
+    bool hasIntensity = false;
+
+    ///< First point of the scan in the mesh arrays
+    std::size_t first = 0;
+
+    ///< Number of valid points stored from the first index
+    std::size_t numStored = 0;
+};
+
+/// Rotates the vector by the (possibly unnormalized) quaternion.
+Coords rotate(const e57::Quaternion& q, const Coords& v) {
+    const double n = std::sqrt(q.w * q.w + q.x * q.x + q.y * q.y + q.z * q.z);
+    if (n == 0.) {
+        // missing pose
+        return v;
+    }
+    const Coords u(q.x / n, q.y / n, q.z / n);
+    const double w = q.w / n;
+    auto cross = [](const Coords& a, const Coords& b) {
+        return Coords(a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0]);
+    };
+    const Coords t = cross(u, v) * 2.;
+    return v + t * w + cross(u, t);
+}
+
+/// Buffers of a single block of points read from the file.
+struct E57Block {
+    std::vector<float> x, y, z;
+    std::vector<int8_t> invalid;
+    std::vector<uint8_t> r, g, b;
+    std::vector<float> intensity;
     e57::Data3DPointsData data;
-    data.cartesianX = x.data();
-    data.cartesianY = y.data();
-    data.cartesianZ = z.data();
-    data.colorRed = r.data();
-    data.colorGreen = g.data();
-    data.colorBlue = b.data();
-
-    e57::CompressedVectorReader dataReader = reader.SetUpData3DPointsData(scanIndex, rowSize, data);
-
-    int step = std::max(int(pointsSize / 100), 100);
-    std::size_t nextProg = step;
-    float iToProg = 100.f / pointsSize;
-    TexturedMesh mesh;
+
+    E57Block(const E57Scan& scan, const std::size_t size)
+        : x(size)
+        , y(size)
+        , z(size) {
+        // spherical coordinates are read into the same buffers as (range, azimuth, elevation)
+        if (scan.spherical) {
+            data.sphericalRange = x.data();
+            data.sphericalAzimuth = y.data();
+            data.sphericalElevation = z.data();
+        } else {
+            data.cartesianX = x.data();
+            data.cartesianY = y.data();
+            data.cartesianZ = z.data();
+        }
+        if (scan.hasInvalidState) {
+            invalid.resize(size);
+            if (scan.spherical) {
+                data.sphericalInvalidState = invalid.data();
+            } else {
+                data.cartesianInvalidState = invalid.data();
+            }
+        }
+        if (scan.hasColors) {
+            r.resize(size);
+            g.resize(size);
+            b.resize(size);
+            data.colorRed = r.data();
+            data.colorGreen = g.data();
+            data.colorBlue = b.data();
+        }
+        if (scan.hasIntensity) {
+            intensity.resize(size);
+            data.intensity = intensity.data();
+        }
+    }
+};
+
+/// Decodes all points of the scan and stores the valid ones, transformed into the local coordinates of the
+/// mesh, into the range of the scan.
+void readScan(e57::Reader& reader,
+    E57Scan& scan,
+    TexturedMesh& mesh,
+    std::vector<float>* intensity,
+    ProgressCounter& counter) {
+    const std::size_t blockSize = std::max(Parameters::global().e57BlockSize, 1);
+    E57Block block(scan, std::size_t(std::min(int64_t(blockSize), std::max(scan.numPoints, int64_t(1)))));
+    const Coords translation(scan.pose.translation.x, scan.pose.translation.y, scan.pose.translation.z);
+
+    e57::CompressedVectorReader dataReader =
+        reader.SetUpData3DPointsData(scan.index, block.x.size(), block.data);
     std::size_t size = 0;
-    std::size_t index = 0;
-    std::size_t nanCnt = 0;
+    std::size_t numRead = 0;
     while ((size = dataReader.read()) > 0) {
+        numRead += size;
+        if (numRead > std::size_t(scan.numPoints)) {
+            throw std::runtime_error("Scan " + std::to_string(scan.index) + " has more points than declared");
+        }
+        // valid points are written consecutively; the gaps left by invalid points are removed after all
+        // scans are loaded
+        std::size_t dst = scan.first + scan.numStored;
         for (std::size_t i = 0; i < size; i++) {
-            if (index == nextProg) {
-                if (prog(index * iToProg)) {
-                    return {};
-                }
-                nextProg += step;
-            }
-            ++index;
-            if (!std::isfinite(x[i]) || !std::isfinite(y[i]) || !std::isfinite(z[i])) {
-                nanCnt++;
+            if ((scan.hasInvalidState && block.invalid[i] != 0) || !std::isfinite(block.x[i]) ||
+                !std::isfinite(block.y[i]) || !std::isfinite(block.z[i])) {
                 continue;
             }
-            mesh.vertices.push_back(Pvl::Vec3f(x[i], y[i], z[i]));
-            mesh.colors.push_back(Color(r[i], g[i], b[i]));
+            Coords p;
+            if (scan.spherical) {
+                const double range = block.x[i];
+                const double azimuth = block.y[i];
+                const double elevation = block.z[i];
+                p = Coords(range * std::cos(elevation) * std::cos(azimuth),
+                    range * std::cos(elevation) * std::sin(azimuth),
+                    range * std::sin(elevation));
+            } else {
+                p = Coords(block.x[i], block.y[i], block.z[i]);
+            }
+            mesh.vertices[dst] = vec3f(mesh.srs.worldToLocal(rotate(scan.pose.rotation, p) + translation));
+            if (scan.hasColors) {
+                mesh.colors[dst] = Color(block.r[i], block.g[i], block.b[i]);
+            }
+            if (scan.hasIntensity) {
+                (*intensity)[dst] = block.intensity[i];
+            }
+            ++dst;
+        }
+        scan.numStored = dst - scan.first;
+        counter.add(size);
+        if (counter.cancelled()) {
+            break;
         }
     }
-    std::cout << "Ignoring " << nanCnt << " NaN points" << std::endl;
-    mesh.srs = Srs(Coords(tr.x, tr.y, tr.z));
-
     dataReader.close();
+}
+
+} // namespace
+
+TexturedMesh loadE57(std::string file, const Progress& prog) {
+    e57::Reader reader(file);
+    const Parameters& globals = Parameters::global();
+    std::vector<int64_t> indices;
+    const int64_t numScans = reader.GetData3DCount();
+    if (globals.scans.empty()) {
+        for (int64_t i = 0; i < numScans; ++i) {
+            indices.push_back(i);
+        }
+    } else {
+        for (int i : globals.scans) {
+            if (i < numScans) {
+                indices.push_back(i);
+            } else {
+                std::cout << "File has only " << numScans << " scans, skipping scan " << i << std::endl;
+            }
+        }
+    }
+
+    std::vector<E57Scan> scans;
+    std::size_t totalPoints = 0;
+    Coords center(0.);
+    for (int64_t scanIndex : indices) {
+        // E57 holds terrestrial or mobile scans, so the whole file is street data, unless the subset rule
+        // selects scans by their index
+        const bool byScan = globals.subsetRule.attribute == SubsetRule::Attribute::POINT_SOURCE;
+        if (!selects(globals.subset, !byScan || globals.subsetRule.isStreet(scanIndex))) {
+            std::cout << "Scan " << scanIndex << " is not in the selected subset, skipping" << std::endl;
+            continue;
+        }
+        e57::Data3D scanHeader;
+        reader.ReadData3D(scanIndex, scanHeader);
+        int64_t column = 0;
+        int64_t row = 0;
+        int64_t pointsSize = 0;
+        int64_t groupsSize = 0;
+        int64_t countsSize = 0;
+        bool columnIndex;
+        reader.GetData3DSizes(scanIndex, row, column, pointsSize, groupsSize, countsSize, columnIndex);
+
+        const e57::PointStandardizedFieldsAvailable& fields = scanHeader.pointFields;
+        if (!fields.cartesianXField && !fields.sphericalRangeField) {
+            std::cout << "Scan " << scanIndex << " has no coordinates, skipping" << std::endl;
+            continue;
+        }
+        E57Scan scan;
+        scan.index = scanIndex;
+        scan.numPoints = pointsSize;
+        scan.first = totalPoints;
+        scan.pose = scanHeader.pose;
+        scan.spherical = !fields.cartesianXField && fields.sphericalRangeField;
+        scan.hasInvalidState =
+            scan.spherical ? fields.sphericalInvalidStateField : fields.cartesianInvalidStateField;
+        scan.hasColors = globals.loads(PointAttribute::COLOR) && fields.colorRedField;
+        scan.hasIntensity = globals.loads(PointAttribute::SCALAR) && fields.intensityField;
+        const auto& tr = scan.pose.translation;
+        center = center + Coords(tr.x, tr.y, tr.z);
+        totalPoints += pointsSize;
+        scans.push_back(std::move(scan));
+    }
+    reader.Close();
+    if (scans.empty()) {
+        return {};
+    }
+    center = center / double(scans.size());
+    std::cout << "Loading E57 with " << scans.size() << " scans and " << totalPoints << " points"
+              << std::endl;
+
+    // scans share a common SRS, centered at the mean scanner position
+    TexturedMesh mesh;
+    mesh.srs = Srs(center);
+    const bool hasColors =
+        std::any_of(scans.begin(), scans.end(), [](const E57Scan& s) { return s.hasColors; });
+    const bool hasIntensity =
+        std::any_of(scans.begin(), scans.end(), [](const E57Scan& s) { return s.hasIntensity; });
+    // presized for all points, scans without colors or intensity among other scans get the default values
+    mesh.vertices.resize(totalPoints);
+    if (hasColors) {
+        mesh.colors.resize(totalPoints, Color(128, 128, 128));
+    }
+    std::vector<float>* intensity = nullptr;
+    if (hasIntensity) {
+        intensity = &mesh.scalars["intensity"];
+        intensity->resize(totalPoints, 0.f);
+    }
+
+    ProgressCounter counter(std::max(totalPoints, std::size_t(1)));
+    // libE57Format is not thread-safe, each worker takes its own reader from the pool; readers are opened
+    // here, as opening them concurrently is not safe either (initialization of Xerces)
+    const std::size_t numReaders =
+        std::min(std::size_t(tbb::this_task_arena::max_concurrency()), scans.size());
+    std::vector<std::unique_ptr<e57::Reader>> readers;
+    tbb::concurrent_bounded_queue<e57::Reader*> pool;
+    for (std::size_t i = 0; i < numReaders; ++i) {
+        readers.push_back(std::make_unique<e57::Reader>(file));
+        pool.push(readers.back().get());
+    }
+    const bool completed = runWithProgress(counter, prog, [&] {
+        tbb::parallel_for(std::size_t(0), scans.size(), [&](std::size_t si) {
+            if (counter.cancelled()) {
+                return;
+            }
+            e57::Reader* scanReader;
+            pool.pop(scanReader);
+            try {
+                readScan(*scanReader, scans[si], mesh, intensity, counter);
+            } catch (...) {
+                pool.push(scanReader);
+                throw;
+            }
+            pool.push(scanReader);
+        });
+    });
+    if (!completed) {
+        return {};
+    }
+
+    // remove the gaps left by invalid points, moving whole scan ranges
+    std::size_t numStored = 0;
+    for (const E57Scan& scan : scans) {
+        if (scan.first != numStored) {
+            auto move = [&scan, numStored](auto& values) {
+                std::move(values.begin() + scan.first,
+                    values.begin() + scan.first + scan.numStored,
+                    values.begin() + numStored);
+            };
+            move(mesh.vertices);
+            if (hasColors) {
+                move(mesh.colors);
+            }
+            if (hasIntensity) {
+                move(*intensity);
+            }
+        }
+        numStored += scan.numStored;
+    }
+    std::cout << "Ignoring " << totalPoints - numStored << " invalid points" << std::endl;
+    mesh.vertices.resize(numStored);
+    mesh.vertices.shrink_to_fit();
+    if (hasColors) {
+        mesh.colors.resize(numStored);
+        mesh.colors.shrink_to_fit();
+    }
+    if (hasIntensity) {
+        intensity->resize(numStored);
+        intensity->shrink_to_fit();
+    }
     return mesh;
 }
 
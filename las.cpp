@@ -1,16 +1,278 @@
 #include "las.h"
+#include "lasindex.hpp"
+#include "lasquadtree.hpp"
 #include "lasreader.hpp"
 #include "json11.hpp"
+#include "parallel.h"
 #include "parameters.h"
+#include <cmath>
+#include <fstream>
 #include <iostream>
+#include <tbb/tbb.h>
 
 namespace Mpcv {
 
-TexturedMesh loadLas(std::string file, const Progress& prog) {
+namespace {
+
+/// Points decoded from a contiguous range of the file.
+struct LasBlock {
+    I64 first = 0;
+    I64 count = 0;
+    I64 numRead = 0;
+    std::vector<Pvl::Vec3f> vertices;
+    std::vector<Color> colors;
+    std::vector<uint8_t> classes;
+    std::vector<double> times;
+    bool hasColors = false;
+};
+
+/// Point attributes stored in the mesh, besides the positions.
+struct LasChannels {
+    bool colors;
+    bool classes;
+    bool times;
+};
+
+/// Copies the points added to the block since the last batch.
+TexturedMesh partialCopy(const LasBlock& block,
+    const std::size_t from,
+    const Srs& srs,
+    const std::map<int, Color>& classToColor) {
+    TexturedMesh part;
+    part.srs = srs;
+    part.classToColor = classToColor;
+    part.vertices.assign(block.vertices.begin() + from, block.vertices.end());
+    if (!block.classes.empty()) {
+        part.classes.assign(block.classes.begin() + from, block.classes.end());
+    }
+    if (block.hasColors) {
+        part.colors.assign(block.colors.begin() + from, block.colors.end());
+    }
+    return part;
+}
+
+/// Selects the points read from the file according to the point stride.
+class LasSampler {
+public:
+    enum class Mode {
+        SEQUENTIAL,   ///< Reads all points, keeps every n-th
+        SEEK,         ///< Seeks directly to every n-th point
+        CHUNK_PREFIX, ///< Reads first 1/n points of each chunk, or a single point of every few chunks
+    };
+
+private:
+    Mode mode_;
+    I64 stride_;
+    I64 chunkSize_;
+    I64 prefix_;
+    I64 chunkStep_;
+
+public:
+    LasSampler(const Mode mode, const I64 stride, const I64 chunkSize = 0)
+        : mode_(mode)
+        , stride_(stride)
+        , chunkSize_(chunkSize) {
+        if (mode_ == Mode::CHUNK_PREFIX) {
+            prefix_ = std::max(chunkSize_ / stride_, I64(1));
+            chunkStep_ = std::max(stride_ / chunkSize_, I64(1));
+        }
+    }
+
+    /// Returns the index of the first point read at or after the given index.
+    I64 first(const I64 index) const {
+        switch (mode_) {
+        case Mode::SEEK:
+            return roundUp(index, stride_);
+        case Mode::CHUNK_PREFIX:
+            return roundUp(index, chunkSize_ * chunkStep_);
+        default:
+            return index;
+        }
+    }
+
+    /// Returns the index of the point read after the given point.
+    I64 next(const I64 index) const {
+        switch (mode_) {
+        case Mode::SEEK:
+            return index + stride_;
+        case Mode::CHUNK_PREFIX: {
+            const I64 offset = index % chunkSize_;
+            return offset + 1 < prefix_ ? index + 1 : index - offset + chunkSize_ * chunkStep_;
+        }
+        default:
+            return index + 1;
+        }
+    }
+
+    /// Returns true if the read point is stored in the mesh.
+    bool accept(const I64 index) const {
+        return mode_ != Mode::SEQUENTIAL || index % stride_ == 0;
+    }
+
+private:
+    static I64 roundUp(const I64 index, const I64 step) {
+        return (index + step - 1) / step * step;
+    }
+};
+
+/// Returns true if the point belongs to the subset selected by the global parameters.
+bool inSubset(const LASpoint& p, const Parameters& globals) {
+    if (globals.subset == CloudSubset::ALL) {
+        return true;
+    }
+    switch (globals.subsetRule.attribute) {
+    case SubsetRule::Attribute::SCAN_ANGLE:
+        return selects(globals.subset, globals.subsetRule.isStreet(std::abs(p.get_scan_angle())));
+    case SubsetRule::Attribute::POINT_SOURCE:
+        return selects(globals.subset, globals.subsetRule.isStreet(p.get_point_source_ID()));
+    case SubsetRule::Attribute::CLASS:
+        return selects(globals.subset, globals.subsetRule.isStreet(p.get_classification()));
+    default:
+        return true;
+    }
+}
+
+/// Decodes the points of the block selected by the sampler. If the reader uses a spatial index, points
+/// outside of the queried cells are skipped without decoding.
+void readBlock(LASreader& reader,
+    LasBlock& block,
+    const LasSampler& sampler,
+    const LasChannels& channels,
+    const TexturedMesh& mesh,
+    ProgressCounter& counter,
+    const PartialResult& partial) {
+    const Parameters& globals = Parameters::global();
+    const std::size_t capacity = std::size_t(block.count / globals.pointStride + 1);
+    block.vertices.reserve(capacity);
+    if (channels.colors) {
+        block.colors.reserve(capacity);
+    }
+    if (channels.classes) {
+        block.classes.reserve(capacity);
+    }
+    if (channels.times) {
+        block.times.reserve(capacity);
+    }
+    const I64 progressStep = 1 << 16;
+    const std::size_t batchSize = 2000000;
+    std::size_t batchStart = 0;
+    const I64 end = block.first + block.count;
+    // progress is measured by the position in the file, as the index and the sampler may skip points
+    I64 reported = 0;
+    for (I64 position = sampler.first(block.first); position < end;) {
+        if (reader.p_count != position && !reader.seek(position)) {
+            throw std::runtime_error("Cannot seek to point " + std::to_string(position));
+        }
+        if (!reader.read_point()) {
+            break;
+        }
+        const LASpoint& p = reader.point;
+        const I64 index = reader.p_count - 1;
+        position = sampler.next(index);
+        Coords coords(p.get_x(), p.get_y(), p.get_z());
+        if (sampler.accept(index) && globals.extents.contains(coords) && inSubset(p, globals)) {
+            block.vertices.push_back(vec3f(mesh.srs.worldToLocal(coords)));
+            if (channels.colors) {
+                Color color(p.get_R() >> 8, p.get_G() >> 8, p.get_B() >> 8);
+                block.colors.push_back(color);
+                block.hasColors |= (color != Color(0, 0, 0));
+            }
+            if (channels.classes) {
+                block.classes.push_back(p.get_classification());
+            }
+            if (channels.times) {
+                block.times.push_back(p.get_gps_time());
+            }
+        }
+
+        block.numRead++;
+        if (block.numRead % progressStep == 0) {
+            const I64 done = std::min(position, end) - block.first;
+            counter.add(done - reported);
+            reported = done;
+            if (counter.cancelled()) {
+                return;
+            }
+        }
+        if (partial && block.vertices.size() >= batchStart + batchSize) {
+            partial(partialCopy(block, batchStart, mesh.srs, mesh.classToColor));
+            batchStart = block.vertices.size();
+        }
+    }
+    counter.add(block.count - reported);
+    if (partial && block.vertices.size() > batchStart) {
+        partial(partialCopy(block, batchStart, mesh.srs, mesh.classToColor));
+    }
+}
+
+/// Returns the number of points that can be read independently of other points in the file, or 0 if
+/// the file can only be read sequentially.
+I64 independentChunkSize(const LASheader& header) {
+    if (!header.laszip) {
+        // uncompressed, can seek to any point
+        return 1 << 20;
+    }
+    if (header.laszip->compressor == LASZIP_COMPRESSOR_POINTWISE || header.laszip->chunk_size == U32_MAX) {
+        // not chunked or variable-sized chunks
+        return 0;
+    }
+    return header.laszip->chunk_size;
+}
+
+LASreader* openReader(const std::string& file) {
     LASreadOpener lasreadopener;
     lasreadopener.set_file_name(file.c_str());
     // lasreadopener.set_auto_reoffset(true);
     LASreader* lasreader = lasreadopener.open();
+    if (!lasreader) {
+        throw std::runtime_error("Cannot open file '" + file + "'");
+    }
+    return lasreader;
+}
+
+void closeReader(LASreader* lasreader) {
+    lasreader->close();
+    delete lasreader;
+}
+
+/// Returns the sampler reading the points selected by the global point stride and stride mode.
+LasSampler makeSampler(const LASheader& header, const bool indexed) {
+    const Parameters& globals = Parameters::global();
+    const I64 stride = globals.pointStride;
+    // seeking to individual records only pays off once the skipped records exceed the read-ahead buffer
+    const I64 minSeekStride = 16;
+    if (stride == 1 || indexed) {
+        // cannot seek without losing the position in the index
+        return LasSampler(LasSampler::Mode::SEQUENTIAL, stride);
+    } else if (!header.laszip) {
+        const LasSampler::Mode mode =
+            stride >= minSeekStride ? LasSampler::Mode::SEEK : LasSampler::Mode::SEQUENTIAL;
+        return LasSampler(mode, stride);
+    } else if (globals.strideMode == StrideMode::APPROXIMATE && independentChunkSize(header) > 0) {
+        return LasSampler(LasSampler::Mode::CHUNK_PREFIX, stride, independentChunkSize(header));
+    } else {
+        // compressed points can only be read sequentially within a chunk
+        return LasSampler(LasSampler::Mode::SEQUENTIAL, stride);
+    }
+}
+
+/// Returns true if the extents restrict the horizontal range of the loaded points.
+bool hasHorizontalExtents(const Pvl::BoundingBox<Coords>& extents) {
+    return extents.lower()[0] > std::numeric_limits<double>::lowest() ||
+           extents.lower()[1] > std::numeric_limits<double>::lowest() ||
+           extents.upper()[0] < std::numeric_limits<double>::max() ||
+           extents.upper()[1] < std::numeric_limits<double>::max();
+}
+
+/// Returns the path of the spatial index, LASlib looks for the file with the same name and .lax extension.
+std::string indexPath(const std::string& file) {
+    return file.substr(0, file.find_last_of('.')) + ".lax";
+}
+
+} // namespace
+
+TexturedMesh loadLas(std::string file, const Progress& prog, const PartialResult& partial) {
+    LASreader* lasreader = openReader(file);
     std::cout << "LAS has " << lasreader->npoints << " points" << std::endl;
     TexturedMesh mesh;
     LASheader& header = lasreader->header;
@@ -19,10 +281,9 @@ TexturedMesh loadLas(std::string file, const Progress& prog) {
     Parameters& globals = Parameters::global();
     if (!Pvl::overlaps(extents, globals.extents)) {
         std::cout << "File '" << file << "' does not overlap specified extents, skipping" << std::endl;
-        delete lasreader;
+        closeReader(lasreader);
         return {};
     }
-    int stride = globals.pointStride;
 
     // to local coordinates
     Coords center = extents.center();
@@ -54,37 +315,121 @@ TexturedMesh loadLas(std::string file, const Progress& prog) {
         }
     }
 
-    int i = 0;
-    int step = std::max(lasreader->npoints / 100, I64(100));
-    int nextProg = step;
-    float iToProg = 100.f / lasreader->npoints;
-    mesh.vertices.reserve(lasreader->npoints);
-    mesh.colors.reserve(lasreader->npoints);
-    mesh.classes.reserve(lasreader->npoints);
-    mesh.times.reserve(lasreader->npoints);
-    bool hasColors = false;
-    while (lasreader->read_point()) {
-        const LASpoint& p = lasreader->point;
-        Coords coords(p.get_x(), p.get_y(), p.get_z());
-        Coords local = mesh.srs.worldToLocal(coords);
-
-        Color color(p.get_R() >> 8, p.get_G() >> 8, p.get_B() >> 8);
-        if ((i % stride == 0) && globals.extents.contains(coords)) {
-            mesh.vertices.push_back(vec3f(local));
-            mesh.colors.push_back(color);
-            mesh.classes.push_back(p.get_classification());
-            mesh.times.push_back(p.get_gps_time());
+    // LAZ files are compressed in chunks (usually 50k points) that can be decoded independently, so the
+    // file is split into blocks of whole chunks, each decoded by a separate reader
+    const I64 numPoints = lasreader->npoints;
+    const I64 chunkSize = independentChunkSize(header);
+    const I64 numThreads = tbb::this_task_arena::max_concurrency();
+    std::vector<LasBlock> blocks;
+    // with a spatial index, only the quadtree cells overlapping the extents are read
+    const bool indexed = hasHorizontalExtents(globals.extents) && lasreader->get_index();
+    if (indexed) {
+        std::cout << "Using spatial index" << std::endl;
+        lasreader->inside_rectangle(globals.extents.lower()[0],
+            globals.extents.lower()[1],
+            globals.extents.upper()[0],
+            globals.extents.upper()[1]);
+    }
+    const LasSampler sampler = makeSampler(header, indexed);
+    LasChannels channels;
+    // point formats 2, 3, 5, 7, 8 and 10 contain RGB
+    const U8 format = header.point_data_format & 0x3f;
+    const bool hasRgb = format == 2 || format == 3 || format == 5 || format == 7 || format == 8 || format == 10;
+    channels.colors = globals.loads(PointAttribute::COLOR) && hasRgb;
+    channels.classes = globals.loads(PointAttribute::CLASS);
+    channels.times = globals.loads(PointAttribute::TIME);
+    if (!indexed && chunkSize > 0 && numThreads > 1 && numPoints > 2 * chunkSize) {
+        const I64 numChunks = (numPoints + chunkSize - 1) / chunkSize;
+        // more blocks than threads to balance the load
+        const I64 blockSize = std::max(numChunks / (8 * numThreads), I64(1)) * chunkSize;
+        for (I64 first = 0; first < numPoints; first += blockSize) {
+            LasBlock block;
+            block.first = first;
+            block.count = std::min(blockSize, numPoints - first);
+            blocks.push_back(std::move(block));
         }
-        hasColors |= (color != Color(0, 0, 0));
+    } else {
+        LasBlock block;
+        block.count = numPoints;
+        blocks.push_back(std::move(block));
+    }
+    std::cout << "Reading " << blocks.size() << " blocks" << std::endl;
 
-        i++;
-        if (i == nextProg) {
-            if (prog(i * iToProg)) {
-                return {}; // Pvl::NONE;
+    ProgressCounter counter(std::size_t(std::max(numPoints, I64(1))));
+    bool completed;
+    if (blocks.size() == 1) {
+        try {
+            completed = runWithProgress(counter, prog, [&] {
+                readBlock(*lasreader, blocks.front(), sampler, channels, mesh, counter, partial);
+            });
+        } catch (...) {
+            closeReader(lasreader);
+            throw;
+        }
+        closeReader(lasreader);
+    } else {
+        closeReader(lasreader);
+        tbb::enumerable_thread_specific<LASreader*> readers([&file] { return openReader(file); });
+        try {
+            completed = runWithProgress(counter, prog, [&] {
+                tbb::parallel_for(std::size_t(0), blocks.size(), [&](std::size_t bi) {
+                    if (counter.cancelled()) {
+                        return;
+                    }
+                    readBlock(*readers.local(), blocks[bi], sampler, channels, mesh, counter, partial);
+                });
+            });
+        } catch (...) {
+            for (LASreader* reader : readers) {
+                closeReader(reader);
             }
-            nextProg += step;
+            throw;
+        }
+        for (LASreader* reader : readers) {
+            closeReader(reader);
         }
     }
+    if (!completed) {
+        return {}; // Pvl::NONE;
+    }
+
+    // splice the blocks in the file order
+    bool hasColors = false;
+    I64 numRead = 0;
+    std::size_t numStored = 0;
+    std::vector<std::size_t> offsets;
+    for (const LasBlock& block : blocks) {
+        hasColors |= block.hasColors;
+        numRead += block.numRead;
+        offsets.push_back(numStored);
+        numStored += block.vertices.size();
+    }
+    if (blocks.size() == 1) {
+        LasBlock& block = blocks.front();
+        mesh.vertices = std::move(block.vertices);
+        mesh.colors = std::move(block.colors);
+        mesh.classes = std::move(block.classes);
+        mesh.times = std::move(block.times);
+    } else {
+        mesh.vertices.resize(numStored);
+        mesh.colors.resize(hasColors ? numStored : 0);
+        mesh.classes.resize(channels.classes ? numStored : 0);
+        mesh.times.resize(channels.times ? numStored : 0);
+        tbb::parallel_for(std::size_t(0), blocks.size(), [&](std::size_t bi) {
+            LasBlock& block = blocks[bi];
+            std::copy(block.vertices.begin(), block.vertices.end(), mesh.vertices.begin() + offsets[bi]);
+            if (hasColors) {
+                std::copy(block.colors.begin(), block.colors.end(), mesh.colors.begin() + offsets[bi]);
+            }
+            if (channels.classes) {
+                std::copy(block.classes.begin(), block.classes.end(), mesh.classes.begin() + offsets[bi]);
+            }
+            if (channels.times) {
+                std::copy(block.times.begin(), block.times.end(), mesh.times.begin() + offsets[bi]);
+            }
+            block = LasBlock();
+        });
+    }
     mesh.vertices.shrink_to_fit();
     mesh.classes.shrink_to_fit();
     mesh.times.shrink_to_fit();
@@ -93,12 +438,44 @@ TexturedMesh loadLas(std::string file, const Progress& prog) {
     } else {
         mesh.colors = {};
     }
-    std::cout << "Loaded " << i << " out of " << lasreader->npoints << " points" << std::endl;
-
-    lasreader->close();
-    delete lasreader;
+    std::cout << "Loaded " << numRead << " out of " << numPoints << " points" << std::endl;
     return mesh;
 }
 
+bool lasIndexMissing(const std::string& file) {
+    return hasHorizontalExtents(Parameters::global().extents) && !std::ifstream(indexPath(file));
+}
+
+bool createLasIndex(const std::string& file, const Progress& prog) {
+    LASreader* lasreader = openReader(file);
+    const LASheader& header = lasreader->header;
+    // same settings as the lasindex tool
+    LASquadtree* quadtree = new LASquadtree();
+    quadtree->setup(header.min_x, header.max_x, header.min_y, header.max_y, 100.f);
+    LASindex index;
+    index.prepare(quadtree, 1000);
+
+    const I64 step = std::max(lasreader->npoints / 100, I64(100));
+    I64 nextProg = step;
+    const float iToProg = 100.f / lasreader->npoints;
+    while (lasreader->read_point()) {
+        const LASpoint& p = lasreader->point;
+        index.add(p.get_x(), p.get_y(), U32(lasreader->p_count - 1));
+        if (lasreader->p_count == nextProg) {
+            if (prog(lasreader->p_count * iToProg)) {
+                closeReader(lasreader);
+                return false;
+            }
+            nextProg += step;
+        }
+    }
+    closeReader(lasreader);
+    index.complete(100000, -20);
+    if (!index.write(file.c_str())) {
+        throw std::runtime_error("Cannot write spatial index '" + indexPath(file) + "'");
+    }
+    std::cout << "Created spatial index '" << indexPath(file) << "'" << std::endl;
+    return true;
+}
 
 } // namespace Mpcv
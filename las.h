@@ -4,6 +4,16 @@
 
 namespace Mpcv {
 
-TexturedMesh loadLas(std::string file, const Progress& prog);
+/// Loads LAS or LAZ point cloud. If the partial callback is given, it receives the points loaded so far
+/// in batches of a few million points. Chunked LAZ files are decoded in parallel, in which case the partial
+/// callback is called from the worker threads.
+TexturedMesh loadLas(std::string file, const Progress& prog, const PartialResult& partial = {});
+
+/// Returns true if the global extents select only a part of the cloud, but the file has no spatial index
+/// (.lax file) to read the selected part without decoding the whole file.
+bool lasIndexMissing(const std::string& file);
+
+/// Creates the spatial index of LAS or LAZ file and saves it next to the file. Returns false if cancelled.
+bool createLasIndex(const std::string& file, const Progress& prog);
 
 }
@@ -38,6 +38,24 @@ void parseArgument(const std::string& arg, const std::string& param) {
         int stride = std::stoi(param);
         std::cout << "Setting point stride to " << stride << std::endl;
         Mpcv::Parameters::global().pointStride = stride;
+    } else if (arg == "--strideMode") {
+        if (param == "exact") {
+            Mpcv::Parameters::global().strideMode = Mpcv::StrideMode::EXACT;
+        } else if (param == "approx") {
+            Mpcv::Parameters::global().strideMode = Mpcv::StrideMode::APPROXIMATE;
+        } else {
+            std::cout << "Unknown stride mode, expected 'exact' or 'approx'" << std::endl;
+            exit(-1);
+        }
+    } else if (arg == "--attributes") {
+        try {
+            Mpcv::Parameters::global().attributes = Mpcv::parseAttributes(param);
+            std::cout << "Setting loaded attributes to " << param << std::endl;
+        } catch (const std::exception& e) {
+            std::cout << e.what() << ", expected 'xyz', 'rgb', 'class', 'time', 'normal', 'scalar' or 'all'"
+                      << std::endl;
+            exit(-1);
+        }
     } else if (arg == "--subset") {
         if (param == "street") {
             Mpcv::Parameters::global().subset = Mpcv::CloudSubset::STREET_ONLY;
@@ -47,6 +65,14 @@ void parseArgument(const std::string& arg, const std::string& param) {
             std::cout << "Unknown subset type, expected 'street' or 'aerial'" << std::endl;
             exit(-1);
         }
+    } else if (arg == "--subsetRule") {
+        try {
+            Mpcv::Parameters::global().subsetRule = Mpcv::parseSubsetRule(param);
+            std::cout << "Setting subset rule to " << param << std::endl;
+        } catch (const std::exception& e) {
+            std::cout << e.what() << ", expected for example 'angle:35-180' or 'source:100-199'" << std::endl;
+            exit(-1);
+        }
     } else if (arg == "--textureScale") {
         float scale = std::stof(param);
         std::cout << "Setting texture scale to " << scale << std::endl;
@@ -55,6 +81,55 @@ void parseArgument(const std::string& arg, const std::string& param) {
         int res = std::stoi(param);
         std::cout << "Setting DSM resolution " << res << std::endl;
         Mpcv::Parameters::global().dsmResolution = res;
+    } else if (arg == "--terrain") {
+        float error = std::stof(param);
+        std::cout << "Setting terrain error to " << error << " pixels" << std::endl;
+        Mpcv::Parameters::global().terrainError = error;
+    } else if (arg == "--pointBudget") {
+        float budget = std::stof(param);
+        std::cout << "Setting point budget to " << budget << "M points" << std::endl;
+        Mpcv::Parameters::global().pointBudget = std::size_t(budget * 1.e6f);
+    } else if (arg == "--outOfCore") {
+        int size = std::stoi(param);
+        std::cout << "Streaming point clouds larger than " << size << "MB" << std::endl;
+        Mpcv::Parameters::global().outOfCoreSize = std::size_t(size) << 20;
+    } else if (arg == "--occlusion") {
+        if (param != "on" && param != "off") {
+            std::cout << "Unknown occlusion culling mode, expected 'on' or 'off'" << std::endl;
+            exit(-1);
+        }
+        std::cout << "Setting occlusion culling " << param << std::endl;
+        Mpcv::Parameters::global().occlusionCulling = param == "on";
+    } else if (arg == "--shaders") {
+        if (param != "on" && param != "off") {
+            std::cout << "Unknown shader mode, expected 'on' or 'off'" << std::endl;
+            exit(-1);
+        }
+        std::cout << "Setting shaders " << param << std::endl;
+        Mpcv::Parameters::global().shaders = param == "on";
+    } else if (arg == "--scans") {
+        try {
+            Mpcv::Parameters::global().scans = Mpcv::parseIndices(param);
+            std::cout << "Loading E57 scans " << param << std::endl;
+        } catch (const std::exception& e) {
+            std::cout << e.what() << ", expected for example '0-9,12'" << std::endl;
+            exit(-1);
+        }
+    } else if (arg == "--e57Block") {
+        int size = std::stoi(param);
+        std::cout << "Setting E57 read block to " << size << " points" << std::endl;
+        Mpcv::Parameters::global().e57BlockSize = size;
+    } else if (arg == "--cache") {
+        std::cout << "Setting mesh cache to '" << param << "'" << std::endl;
+        Mpcv::Parameters::global().cacheDir = param;
+    } else if (arg == "--cacheSize") {
+        int size = std::stoi(param);
+        std::cout << "Setting mesh cache size to " << size << "GB" << std::endl;
+        Mpcv::Parameters::global().cacheSizeLimit = std::size_t(size) << 30;
+    } else if (arg == "--loadMemory") {
+        int limit = std::stoi(param);
+        std::cout << "Setting memory limit for loading files to " << limit << "MB" << std::endl;
+        Mpcv::Parameters::global().loadMemoryLimit = std::size_t(limit) << 20;
     } else {
         std::cout << "Unknown parameter '" << arg << "'" << std::endl;
         exit(-1);
@@ -70,9 +145,34 @@ int main(int argc, char* argv[]) {
                   << std::endl;
         std::cout << "--stride n                    Loads only every n-th point for each point cloud"
                   << std::endl;
+        std::cout << "--strideMode [exact,approx]   Approximate stride loads LAZ files faster (default exact)"
+                  << std::endl;
+        std::cout << "--attributes a,b,...          Loaded point attributes, e.g. xyz,rgb,class (default all)"
+                  << std::endl;
         std::cout << "--subset [street,aerial]      Loads only a specific category of points" << std::endl;
+        std::cout << "--subsetRule attr:from-to     Street points by angle, source or class (angle:35-180)"
+                  << std::endl;
         std::cout << "--textureScale f              Resizes the loaded textures by given factor" << std::endl;
         std::cout << "--dsmResolution n             Resolution of the loaded GeoTIFF DSMs" << std::endl;
+        std::cout << "--terrain px                  Shows GeoTIFF DSMs as terrain with given error in pixels"
+                  << std::endl;
+        std::cout << "--pointBudget n               Millions of points drawn in a frame (default 20)"
+                  << std::endl;
+        std::cout << "--outOfCore n                 Streams clouds larger than n MB from on-disk octrees"
+                  << std::endl;
+        std::cout << "--occlusion [on,off]          Skips hidden parts of meshes using occlusion queries"
+                  << std::endl;
+        std::cout << "--shaders [on,off]            Draws meshes using GLSL shaders (requires OpenGL 3.3)"
+                  << std::endl;
+        std::cout << "--scans i,j-k,...             Loads only the given scans of E57 files" << std::endl;
+        std::cout << "--e57Block n                  Number of points read from E57 files at once"
+                  << std::endl;
+        std::cout << "--cache [dir,source,off]      Directory of cached meshes (default ~/.cache/mpcv)"
+                  << std::endl;
+        std::cout << "--cacheSize n                 Cache size limit in GB (default 20, 0 for no limit)"
+                  << std::endl;
+        std::cout << "--loadMemory n                Memory (in MB) used when loading several files at once"
+                  << std::endl;
         return 0;
     }
 
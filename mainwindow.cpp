@@ -1,10 +1,14 @@
 #include "mainwindow.h"
 #include "./ui_mainwindow.h"
+#include "cache.h"
 #include "dem.h"
 #include "e57.h"
 #include "las.h"
 #include "mesh.h"
+#include "obj.h"
 #include "openglwidget.h"
+#include "parameters.h"
+#include "ply.h"
 #include "sunwidget.h"
 #include "utils.h"
 #include <QClipboard>
@@ -15,10 +19,16 @@
 #include <QShortcut>
 #include <QStatusBar>
 #include <QScreen>
+#include <atomic>
+#include <condition_variable>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <sstream>
+#include <tbb/tbb.h>
+#include <thread>
+#include <unistd.h>
 
 using namespace Mpcv;
 
@@ -77,10 +87,15 @@ std::map<std::string, Coords> parseConfig() {
 static std::map<std::string, Coords> config;
 
 void geolocalize(TexturedMesh& mesh, const QString& file) {
+    if (!(mesh.srs == Srs())) {
+        // already georeferenced by the loader
+        return;
+    }
     std::string basename = findBasename(QFileInfo(file).absolutePath());
-    if (!basename.empty() && config.find(basename) != config.end()) {
-        std::cout << "Setting srs to " << config[basename][0] << "," << config[basename][1] << std::endl;
-        mesh.srs = Srs(config[basename]);
+    auto iter = basename.empty() ? config.end() : config.find(basename);
+    if (iter != config.end()) {
+        std::cout << "Setting srs to " << iter->second[0] << "," << iter->second[1] << std::endl;
+        mesh.srs = Srs(iter->second);
     } else {
         std::cout << "No srs found in config" << std::endl;
     }
@@ -234,9 +249,9 @@ MainWindow::~MainWindow() {
     delete ui_;
 }
 
-QProgressDialog* MainWindow::createProgressDialog(const QString& message) {
+QProgressDialog* MainWindow::createProgressDialog(const QString& message, Qt::WindowModality modality) {
     QProgressDialog* dialog = new QProgressDialog(message, "Cancel", 0, 100, this);
-    dialog->setWindowModality(Qt::WindowModal);
+    dialog->setWindowModality(modality);
     dialog->show();
     QRect screen = QGuiApplication::primaryScreen()->geometry();
     int x = (screen.width() - dialog->width()) / 2;
@@ -248,7 +263,8 @@ QProgressDialog* MainWindow::createProgressDialog(const QString& message) {
 
 bool MainWindow::open(const QString& file) {
     QString message = "Loading '" + file + "'";
-    QProgressDialog* dialog = createProgressDialog(message);
+    // non-modal, so that the partially loaded mesh can be viewed
+    QProgressDialog* dialog = createProgressDialog(message, Qt::NonModal);
     bool retval = open(file, dialog);
     dialog->close();
     return retval;
@@ -257,64 +273,343 @@ bool MainWindow::open(const QString& file) {
 void MainWindow::openAll(const std::vector<QString>& files) {
     if (files.empty()) {
         return;
+    } else if (files.size() == 1) {
+        open(files.front());
+    } else {
+        openParallel(files);
+    }
+}
+
+namespace {
+
+bool isSupported(const QString& file) {
+    QString ext = QFileInfo(file).suffix();
+    return ext == "ply" || ext == "obj" || ext == "xyz" || ext == "las" || ext == "laz" || ext == "e57" ||
+           ext == "tif";
+}
+
+/// Returns true if the file is a DEM shown as level-of-detail terrain instead of a loaded mesh.
+bool isTerrain(const QString& file) {
+    return QFileInfo(file).suffix() == "tif" && Parameters::global().terrainError > 0.f;
+}
+
+/// Returns true if the file is a point cloud too large to be loaded into memory, streamed from an on-disk
+/// octree instead.
+bool isStreamed(const QString& file) {
+    const Parameters& params = Parameters::global();
+    QFileInfo info(file);
+    const QString ext = info.suffix();
+    return (ext == "las" || ext == "laz" || ext == "e57" || ext == "xyz") && params.outOfCoreSize > 0 &&
+           std::size_t(info.size()) > params.outOfCoreSize && params.cacheDir != "off";
+}
+
+void unknownFormatWarning(const QString& file) {
+    QMessageBox box(QMessageBox::Warning, "Error", "Unknown file format of file '" + file + "'");
+    box.exec();
+}
+
+/// Estimates the memory needed to load the file.
+std::size_t estimateLoadMemory(const QString& file) {
+    QFileInfo info(file);
+    const std::size_t size = info.size();
+    const QString ext = info.suffix();
+    if (ext == "laz") {
+        return 10 * size; // usual compression ratio of LAZ files
+    } else if (ext == "e57") {
+        return 4 * size;
+    } else if (ext == "tif") {
+        // DEM is resampled to the given resolution, regardless of the file size
+        const std::size_t res = Parameters::global().dsmResolution;
+        return res * res * 64;
+    } else {
+        return 2 * size;
     }
-    QString message = "Loading '" + files.front() + "'";
-    QProgressDialog* dialog = createProgressDialog(message);
-    for (std::size_t i = 0; i < files.size(); ++i) {
-        QString message = "Loading '" + files[i] + "'";
-        if (files.size() > 1) {
-            message += " (" + QString::number(i+1) + " of " + QString::number(files.size()) + ")";
+}
+
+std::size_t loadMemoryLimit() {
+    const std::size_t limit = Parameters::global().loadMemoryLimit;
+    if (limit > 0) {
+        return limit;
+    }
+    return std::size_t(sysconf(_SC_PHYS_PAGES)) * std::size_t(sysconf(_SC_PAGE_SIZE)) / 2;
+}
+
+struct LoadTask {
+    QString file;
+    std::size_t memory;
+    std::atomic<float> progress{ 0.f };
+    std::atomic<bool> indexing{ false };
+    std::atomic<bool> caching{ false };
+    bool createIndex = false;
+    bool started = false;
+    bool finished = false;
+
+    ///< Loaded mesh or the exception thrown by the loader
+    PreparedMesh mesh;
+    std::exception_ptr error;
+};
+
+} // namespace
+
+void MainWindow::openParallel(const std::vector<QString>& files) {
+    std::vector<std::unique_ptr<LoadTask>> tasks;
+    for (const QString& file : files) {
+        if (!isSupported(file)) {
+            unknownFormatWarning(file);
+            continue;
         }
-        dialog->setLabelText(message);
+        if (isTerrain(file)) {
+            // tiles are loaded while drawing
+            openTerrain(file);
+            continue;
+        }
+        if (isStreamed(file)) {
+            // converted one at a time, conversion needs the whole cloud in memory
+            if (!openStreamed(file)) {
+                return;
+            }
+            continue;
+        }
+        tasks.emplace_back(std::make_unique<LoadTask>());
+        tasks.back()->file = file;
+        tasks.back()->memory = estimateLoadMemory(file);
+    }
 
-        if (!open(files[i], dialog)) {
-            // cancelled, skip the rest
+    // offer the spatial index once for all files that would have to be read whole
+    std::vector<LoadTask*> unindexed;
+    for (const auto& task : tasks) {
+        const QString ext = QFileInfo(task->file).suffix();
+        if ((ext == "las" || ext == "laz") && lasIndexMissing(task->file.toStdString()) &&
+            !hasCachedMesh(task->file)) {
+            unindexed.push_back(task.get());
+        }
+    }
+    if (!unindexed.empty()) {
+        QString text = QString::number(unindexed.size()) +
+                       " files have no spatial index, so the whole files must be read to select the points "
+                       "within the extents.\nCreate the indices? They will be saved next to the files.";
+        QMessageBox box(QMessageBox::Question, "Spatial index", text, QMessageBox::Yes | QMessageBox::No, this);
+        if (box.exec() == QMessageBox::Yes) {
+            for (LoadTask* task : unindexed) {
+                task->createIndex = true;
+            }
+        }
+    }
+
+    QProgressDialog* dialog = createProgressDialog("Loading " + QString::number(tasks.size()) + " files");
+    const std::size_t memoryLimit = loadMemoryLimit();
+    const std::size_t maxRunning = tbb::this_task_arena::max_concurrency();
+    std::atomic<bool> cancelled{ false };
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<LoadTask*> loaded;
+    tbb::task_group group;
+    std::size_t next = 0;
+    std::size_t running = 0;
+    std::size_t reserved = 0;
+    std::size_t numFinished = 0;
+    while (numFinished < tasks.size()) {
+        // start loading files while they fit into the memory limit; at least one file is always loading
+        while (!cancelled && next < tasks.size() && running < maxRunning &&
+               (running == 0 || reserved + tasks[next]->memory <= memoryLimit)) {
+            LoadTask* task = tasks[next++].get();
+            task->started = true;
+            reserved += task->memory;
+            ++running;
+            group.run([task, &cancelled, &mutex, &cv, &loaded] {
+                try {
+                    // called from the worker, must not touch the GUI
+                    auto callback = [task, &cancelled](float value) {
+                        task->progress = value;
+                        return bool(cancelled);
+                    };
+                    if (task->createIndex) {
+                        task->indexing = true;
+                        createLasIndex(task->file.toStdString(), callback);
+                        task->indexing = false;
+                    }
+                    if (!cancelled) {
+                        TexturedMesh mesh =
+                            loadMesh(task->file, callback, {}, [task] { task->caching = true; });
+                        if (!cancelled) {
+                            task->mesh = OpenGLWidget::prepare(std::move(mesh));
+                        }
+                    }
+                } catch (...) {
+                    task->error = std::current_exception();
+                }
+                std::unique_lock<std::mutex> lock(mutex);
+                loaded.push_back(task);
+                cv.notify_one();
+            });
+        }
+        if (cancelled && running == 0) {
             break;
         }
+
+        std::vector<LoadTask*> handoff;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait_for(lock, std::chrono::milliseconds(50), [&loaded] { return !loaded.empty(); });
+            std::swap(handoff, loaded);
+        }
+        // meshes are handed to the viewport on the GUI thread, in the order they got loaded
+        for (LoadTask* task : handoff) {
+            --running;
+            reserved -= task->memory;
+            ++numFinished;
+            task->finished = true;
+            if (cancelled) {
+                // skip the rest
+            } else if (task->error) {
+                try {
+                    std::rethrow_exception(task->error);
+                } catch (const std::exception& e) {
+                    QMessageBox box(
+                        QMessageBox::Warning, "Error", "Cannot open file '" + task->file + "'\n" + e.what());
+                    box.exec();
+                }
+            } else if (task->mesh.mesh.vertices.empty()) {
+                std::cout << "Skipping empty mesh '" << task->file.toStdString() << "'" << std::endl;
+            } else {
+                addMesh(task->file, std::move(task->mesh));
+            }
+            task->mesh = {};
+        }
+
+        float progress = 0.f;
+        QString message = "Loaded " + QString::number(numFinished) + " of " + QString::number(tasks.size()) +
+                          " files";
+        for (const auto& task : tasks) {
+            if (task->finished) {
+                progress += 100.f;
+            } else if (task->started) {
+                progress += task->progress;
+                const QString phase = task->indexing ? ": indexing " : task->caching ? ": caching " : ": ";
+                message += "\n" + QFileInfo(task->file).fileName() + phase +
+                           QString::number(int(task->progress)) + "%";
+            }
+        }
+        dialog->setLabelText(message);
+        dialog->setValue(progress / tasks.size());
+        QCoreApplication::processEvents();
+        if (dialog->wasCanceled()) {
+            cancelled = true;
+        }
     }
+    group.wait();
     dialog->close();
 }
 
-
 bool MainWindow::open(const QString& file, QProgressDialog* dialog) {
     QCoreApplication::processEvents();
-    try {
-        QString ext = QFileInfo(file).suffix();
-        if (ext != "ply" && ext != "obj" && ext != "xyz" && ext != "las" && ext != "laz" && ext != "e57" &&
-            ext != "tif") {
-            QMessageBox box(QMessageBox::Warning, "Error", "Unknown file format of file '" + file + "'");
-            box.exec();
-            return true; // continue opening files
-        }
+    if (!isSupported(file)) {
+        unknownFormatWarning(file);
+        return true; // continue opening files
+    }
+    if (isTerrain(file)) {
+        openTerrain(file);
+        return true;
+    }
+    if (isStreamed(file)) {
+        return openStreamed(file);
+    }
 
-        auto callback = [dialog](float prog) {
-            dialog->setValue(prog);
-            QCoreApplication::processEvents();
-            return dialog->wasCanceled();
-        };
+    const QString ext = QFileInfo(file).suffix();
+    bool createIndex = false;
+    // the index is not needed if the selected part of the file is already cached
+    if ((ext == "las" || ext == "laz") && lasIndexMissing(file.toStdString()) && !hasCachedMesh(file)) {
+        QString text = "File '" + file +
+                       "' has no spatial index, so the whole file must be read to select the points within "
+                       "the extents.\nCreate the index? It will be saved next to the file.";
+        QMessageBox box(QMessageBox::Question, "Spatial index", text, QMessageBox::Yes | QMessageBox::No, this);
+        createIndex = box.exec() == QMessageBox::Yes;
+    }
 
-        TexturedMesh mesh = loadMesh(file, callback);
+    // load on a worker thread; the GUI stays responsive and shows the parts of the mesh loaded so far
+    std::atomic<float> progress{ 0.f };
+    std::atomic<bool> cancelled{ false };
+    std::atomic<bool> caching{ false };
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<TexturedMesh> parts;
+    bool finished = false;
+    PreparedMesh mesh;
+    std::exception_ptr error;
+    std::thread worker([&] {
+        try {
+            auto callback = [&progress, &cancelled](float value) {
+                progress = value;
+                return bool(cancelled);
+            };
+            auto partial = [&mutex, &parts](TexturedMesh&& part) {
+                std::unique_lock<std::mutex> lock(mutex);
+                parts.push_back(std::move(part));
+            };
+            // skip loading if cancelled while creating the index
+            if (!createIndex || createLasIndex(file.toStdString(), callback)) {
+                TexturedMesh loaded = loadMesh(file, callback, partial, [&caching] { caching = true; });
+                if (!cancelled) {
+                    mesh = OpenGLWidget::prepare(std::move(loaded));
+                }
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        finished = true;
+        cv.notify_one();
+    });
+
+    // prevent opening other files or modifying the meshes while loading
+    menuBar()->setEnabled(false);
+    list_->setEnabled(false);
+    const void* partialHandle = &parts;
+    const QString cachingText = "Saving '" + file + "' to cache";
+    while (true) {
+        std::vector<TexturedMesh> ready;
+        bool done;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait_for(lock, std::chrono::milliseconds(50), [&finished] { return finished; });
+            std::swap(ready, parts);
+            done = finished;
+        }
+        for (TexturedMesh& part : ready) {
+            viewport_->viewPartial(partialHandle, std::move(part));
+        }
+        if (done) {
+            break;
+        }
+        if (caching && dialog->labelText() != cachingText) {
+            dialog->setLabelText(cachingText);
+        }
+        dialog->setValue(progress);
+        QCoreApplication::processEvents();
         if (dialog->wasCanceled()) {
+            cancelled = true;
+        }
+    }
+    worker.join();
+    menuBar()->setEnabled(true);
+    list_->setEnabled(true);
+
+    try {
+        if (error) {
+            viewport_->deleteMesh(partialHandle);
+            std::rethrow_exception(error);
+        }
+        if (cancelled) {
+            viewport_->deleteMesh(partialHandle);
             return false;
         }
-        if (mesh.vertices.empty()) {
+        if (mesh.mesh.vertices.empty()) {
+            viewport_->deleteMesh(partialHandle);
             std::cout << "Skipping empty mesh '" << file.toStdString() << "'" << std::endl;
             return true; // continue opening files
         }
-
-        QFileInfo info(file);
-        QString identifier = info.absoluteDir().dirName() + "/" + info.baseName();
-        QListWidgetItem* item = new QListWidgetItem(identifier, list_);
-        list_->addItem(item);
-
-        viewport_->view(item, findBasename(file), std::move(mesh));
-        item->setData(Qt::UserRole, info.absolutePath());
-        item->setFlags(
-            Qt::ItemIsEditable | Qt::ItemIsSelectable | Qt::ItemIsUserCheckable | Qt::ItemIsEnabled);
-
-        /// \todo avoid firing signal
-
-        item->setCheckState(Qt::CheckState::Checked);
+        addMesh(file, std::move(mesh));
+        viewport_->deleteMesh(partialHandle);
         return true;
 
     } catch (const std::exception& e) {
@@ -324,14 +619,141 @@ bool MainWindow::open(const QString& file, QProgressDialog* dialog) {
     }
 }
 
-TexturedMesh MainWindow::loadMesh(const QString& file, std::function<bool(float)> callback) {
+void MainWindow::openTerrain(const QString& file) {
+    try {
+        std::unique_ptr<DemTerrain> terrain = std::make_unique<DemTerrain>(file.toStdString());
+        addItem(file, [this, &file, &terrain](QListWidgetItem* item) {
+            viewport_->viewTerrain(item, findBasename(file), std::move(terrain));
+        });
+    } catch (const std::exception& e) {
+        QMessageBox box(QMessageBox::Warning, "Error", "Cannot open file '" + file + "'\n" + e.what());
+        box.exec();
+    }
+}
+
+bool MainWindow::openStreamed(const QString& file) {
+    std::unique_ptr<CachedOctree> octree = loadCachedOctree(file);
+    if (!octree) {
+        // load the cloud once on a worker thread and store it as octree
+        QProgressDialog* dialog = createProgressDialog("Converting '" + file + "' to octree");
+        std::atomic<float> progress{ 0.f };
+        std::atomic<bool> cancelled{ false };
+        std::atomic<bool> finished{ false };
+        bool saved = false;
+        // kept to show the cloud in memory if the octree cannot be stored
+        PreparedMesh cloud;
+        std::exception_ptr error;
+        std::thread worker([&] {
+            try {
+                // loading takes the first half of the progress, saving the second
+                auto loadCallback = [&progress, &cancelled](float value) {
+                    progress = 0.5f * value;
+                    return bool(cancelled);
+                };
+                auto saveCallback = [&progress, &cancelled](float value) {
+                    progress = 50.f + 0.5f * value;
+                    return bool(cancelled);
+                };
+                cloud.mesh = loadFile(file, loadCallback);
+                if (!cancelled && !cloud.mesh.vertices.empty()) {
+                    cloud.octree = PointOctree(cloud.mesh);
+                    saved = saveCachedOctree(file, cloud.mesh, cloud.octree, saveCallback);
+                }
+            } catch (...) {
+                error = std::current_exception();
+            }
+            finished = true;
+        });
+        while (!finished) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            dialog->setValue(progress);
+            QCoreApplication::processEvents();
+            if (dialog->wasCanceled()) {
+                cancelled = true;
+            }
+        }
+        worker.join();
+        dialog->close();
+        if (error) {
+            try {
+                std::rethrow_exception(error);
+            } catch (const std::exception& e) {
+                QMessageBox box(
+                    QMessageBox::Warning, "Error", "Cannot open file '" + file + "'\n" + e.what());
+                box.exec();
+                return true; // continue opening files
+            }
+        }
+        if (cancelled) {
+            return false;
+        }
+        if (saved) {
+            octree = loadCachedOctree(file);
+        }
+        if (!octree && cloud.mesh.vertices.empty()) {
+            std::cout << "Skipping empty mesh '" << file.toStdString() << "'" << std::endl;
+            return true;
+        }
+        if (!octree) {
+            // cache directory not writable or disk full
+            std::cout << "Cannot store octree of '" << file.toStdString() << "', showing it from memory"
+                      << std::endl;
+            addMesh(file, std::move(cloud));
+            return true;
+        }
+    }
+    addItem(file, [this, &file, &octree](QListWidgetItem* item) {
+        viewport_->viewStreamed(item, findBasename(file), std::move(octree));
+    });
+    return true;
+}
+
+void MainWindow::addMesh(const QString& file, PreparedMesh&& mesh) {
+    addItem(file, [this, &file, &mesh](QListWidgetItem* item) {
+        viewport_->view(item, findBasename(file), std::move(mesh));
+    });
+}
+
+void MainWindow::addItem(const QString& file, const std::function<void(QListWidgetItem*)>& view) {
+    QFileInfo info(file);
+    QString identifier = info.absoluteDir().dirName() + "/" + info.baseName();
+    QListWidgetItem* item = new QListWidgetItem(identifier, list_);
+    list_->addItem(item);
+
+    view(item);
+    item->setData(Qt::UserRole, info.absolutePath());
+    item->setFlags(Qt::ItemIsEditable | Qt::ItemIsSelectable | Qt::ItemIsUserCheckable | Qt::ItemIsEnabled);
+
+    /// \todo avoid firing signal
+
+    item->setCheckState(Qt::CheckState::Checked);
+}
+
+TexturedMesh MainWindow::loadMesh(const QString& file,
+    std::function<bool(float)> callback,
+    std::function<void(TexturedMesh&&)> partial,
+    std::function<void()> caching) {
+    TexturedMesh mesh;
+    if (loadCachedMesh(file, mesh)) {
+        return mesh;
+    }
+    mesh = loadFile(file, callback, partial);
+    if (!mesh.vertices.empty() && Parameters::global().cacheDir != "off") {
+        if (caching) {
+            caching();
+        }
+        saveCachedMesh(file, mesh, callback);
+    }
+    return mesh;
+}
+
+TexturedMesh MainWindow::loadFile(const QString& file,
+    std::function<bool(float)> callback,
+    std::function<void(TexturedMesh&&)> partial) {
     TexturedMesh mesh;
     QString ext = QFileInfo(file).suffix();
     if (ext == "ply") {
-        std::ifstream in;
-        in.exceptions(std::ifstream::badbit | std::ifstream::failbit);
-        in.open(file.toStdString());
-        mesh = loadPly(in, callback);
+        mesh = loadPly(file, callback);
         geolocalize(mesh, file);
     } else if (ext == "obj") {
         mesh = loadObj(file, callback);
@@ -340,7 +762,7 @@ TexturedMesh MainWindow::loadMesh(const QString& file, std::function<bool(float)
         mesh = loadXyz(file, callback);
         geolocalize(mesh, file);
     } else if (ext == "las" || ext == "laz") {
-        mesh = loadLas(file.toStdString(), callback);
+        mesh = loadLas(file.toStdString(), callback, partial);
     } else if (ext == "e57") {
         mesh = loadE57(file.toStdString(), callback);
     } else if (ext == "tif") {
@@ -425,8 +847,11 @@ void MainWindow::on_actionQuit_triggered() {
 
 void MainWindow::on_actionSave_triggered() {
     QDir& initialDir = saveFileDialogInitialDir();
-    QString file =
-        QFileDialog::getSaveFileName(this, tr("Save mesh"), initialDir.path(), tr(".ply object (*.ply)"));
+    const QString binaryFilter = tr("Binary .ply object (*.ply)");
+    const QString asciiFilter = tr("ASCII .ply object (*.ply)");
+    QString selectedFilter = binaryFilter;
+    QString file = QFileDialog::getSaveFileName(
+        this, tr("Save mesh"), initialDir.path(), binaryFilter + ";;" + asciiFilter, &selectedFilter);
     if (!file.isEmpty()) {
         QFileInfo info(file);
         if (info.suffix().isEmpty()) {
@@ -447,7 +872,14 @@ void MainWindow::on_actionSave_triggered() {
             QCoreApplication::processEvents();
             return dialog->wasCanceled();
         };
-        viewport_->saveAsMesh(file, handles, callback);
+        const PlyFormat format =
+            selectedFilter == asciiFilter ? PlyFormat::ASCII : PlyFormat::BINARY_LITTLE_ENDIAN;
+        try {
+            viewport_->saveAsMesh(file, handles, callback, format);
+        } catch (const std::exception& e) {
+            QMessageBox box(QMessageBox::Warning, "Error", "Cannot save file '" + file + "'\n" + e.what());
+            box.exec();
+        }
         dialog->close();
     }
 }
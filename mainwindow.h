@@ -17,6 +17,7 @@ class TexturedMesh;
 }
 
 class OpenGLWidget;
+struct PreparedMesh;
 
 class MainWindow : public QMainWindow {
     Q_OBJECT
@@ -29,7 +30,19 @@ public:
 
     void openAll(const std::vector<QString>& file);
 
-    static Mpcv::TexturedMesh loadMesh(const QString& file, std::function<bool(float)> progress);
+    /// Loads the mesh from file, optionally passing parts of the mesh to the partial callback while it is
+    /// being loaded. Meshes not loaded from the cache are then written into it; the caching callback is
+    /// called before that, the progress starts again from 0. Can be called from any thread, as long as the
+    /// callbacks are thread-safe.
+    static Mpcv::TexturedMesh loadMesh(const QString& file,
+        std::function<bool(float)> progress,
+        std::function<void(Mpcv::TexturedMesh&&)> partial = {},
+        std::function<void()> caching = {});
+
+    /// Loads the mesh from file, bypassing the mesh cache.
+    static Mpcv::TexturedMesh loadFile(const QString& file,
+        std::function<bool(float)> progress,
+        std::function<void(Mpcv::TexturedMesh&&)> partial = {});
 
 private slots:
     void on_MeshList_itemChanged(QListWidgetItem* item);
@@ -87,5 +100,22 @@ private:
 
     bool open(const QString& file, QProgressDialog* dialog);
 
-    QProgressDialog* createProgressDialog(const QString& message);
+    /// Loads the files concurrently, the meshes are shown in the order they get loaded.
+    void openParallel(const std::vector<QString>& files);
+
+    /// Adds the loaded mesh to the mesh list and shows it in the viewport.
+    void addMesh(const QString& file, PreparedMesh&& mesh);
+
+    /// Opens the DEM as a level-of-detail terrain and adds it to the mesh list.
+    void openTerrain(const QString& file);
+
+    /// Opens the point cloud streamed from its on-disk octree, converting the file first if needed.
+    /// Returns false if the conversion has been cancelled.
+    bool openStreamed(const QString& file);
+
+    /// Adds an item to the mesh list, the view function shows the object of the item in the viewport.
+    void addItem(const QString& file, const std::function<void(QListWidgetItem*)>& view);
+
+    QProgressDialog* createProgressDialog(const QString& message,
+        Qt::WindowModality modality = Qt::WindowModal);
 };
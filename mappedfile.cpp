@@ -0,0 +1,43 @@
+#include "mappedfile.h"
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Mpcv {
+
+MappedFile::MappedFile(const std::string& file) {
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open file '" + file + "'");
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Cannot stat file '" + file + "'");
+    }
+    size_ = info.st_size;
+    if (size_ == 0) {
+        ::close(fd);
+        return;
+    }
+    void* ptr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if (ptr == MAP_FAILED) {
+        size_ = 0;
+        throw std::runtime_error("Cannot map file '" + file + "' to memory");
+    }
+    // loaders read the data front to back, let the kernel prefetch aggressively
+    madvise(ptr, size_, MADV_SEQUENTIAL);
+    data_ = static_cast<const char*>(ptr);
+}
+
+MappedFile::~MappedFile() {
+    if (data_) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+}
+
+} // namespace Mpcv
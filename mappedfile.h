@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace Mpcv {
+
+/// Read-only memory mapping of the whole file.
+class MappedFile {
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+
+public:
+    explicit MappedFile(const std::string& file);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const {
+        return data_;
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+
+    const char* begin() const {
+        return data_;
+    }
+
+    const char* end() const {
+        return data_ + size_;
+    }
+};
+
+} // namespace Mpcv
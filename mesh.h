@@ -1,6 +1,7 @@
 #pragma once
 
 #include "coordinates.h"
+#include "pvl/Box.hpp"
 #include "pvl/Optional.hpp"
 #include "pvl/UniformGrid.hpp"
 #include "pvl/Vector.hpp"
@@ -15,6 +16,19 @@ namespace Mpcv {
 
 using Color = Pvl::Vector<uint8_t, 3>;
 
+/// Material shared by a contiguous range of faces.
+struct Material {
+    ///< Name of the material in the material library
+    std::string name;
+
+    ///< Texture image (deleted once transvered to OpenGL); may be null
+    std::unique_ptr<ITexture> texture;
+
+    ///< Faces [firstFace, firstFace + numFaces) use this material
+    std::size_t firstFace = 0;
+    std::size_t numFaces = 0;
+};
+
 struct TexturedMesh {
     using Face = std::array<uint32_t, 3>;
 
@@ -45,9 +59,15 @@ struct TexturedMesh {
     ///< Vertex classes
     std::vector<uint8_t> classes;
 
+    ///< Other per-vertex attributes (intensity, scalar fields, ...) indexed by name
+    std::map<std::string, std::vector<float>> scalars;
+
     ///< Texture image (deleted once transvered to OpenGL)
     std::unique_ptr<ITexture> texture;
 
+    ///< Materials of faces, sorted by face ranges; if empty, the whole mesh uses the texture above
+    std::vector<Material> materials;
+
     ///< Specifies the coordinates of the mesh
     Srs srs;
 
@@ -82,14 +102,20 @@ struct TexturedMesh {
 
 using Progress = std::function<bool(float)>;
 
-void savePly(std::ostream& out, const TexturedMesh& mesh);
-
-void savePly(std::ostream& out, const std::vector<const TexturedMesh*>& meshes, const Progress& progress);
-
-TexturedMesh loadPly(std::istream& in, const Progress& prog);
+/// Receives a part of the mesh while it is still being loaded; called from the loading thread.
+using PartialResult = std::function<void(TexturedMesh&& part)>;
 
 TexturedMesh loadXyz(const QString& file, const Progress& prog);
 
-TexturedMesh loadObj(const QString& file, const Progress& prog);
+/// Spatially coherent range of faces of a mesh.
+struct MeshChunk {
+    Pvl::Box3f box;
+    std::size_t firstFace = 0;
+    std::size_t numFaces = 0;
+};
+
+/// Reorders the faces of each material along the Morton curve of their centroids and splits them into
+/// chunks of at most chunkSize faces, sorted by face ranges. Chunks never span two materials.
+std::vector<MeshChunk> sortIntoChunks(TexturedMesh& mesh, std::size_t chunkSize);
 
 } // namespace Mpcv
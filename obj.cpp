@@ -0,0 +1,517 @@
+#include "obj.h"
+#include "mappedfile.h"
+#include "parallel.h"
+#include "parameters.h"
+#include "scanner.h"
+#include <QDir>
+#include <QFileInfo>
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <tbb/tbb.h>
+
+namespace Mpcv {
+
+namespace {
+
+enum class ObjRecord {
+    EMPTY,
+    VERTEX,
+    TEX_COORD,
+    NORMAL,
+    FACE,
+    MATERIAL_LIBRARY,
+    USE_MATERIAL,
+    IGNORED,
+    UNKNOWN,
+};
+
+inline bool isEndOfRecord(const char* p, const char* eol) {
+    return p == eol || *p == '\n' || *p == '#';
+}
+
+/// Identifies the record on the line and moves the pointer past the keyword.
+ObjRecord classify(const char*& p, const char* eol) {
+    p = skipBlanks(p, eol);
+    if (isEndOfRecord(p, eol)) {
+        return ObjRecord::EMPTY;
+    }
+    const char* keyword = p;
+    while (p < eol && !isBlank(*p) && *p != '\n') {
+        ++p;
+    }
+    const std::size_t length = p - keyword;
+    auto is = [keyword, length](const char* name) {
+        return length == strlen(name) && memcmp(keyword, name, length) == 0;
+    };
+    if (is("v")) {
+        return ObjRecord::VERTEX;
+    } else if (is("vt")) {
+        return ObjRecord::TEX_COORD;
+    } else if (is("vn")) {
+        return ObjRecord::NORMAL;
+    } else if (is("f")) {
+        return ObjRecord::FACE;
+    } else if (is("mtllib")) {
+        return ObjRecord::MATERIAL_LIBRARY;
+    } else if (is("usemtl")) {
+        return ObjRecord::USE_MATERIAL;
+    } else if (is("o") || is("g") || is("s") || is("vp") || is("l") || is("p")) {
+        return ObjRecord::IGNORED;
+    } else {
+        return ObjRecord::UNKNOWN;
+    }
+}
+
+/// Returns the number of vertices of a face, given the line past the keyword.
+std::size_t countFaceVertices(const char* p, const char* eol) {
+    std::size_t count = 0;
+    for (p = skipBlanks(p, eol); !isEndOfRecord(p, eol); p = skipBlanks(p, eol)) {
+        ++count;
+        while (p < eol && !isBlank(*p) && *p != '\n') {
+            ++p;
+        }
+    }
+    return count;
+}
+
+inline std::size_t numTriangles(const std::size_t numFaceVertices) {
+    return numFaceVertices >= 3 ? numFaceVertices - 2 : 0;
+}
+
+/// Parses a (possibly negative) index, returns p if there is no index at the current position.
+inline const char* scanIndex(const char* p, const char* end, int64_t& index) {
+    const bool negative = p < end && *p == '-';
+    const char* digits = negative ? p + 1 : p;
+    if (digits == end || unsigned(*digits - '0') >= 10) {
+        return p;
+    }
+    uint32_t value;
+    p = scanUnsigned(digits, end, value);
+    index = negative ? -int64_t(value) : int64_t(value);
+    return p;
+}
+
+/// Converts one-based (or negative relative) index into zero-based index.
+///
+/// \param count Number of records of given kind preceding the face.
+/// \param total Total number of records of given kind in the file.
+inline uint32_t resolveIndex(const int64_t index, const std::size_t count, const std::size_t total) {
+    const int64_t resolved = index > 0 ? index - 1 : int64_t(count) + index;
+    if (index == 0 || resolved < 0 || resolved >= int64_t(total)) {
+        throw std::runtime_error("Invalid index " + std::to_string(index) + " in .obj file");
+    }
+    return uint32_t(resolved);
+}
+
+const uint32_t NO_NORMAL = uint32_t(-1);
+
+std::string trimmed(const char* p, const char* eol) {
+    p = skipBlanks(p, eol);
+    while (eol > p && (isBlank(eol[-1]) || eol[-1] == '\n')) {
+        --eol;
+    }
+    return std::string(p, eol);
+}
+
+/// Consecutive faces using the same material.
+struct ObjSegment {
+    ///< Name of the material, empty if no usemtl precedes the faces
+    std::string material;
+
+    ///< Segment at the start of a chunk; uses the material of the previous chunk
+    bool inherited = false;
+
+    std::size_t numFaces = 0;
+
+    ///< Index of the first face of the segment in the mesh, faces are sorted by material
+    std::size_t firstFace = 0;
+};
+
+struct ObjChunk {
+    const char* begin = nullptr;
+    const char* end = nullptr;
+
+    ///< Number of records in the chunk; faces are counted as triangles
+    std::size_t numVertices = 0;
+    std::size_t numTexCoords = 0;
+    std::size_t numNormals = 0;
+    std::size_t numFaces = 0;
+    std::size_t numUnknown = 0;
+
+    ///< Global indices of the first records in the chunk
+    std::size_t firstVertex = 0;
+    std::size_t firstTexCoord = 0;
+    std::size_t firstNormal = 0;
+
+    ///< Faces of the chunk split by usemtl records
+    std::vector<ObjSegment> segments;
+
+    ///< First mtllib record in the chunk (if any)
+    const char* materialLibrary = nullptr;
+};
+
+/// Counts the records of each kind in the chunk.
+void countRecords(ObjChunk& chunk) {
+    chunk.segments.resize(1);
+    chunk.segments[0].inherited = true;
+    for (const char* line = chunk.begin; line < chunk.end;) {
+        const char* eol = nextLine(line, chunk.end);
+        const char* p = line;
+        switch (classify(p, eol)) {
+        case ObjRecord::VERTEX:
+            chunk.numVertices++;
+            break;
+        case ObjRecord::TEX_COORD:
+            chunk.numTexCoords++;
+            break;
+        case ObjRecord::NORMAL:
+            chunk.numNormals++;
+            break;
+        case ObjRecord::FACE: {
+            const std::size_t numFaces = numTriangles(countFaceVertices(p, eol));
+            chunk.numFaces += numFaces;
+            chunk.segments.back().numFaces += numFaces;
+            break;
+        }
+        case ObjRecord::USE_MATERIAL:
+            chunk.segments.emplace_back();
+            chunk.segments.back().material = trimmed(p, eol);
+            break;
+        case ObjRecord::MATERIAL_LIBRARY:
+            if (!chunk.materialLibrary) {
+                chunk.materialLibrary = p;
+            }
+            break;
+        case ObjRecord::UNKNOWN:
+            chunk.numUnknown++;
+            break;
+        default:
+            break;
+        }
+        line = eol;
+    }
+}
+
+/// Parses records of the chunks into presized arrays, at the offsets given by the first pass.
+class ObjParser {
+    TexturedMesh& mesh_;
+    std::vector<Pvl::Vec3f>& normals_;
+    std::vector<TexturedMesh::Face>& normalIds_;
+    std::size_t numVertices_;
+    std::size_t numTexCoords_;
+
+    struct Corner {
+        uint32_t v;
+        uint32_t vt;
+        uint32_t vn;
+        bool hasTexCoord;
+        bool hasNormal;
+    };
+
+public:
+    /// Parses vertices, tex coords and faces into the presized mesh, normals and normal indices into the
+    /// separate arrays, as the mesh stores normals per vertex.
+    ObjParser(TexturedMesh& mesh, std::vector<Pvl::Vec3f>& normals, std::vector<TexturedMesh::Face>& normalIds)
+        : mesh_(mesh)
+        , normals_(normals)
+        , normalIds_(normalIds)
+        , numVertices_(mesh.vertices.size())
+        , numTexCoords_(mesh.uv.size()) {}
+
+    void parse(const ObjChunk& chunk) const {
+        std::size_t vi = chunk.firstVertex;
+        std::size_t ti = chunk.firstTexCoord;
+        std::size_t ni = chunk.firstNormal;
+        std::size_t si = 0;
+        std::size_t fi = chunk.segments[0].firstFace;
+        std::vector<Corner> corners;
+        for (const char* line = chunk.begin; line < chunk.end;) {
+            const char* eol = nextLine(line, chunk.end);
+            const char* p = line;
+            switch (classify(p, eol)) {
+            case ObjRecord::VERTEX: {
+                Pvl::Vec3f& v = mesh_.vertices[vi++];
+                for (int i = 0; i < 3; ++i) {
+                    p = scanFloat(p, eol, v[i]);
+                }
+                break;
+            }
+            case ObjRecord::TEX_COORD: {
+                Pvl::Vec2f& t = mesh_.uv[ti++];
+                for (int i = 0; i < 2; ++i) {
+                    p = scanFloat(p, eol, t[i]);
+                }
+                break;
+            }
+            case ObjRecord::NORMAL: {
+                if (normals_.empty()) {
+                    break;
+                }
+                Pvl::Vec3f& n = normals_[ni++];
+                for (int i = 0; i < 3; ++i) {
+                    p = scanFloat(p, eol, n[i]);
+                }
+                break;
+            }
+            case ObjRecord::USE_MATERIAL:
+                fi = chunk.segments[++si].firstFace;
+                break;
+            case ObjRecord::FACE:
+                parseFace(p, eol, vi, ti, ni, corners);
+                // fan triangulation of polygons
+                for (std::size_t i = 2; i < corners.size(); ++i, ++fi) {
+                    const Corner& c0 = corners[0];
+                    const Corner& c1 = corners[i - 1];
+                    const Corner& c2 = corners[i];
+                    mesh_.faces[fi] = TexturedMesh::Face{ c0.v, c1.v, c2.v };
+                    if (!mesh_.texIds.empty() && c0.hasTexCoord && c1.hasTexCoord && c2.hasTexCoord) {
+                        mesh_.texIds[fi] = TexturedMesh::Face{ c0.vt, c1.vt, c2.vt };
+                    }
+                    if (!normalIds_.empty() && c0.hasNormal && c1.hasNormal && c2.hasNormal) {
+                        normalIds_[fi] = TexturedMesh::Face{ c0.vn, c1.vn, c2.vn };
+                    }
+                }
+                break;
+            default:
+                break;
+            }
+            line = eol;
+        }
+    }
+
+private:
+    /// Parses face vertices in forms v, v/vt, v//vn or v/vt/vn.
+    void parseFace(const char* p,
+        const char* eol,
+        const std::size_t vi,
+        const std::size_t ti,
+        const std::size_t ni,
+        std::vector<Corner>& corners) const {
+        corners.clear();
+        for (p = skipBlanks(p, eol); !isEndOfRecord(p, eol); p = skipBlanks(p, eol)) {
+            Corner corner{ 0, 0, 0, false, false };
+            int64_t index;
+            const char* next = scanIndex(p, eol, index);
+            if (next == p) {
+                throw std::runtime_error("Invalid face in .obj file");
+            }
+            corner.v = resolveIndex(index, vi, numVertices_);
+            p = next;
+            if (p < eol && *p == '/') {
+                ++p;
+                next = scanIndex(p, eol, index);
+                if (next != p) {
+                    corner.vt = resolveIndex(index, ti, numTexCoords_);
+                    corner.hasTexCoord = true;
+                    p = next;
+                }
+                if (p < eol && *p == '/') {
+                    ++p;
+                    next = scanIndex(p, eol, index);
+                    if (next != p && !normals_.empty()) {
+                        corner.vn = resolveIndex(index, ni, normals_.size());
+                        corner.hasNormal = true;
+                    }
+                    p = next;
+                }
+            }
+            corners.push_back(corner);
+            // skip whatever follows the indices
+            while (p < eol && !isBlank(*p) && *p != '\n') {
+                ++p;
+            }
+        }
+    }
+};
+
+bool startsWith(const std::string& s, const std::string& p) {
+    return s.size() >= p.size() && s.substr(0, p.size()) == p;
+}
+
+/// Returns the texture file of each material in the material library.
+std::map<std::string, QString> loadMaterialLibrary(const QString& file, const std::string& mtl) {
+    /// \todo path resolving
+    QFileInfo info(file);
+    std::string mtlPath = info.dir().path().toStdString() + "/" + mtl;
+    if (!QFileInfo(mtlPath.c_str()).exists()) {
+        throw std::runtime_error("Material file '" + mtlPath + "' does not exist");
+    }
+
+    std::cout << "opening mtl path = " << mtlPath << std::endl;
+    std::ifstream mtlin(mtlPath);
+    std::map<std::string, QString> textures;
+    std::string material;
+    std::string line;
+    while (std::getline(mtlin, line)) {
+        line = trimmed(line.data(), line.data() + line.size());
+        if (startsWith(line, "newmtl")) {
+            material = trimmed(line.data() + 6, line.data() + line.size());
+        } else if (startsWith(line, "map_Kd")) {
+            std::string atlas = trimmed(line.data() + 6, line.data() + line.size());
+            std::cout << "Material '" << material << "' references atlas " << atlas << std::endl;
+            textures[material] = info.dir().path() + "/" + QString::fromStdString(atlas);
+        }
+    }
+    return textures;
+}
+
+/// Assigns the face ranges to segments, so that faces are sorted by material, and creates the materials.
+std::vector<Material> sortByMaterial(std::vector<ObjChunk>& chunks) {
+    std::map<std::string, std::size_t> indices;
+    std::vector<Material> materials;
+    std::string current;
+    for (ObjChunk& chunk : chunks) {
+        for (ObjSegment& segment : chunk.segments) {
+            if (segment.inherited) {
+                segment.material = current;
+            }
+            current = segment.material;
+            if (segment.numFaces == 0) {
+                continue;
+            }
+            auto iter = indices.find(segment.material);
+            if (iter == indices.end()) {
+                iter = indices.emplace(segment.material, materials.size()).first;
+                materials.emplace_back();
+                materials.back().name = segment.material;
+            }
+            // faces of the material so far, in the order of the file
+            Material& material = materials[iter->second];
+            segment.firstFace = material.numFaces;
+            material.numFaces += segment.numFaces;
+        }
+    }
+    for (std::size_t mi = 1; mi < materials.size(); ++mi) {
+        materials[mi].firstFace = materials[mi - 1].firstFace + materials[mi - 1].numFaces;
+    }
+    for (ObjChunk& chunk : chunks) {
+        for (ObjSegment& segment : chunk.segments) {
+            if (segment.numFaces > 0) {
+                segment.firstFace += materials[indices[segment.material]].firstFace;
+            }
+        }
+    }
+    return materials;
+}
+
+} // namespace
+
+TexturedMesh loadObj(const QString& file, const Progress& prog) {
+    MappedFile mapped(file.toStdString());
+    std::vector<ObjChunk> chunks;
+    for (const auto& range :
+        splitLines(mapped.begin(), mapped.end(), 16 * tbb::this_task_arena::max_concurrency(), 1 << 20)) {
+        ObjChunk chunk;
+        chunk.begin = range.first;
+        chunk.end = range.second;
+        chunks.push_back(chunk);
+    }
+
+    TexturedMesh mesh;
+    std::string mtl;
+    std::size_t numUnknown = 0;
+    // both passes go through the whole file
+    ProgressCounter counter(2 * mapped.size());
+    bool completed = runWithProgress(counter, prog, [&] {
+        // first pass counts the records in each chunk to find out where to put them
+        tbb::parallel_for(std::size_t(0), chunks.size(), [&](std::size_t ci) {
+            if (counter.cancelled()) {
+                return;
+            }
+            countRecords(chunks[ci]);
+            counter.add(chunks[ci].end - chunks[ci].begin);
+        });
+        if (counter.cancelled()) {
+            return;
+        }
+        ObjChunk total;
+        for (ObjChunk& chunk : chunks) {
+            chunk.firstVertex = total.numVertices;
+            chunk.firstTexCoord = total.numTexCoords;
+            chunk.firstNormal = total.numNormals;
+            total.numVertices += chunk.numVertices;
+            total.numTexCoords += chunk.numTexCoords;
+            total.numNormals += chunk.numNormals;
+            total.numFaces += chunk.numFaces;
+            numUnknown += chunk.numUnknown;
+            if (!total.materialLibrary && chunk.materialLibrary) {
+                total.materialLibrary = chunk.materialLibrary;
+                mtl = trimmed(chunk.materialLibrary, nextLine(chunk.materialLibrary, chunk.end));
+                std::cout << "Found material '" << mtl << "'" << std::endl;
+            }
+        }
+        mesh.materials = sortByMaterial(chunks);
+
+        // second pass parses the records into presized arrays
+        mesh.vertices.resize(total.numVertices);
+        mesh.faces.resize(total.numFaces);
+        mesh.uv.resize(total.numTexCoords);
+        if (total.numTexCoords > 0) {
+            mesh.texIds.resize(total.numFaces, TexturedMesh::Face{ 0, 0, 0 });
+        }
+        // unrequested normals are skipped by the parser
+        const bool loadNormals = Parameters::global().loads(PointAttribute::NORMAL);
+        std::vector<Pvl::Vec3f> normals(loadNormals ? total.numNormals : 0);
+        std::vector<TexturedMesh::Face> normalIds;
+        if (!normals.empty()) {
+            normalIds.resize(total.numFaces, TexturedMesh::Face{ NO_NORMAL, NO_NORMAL, NO_NORMAL });
+        }
+        ObjParser parser(mesh, normals, normalIds);
+        tbb::parallel_for(std::size_t(0), chunks.size(), [&](std::size_t ci) {
+            if (counter.cancelled()) {
+                return;
+            }
+            parser.parse(chunks[ci]);
+            counter.add(chunks[ci].end - chunks[ci].begin);
+        });
+        if (counter.cancelled()) {
+            return;
+        }
+
+        if (!normalIds.empty()) {
+            // normals are stored per vertex in the mesh; corners sharing a vertex usually share the normal
+            mesh.normals.resize(mesh.vertices.size(), Pvl::Vec3f(0.f));
+            for (std::size_t fi = 0; fi < mesh.faces.size(); ++fi) {
+                for (int i = 0; i < 3; ++i) {
+                    if (normalIds[fi][i] != NO_NORMAL) {
+                        mesh.normals[mesh.faces[fi][i]] = normals[normalIds[fi][i]];
+                    }
+                }
+            }
+        }
+
+        if (!mtl.empty() && !mesh.faces.empty()) {
+            const std::map<std::string, QString> textures = loadMaterialLibrary(file, mtl);
+            // decode the atlases concurrently
+            tbb::parallel_for(std::size_t(0), mesh.materials.size(), [&](std::size_t mi) {
+                Material& material = mesh.materials[mi];
+                auto iter = textures.find(material.name);
+                if (iter != textures.end()) {
+                    material.texture = makeTexture(iter->second);
+                }
+            });
+        }
+    });
+    if (!completed) {
+        return {};
+    }
+    if (numUnknown > 0) {
+        std::cout << "Skipped " << numUnknown << " unknown lines" << std::endl;
+    }
+
+    const bool hasTexture = std::any_of(mesh.materials.begin(), mesh.materials.end(), [](const Material& m) {
+        return bool(m.texture);
+    });
+    if (!hasTexture) {
+        mesh.texIds.clear();
+        mesh.uv.clear();
+        mesh.materials.clear();
+    }
+    std::cout << "Loaded mesh with " << mesh.vertices.size() << " vertices, " << mesh.uv.size()
+              << " tex coords, " << mesh.faces.size() << " faces and " << mesh.materials.size()
+              << " materials" << std::endl;
+    return mesh;
+}
+
+} // namespace Mpcv
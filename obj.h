@@ -0,0 +1,10 @@
+#pragma once
+
+#include "mesh.h"
+
+namespace Mpcv {
+
+/// Loads Wavefront .obj file, including the texture referenced by the material library.
+TexturedMesh loadObj(const QString& file, const Progress& prog);
+
+} // namespace Mpcv
@@ -0,0 +1,166 @@
+#include "octree.h"
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <tbb/tbb.h>
+
+namespace Mpcv {
+
+namespace {
+
+/// Resolution of the sampling grid of each node; the first point in each cell is sampled into the node
+const int GRID_SIZE = 64;
+
+/// Nodes with fewer points hold all of them and are not subdivided
+const std::size_t LEAF_SIZE = 20000;
+
+/// Limits the subdivision of duplicate points
+const int MAX_LEVEL = 24;
+
+struct BuildNode {
+    Pvl::Box3f box;
+    std::size_t first = 0;
+    std::size_t count = 0;
+    int level = 0;
+    std::array<std::unique_ptr<BuildNode>, 8> children;
+};
+
+int octantIndex(const Pvl::Box3f& box, const Pvl::Vec3f& p) {
+    const Pvl::Vec3f center = box.center();
+    return int(p[0] >= center[0]) | (int(p[1] >= center[1]) << 1) | (int(p[2] >= center[2]) << 2);
+}
+
+Pvl::Box3f octant(const Pvl::Box3f& box, const int index) {
+    const Pvl::Vec3f center = box.center();
+    Pvl::Box3f child = box;
+    for (int i = 0; i < 3; ++i) {
+        if (index & (1 << i)) {
+            child.lower()[i] = center[i];
+        } else {
+            child.upper()[i] = center[i];
+        }
+    }
+    return child;
+}
+
+/// Moves the sample of the node to the beginning of its range of count points and the remaining points,
+/// sorted by octants, after it. Children are then built recursively in parallel.
+void buildNode(BuildNode& node, const std::vector<Pvl::Vec3f>& points, uint32_t* order, const std::size_t count) {
+    const float size = node.box.size()[0];
+    if (count <= LEAF_SIZE || node.level >= MAX_LEVEL || size <= 0.f) {
+        node.count = count;
+        return;
+    }
+    const Pvl::Vec3f lower = node.box.lower();
+    const float scale = GRID_SIZE / size;
+    auto cell = [&](const float x, const int i) { return std::min(int((x - lower[i]) * scale), GRID_SIZE - 1); };
+    std::vector<bool> occupied(GRID_SIZE * GRID_SIZE * GRID_SIZE, false);
+    std::vector<uint32_t> rest;
+    rest.reserve(count);
+    const std::size_t end = node.first + count;
+    std::size_t sampled = node.first;
+    for (std::size_t i = node.first; i < end; ++i) {
+        const Pvl::Vec3f& p = points[order[i]];
+        const int index = (cell(p[2], 2) * GRID_SIZE + cell(p[1], 1)) * GRID_SIZE + cell(p[0], 0);
+        if (!occupied[index]) {
+            occupied[index] = true;
+            order[sampled++] = order[i];
+        } else {
+            rest.push_back(order[i]);
+        }
+    }
+    node.count = sampled - node.first;
+
+    // counting sort of the remaining points by octants
+    std::array<std::size_t, 9> offsets{};
+    for (const uint32_t i : rest) {
+        ++offsets[octantIndex(node.box, points[i]) + 1];
+    }
+    for (int i = 1; i < 9; ++i) {
+        offsets[i] += offsets[i - 1];
+    }
+    std::array<std::size_t, 8> positions;
+    for (int i = 0; i < 8; ++i) {
+        positions[i] = sampled + offsets[i];
+    }
+    for (const uint32_t i : rest) {
+        order[positions[octantIndex(node.box, points[i])]++] = i;
+    }
+    rest = {};
+
+    tbb::parallel_for(0, 8, [&](const int i) {
+        const std::size_t childCount = offsets[i + 1] - offsets[i];
+        if (childCount == 0) {
+            return;
+        }
+        node.children[i] = std::make_unique<BuildNode>();
+        BuildNode& child = *node.children[i];
+        child.box = octant(node.box, i);
+        child.first = sampled + offsets[i];
+        child.level = node.level + 1;
+        buildNode(child, points, order, childCount);
+    });
+}
+
+int flatten(const BuildNode& node, std::vector<OctreeNode>& nodes) {
+    const int index = int(nodes.size());
+    nodes.emplace_back();
+    nodes[index].box = node.box;
+    nodes[index].first = node.first;
+    nodes[index].count = node.count;
+    nodes[index].spacing = node.box.size()[0] / GRID_SIZE;
+    nodes[index].level = node.level;
+    for (int i = 0; i < 8; ++i) {
+        if (node.children[i]) {
+            const int child = flatten(*node.children[i], nodes);
+            nodes[index].children[i] = child;
+        }
+    }
+    return index;
+}
+
+template <typename T>
+void permute(std::vector<T>& values, const std::vector<uint32_t>& order) {
+    if (values.empty()) {
+        return;
+    }
+    std::vector<T> permuted(values.size());
+    tbb::parallel_for(std::size_t(0), order.size(), [&](std::size_t i) { permuted[i] = values[order[i]]; });
+    values = std::move(permuted);
+}
+
+} // namespace
+
+PointOctree::PointOctree(TexturedMesh& cloud) {
+    if (cloud.vertices.empty() || cloud.vertices.size() > std::numeric_limits<uint32_t>::max()) {
+        return;
+    }
+    // nodes are cubes, so that the sampling grid has the same spacing in all dimensions
+    Pvl::Box3f box;
+    for (const Pvl::Vec3f& p : cloud.vertices) {
+        box.extend(p);
+    }
+    const float size = std::max({ box.size()[0], box.size()[1], box.size()[2] });
+    BuildNode root;
+    root.box = Pvl::Box3f(box.lower(), box.lower() + Pvl::Vec3f(size));
+
+    std::vector<uint32_t> order(cloud.vertices.size());
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        order[i] = uint32_t(i);
+    }
+    buildNode(root, cloud.vertices, order.data(), order.size());
+    flatten(root, nodes_);
+
+    permute(cloud.vertices, order);
+    permute(cloud.normals, order);
+    permute(cloud.colors, order);
+    permute(cloud.times, order);
+    permute(cloud.classes, order);
+    for (auto& p : cloud.scalars) {
+        permute(p.second, order);
+    }
+    std::cout << "Built octree with " << nodes_.size() << " nodes" << std::endl;
+}
+
+} // namespace Mpcv
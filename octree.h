@@ -0,0 +1,53 @@
+#pragma once
+
+#include "mesh.h"
+#include "pvl/Box.hpp"
+#include <array>
+
+namespace Mpcv {
+
+/// Node of the point octree, owning a contiguous range of the reordered points.
+struct OctreeNode {
+    Pvl::Box3f box;
+
+    ///< Points [first, first + count) belong to the node
+    std::size_t first = 0;
+    std::size_t count = 0;
+
+    ///< Minimal distance of the points sampled into the node
+    float spacing = 0.f;
+    int level = 0;
+
+    ///< Indices of the child nodes, -1 for missing children
+    std::array<int, 8> children;
+
+    OctreeNode() {
+        children.fill(-1);
+    }
+};
+
+/// \brief Octree of nested, subsampled point sets, similar to the Potree format.
+///
+/// Each node holds a sample of the points in its box, the remaining points are passed to its children. A node
+/// drawn together with its ancestors gives the cloud at the density of the node. Points of each node are
+/// stored contiguously, so a node can be drawn as a range of the vertex buffer.
+class PointOctree {
+    std::vector<OctreeNode> nodes_;
+
+public:
+    PointOctree() = default;
+
+    /// Builds the octree, reordering the points and all their attributes into the order of the nodes.
+    explicit PointOctree(TexturedMesh& cloud);
+
+    bool empty() const {
+        return nodes_.empty();
+    }
+
+    /// Nodes of the octree, the first one is the root.
+    const std::vector<OctreeNode>& nodes() const {
+        return nodes_;
+    }
+};
+
+} // namespace Mpcv
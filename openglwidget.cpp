@@ -1,12 +1,19 @@
 #include "openglwidget.h"
 #include "framebuffer.h"
+#include "parameters.h"
+#include "ply.h"
 #include "pvl/CloudUtils.hpp"
 #include "pvl/QuadricDecimator.hpp"
 #include "pvl/Refinement.hpp"
 #include "pvl/Simplification.hpp"
 #include "pvl/TriangleMesh.hpp"
 #include "renderer.h"
+#include "shaders.h"
 #include <QPainter>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <queue>
 #include <sstream>
 #include <tbb/tbb.h>
 
@@ -21,6 +28,57 @@
 
 using namespace Mpcv;
 
+namespace {
+
+/// Maximum number of terrain tiles loaded in a single frame, the remaining tiles are loaded later
+const int TERRAIN_LOADS_PER_FRAME = 8;
+
+/// Number of tiles of each terrain kept in memory
+const std::size_t TERRAIN_CACHE_SIZE = 256;
+
+/// Number of faces in a chunk culled by the view frustum
+const std::size_t CHUNK_SIZE = 1 << 16;
+
+/// Maximum number of octree nodes read from disk at once
+const std::size_t STREAM_LOADS_IN_FLIGHT = 8;
+
+/// Points of streamed clouds kept in memory, as a multiple of the point budget
+const std::size_t STREAM_CACHE_FACTOR = 2;
+
+void drawBoxFaces(const Pvl::Box3f& box) {
+    const Pvl::Vec3f& l = box.lower();
+    const Pvl::Vec3f& u = box.upper();
+    glBegin(GL_QUADS);
+    for (int i = 0; i < 3; ++i) {
+        const int j = (i + 1) % 3;
+        const int k = (i + 2) % 3;
+        for (const float x : { l[i], u[i] }) {
+            Pvl::Vec3f p;
+            p[i] = x;
+            p[j] = l[j];
+            p[k] = l[k];
+            glVertex3f(p[0], p[1], p[2]);
+            p[j] = u[j];
+            glVertex3f(p[0], p[1], p[2]);
+            p[k] = u[k];
+            glVertex3f(p[0], p[1], p[2]);
+            p[j] = l[j];
+            glVertex3f(p[0], p[1], p[2]);
+        }
+    }
+    glEnd();
+}
+
+float distanceToBox(const Pvl::Vec3f& p, const Pvl::Box3f& box) {
+    Pvl::Vec3f closest;
+    for (int i = 0; i < 3; ++i) {
+        closest[i] = std::max(box.lower()[i], std::min(p[i], box.upper()[i]));
+    }
+    return Pvl::norm(p - closest);
+}
+
+} // namespace
+
 void OpenGLWidget::resizeGL(const int width, const int height) {
     std::cout << "Resizing " << width << " " << height << std::endl;
     glViewport(0, 0, width, height);
@@ -44,6 +102,34 @@ void OpenGLWidget::resizeGL(const int width, const int height) {
 
 void OpenGLWidget::initializeGL() {
     initializeOpenGLFunctions();
+    if (Parameters::global().occlusionCulling) {
+        gl30_ = context()->versionFunctions<QOpenGLFunctions_3_0>();
+        if (gl30_ && gl30_->initializeOpenGLFunctions()) {
+            std::cout << "Using occlusion culling" << std::endl;
+        } else {
+            std::cout << "Occlusion culling requires OpenGL 3.0, disabling" << std::endl;
+            gl30_ = nullptr;
+        }
+    }
+    if (Parameters::global().shaders) {
+        gl33_ = context()->versionFunctions<QOpenGLFunctions_3_3_Core>();
+        if (!vbos_ || !gl33_ || !gl33_->initializeOpenGLFunctions()) {
+            std::cout << "Shaders require OpenGL 3.3 and vertex buffers, using the fixed-function pipeline"
+                      << std::endl;
+            gl33_ = nullptr;
+        } else {
+            program_ = std::make_unique<QOpenGLShaderProgram>();
+            if (!program_->addShaderFromSourceCode(QOpenGLShader::Vertex, MESH_VERTEX_SHADER) ||
+                !program_->addShaderFromSourceCode(QOpenGLShader::Fragment, MESH_FRAGMENT_SHADER) ||
+                !program_->link()) {
+                std::cout << "Cannot build shaders: " << program_->log().toStdString() << std::endl;
+                program_.reset();
+                gl33_ = nullptr;
+            } else {
+                std::cout << "Using shaders" << std::endl;
+            }
+        }
+    }
     glClearColor(0, 0, 0, 0);
 
     glEnable(GL_DEPTH_TEST);
@@ -105,16 +191,310 @@ void OpenGLWidget::initializeGL() {
     glPointSize(pointSize_);
 }
 
+void OpenGLWidget::drawMesh(const MeshData& mesh) {
+    if (mesh.vao != 0) {
+        drawMeshShaded(mesh);
+        return;
+    }
+    if (vbos_) {
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    }
+
+    bool useNormals = mesh.hasNormals();
+    bool useColors;
+    if (mesh.pointCloud()) {
+        // for point clouds, point colors are considered a texture here
+        useColors = mesh.hasColors() && enableTextures_;
+    } else {
+        useColors = mesh.hasColors() || (enableAo_ && mesh.hasAo());
+    }
+    bool useClasses = enableClasses_ && mesh.hasClasses();
+    bool useTexture = enableTextures_ && mesh.hasTexture();
+
+    if (useColors || useTexture || !useNormals) {
+        glDisable(GL_LIGHTING);
+    }
+    if (useNormals) {
+        glEnableClientState(GL_NORMAL_ARRAY);
+    }
+    // AO is interpolated, as are the averaged vertex normals of indexed meshes
+    const bool smooth = useColors || (useNormals && !mesh.pointCloud() && mesh.counts.indices > 0);
+    if (smooth) {
+        glShadeModel(GL_SMOOTH);
+    }
+    if (useColors) {
+        glEnableClientState(GL_COLOR_ARRAY);
+    }
+    if (useClasses) {
+        glEnableClientState(GL_COLOR_ARRAY);
+    }
+    if (useTexture) {
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    }
+    glEnableClientState(GL_VERTEX_ARRAY);
+
+    std::size_t numVert = mesh.counts.vertices;
+    std::size_t numNorm = mesh.counts.normals;
+    std::size_t numClr = mesh.counts.vertexColors;
+    std::size_t numCls = mesh.counts.classColors;
+    // clouds with octree are thinned by the point budget instead
+    int stride = mesh.pointCloud() && mesh.octree.empty() && !mesh.streamedNode ? int(pointStride_) : 0;
+
+    if (!vbos_) {
+        glVertexPointer(3, GL_FLOAT, stride * 3 * sizeof(float), mesh.vis.vertices.data());
+        if (useNormals) {
+            glNormalPointer(GL_FLOAT, stride * 3 * sizeof(float), mesh.vis.normals.data());
+        }
+        if (useClasses && !enableAo_) {
+            glColorPointer(
+                3, GL_UNSIGNED_BYTE, stride * 3 * sizeof(uint8_t), mesh.vis.classColors.data());
+        } else if (useColors) {
+            glColorPointer(
+                3, GL_UNSIGNED_BYTE, stride * 3 * sizeof(uint8_t), mesh.vis.vertexColors.data());
+        }
+        if (useTexture) {
+            // never used by pc
+            glTexCoordPointer(2, GL_FLOAT, 0, mesh.vis.uv.data());
+        }
+    } else {
+        glVertexPointer(3, GL_FLOAT, stride * 3 * sizeof(float), (void*)0);
+        if (useNormals) {
+            glNormalPointer(GL_FLOAT, stride * 3 * sizeof(float), (void*)(numVert * sizeof(float)));
+        }
+        if (useClasses && !enableAo_) {
+            glColorPointer(3,
+                GL_UNSIGNED_BYTE,
+                stride * 3 * sizeof(uint8_t),
+                (void*)((numVert + numNorm) * sizeof(float) + numClr * sizeof(uint8_t)));
+        } else if (useColors) {
+            glColorPointer(3,
+                GL_UNSIGNED_BYTE,
+                stride * 3 * sizeof(uint8_t),
+                (void*)((numVert + numNorm) * sizeof(float)));
+        }
+        if (useTexture) {
+            glTexCoordPointer(2,
+                GL_FLOAT,
+                0,
+                (void*)((numVert + numNorm) * sizeof(float) + (numClr + numCls) * sizeof(uint8_t)));
+        }
+    }
+
+    drawPrimitives(mesh, useTexture, stride);
+
+    glDisableClientState(GL_VERTEX_ARRAY);
+    if (useTexture) {
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    if (useColors) {
+        glDisableClientState(GL_COLOR_ARRAY);
+    }
+    if (smooth) {
+        glShadeModel(GL_FLAT);
+    }
+    if (useClasses) {
+        glDisableClientState(GL_COLOR_ARRAY);
+    }
+    if (useNormals) {
+        glDisableClientState(GL_NORMAL_ARRAY);
+    }
+    glEnable(GL_LIGHTING);
+
+    if (vbos_) {
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+}
+
+void OpenGLWidget::drawPrimitives(const MeshData& mesh, const bool useTexture, const int stride) {
+    if (mesh.pointCloud() && !mesh.octree.empty()) {
+        for (const int index : mesh.visibleNodes) {
+            const OctreeNode& node = mesh.octree.nodes()[index];
+            glDrawArrays(GL_POINTS, node.first, node.count);
+        }
+        stats_.drawCalls += mesh.visibleNodes.size();
+    } else if (mesh.pointCloud()) {
+        glDrawArrays(GL_POINTS, 0, mesh.counts.vertices / 3 / std::max(stride, 1));
+        ++stats_.drawCalls;
+    } else if (useTexture) {
+        // faces are sorted by material, so each texture is drawn by a single call
+        for (const MeshData::Batch& batch : mesh.batches) {
+            glBindTexture(GL_TEXTURE_2D, batch.texture);
+            drawVisibleFaces(mesh, batch.firstFace, batch.numFaces, true);
+        }
+    } else {
+        drawVisibleFaces(mesh, 0, mesh.numFaces(), true);
+    }
+}
+
+void OpenGLWidget::drawFaces(const MeshData& mesh, const std::size_t firstFace, const std::size_t numFaces) {
+    ++stats_.drawCalls;
+    if (mesh.counts.indices == 0) {
+        glDrawArrays(GL_TRIANGLES, 3 * firstFace, 3 * numFaces);
+    } else if (mesh.vao != 0) {
+        // the element buffer is bound with the vertex array, rebinding it would detach it from the array
+        glDrawElements(
+            GL_TRIANGLES, 3 * numFaces, GL_UNSIGNED_INT, (void*)(3 * firstFace * sizeof(uint32_t)));
+    } else if (vbos_) {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
+        glDrawElements(
+            GL_TRIANGLES, 3 * numFaces, GL_UNSIGNED_INT, (void*)(3 * firstFace * sizeof(uint32_t)));
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    } else {
+        glDrawElements(GL_TRIANGLES, 3 * numFaces, GL_UNSIGNED_INT, mesh.vis.indices.data() + 3 * firstFace);
+    }
+}
+
+void OpenGLWidget::drawVisibleFaces(const MeshData& mesh,
+    const std::size_t firstFace,
+    const std::size_t numFaces,
+    const bool queries) {
+    if (mesh.chunks.empty()) {
+        drawFaces(mesh, firstFace, numFaces);
+        return;
+    }
+    const Frustum frustum = viewFrustum();
+    SrsConv conv(mesh.mesh.srs, camera_.srs());
+    const bool occlusion = gl30_ != nullptr;
+    if (occlusion && mesh.visibility.size() != mesh.chunks.size()) {
+        mesh.visibility.resize(mesh.chunks.size());
+    }
+    std::vector<std::size_t> occluded;
+    std::vector<std::size_t> tested;
+    // consecutive visible chunks are drawn by a single call
+    std::size_t first = firstFace;
+    std::size_t count = 0;
+    for (std::size_t ci = 0; ci < mesh.chunks.size(); ++ci) {
+        const MeshChunk& chunk = mesh.chunks[ci];
+        if (chunk.firstFace < firstFace || chunk.firstFace >= firstFace + numFaces) {
+            continue;
+        }
+        if (!frustum.intersects(Pvl::Box3f(conv(chunk.box.lower()), conv(chunk.box.upper())))) {
+            if (queries) {
+                ++stats_.frustumCulled;
+            }
+            continue;
+        }
+        if (occlusion) {
+            MeshData::ChunkVisibility& visibility = mesh.visibility[ci];
+            if (visibility.pending) {
+                // results of the previous frames; never waits for the result, keeping the last one instead
+                GLuint available = 0;
+                gl30_->glGetQueryObjectuiv(visibility.query, GL_QUERY_RESULT_AVAILABLE, &available);
+                if (available) {
+                    GLuint samples = 0;
+                    gl30_->glGetQueryObjectuiv(visibility.query, GL_QUERY_RESULT, &samples);
+                    visibility.visible = samples > 0;
+                    visibility.pending = false;
+                }
+            }
+            if (!visibility.visible) {
+                occluded.push_back(ci);
+                continue;
+            }
+            if (!visibility.pending) {
+                tested.push_back(ci);
+            }
+        }
+        if (count > 0 && first + count == chunk.firstFace) {
+            count += chunk.numFaces;
+            continue;
+        }
+        if (count > 0) {
+            drawFaces(mesh, first, count);
+        }
+        first = chunk.firstFace;
+        count = chunk.numFaces;
+    }
+    if (count > 0) {
+        drawFaces(mesh, first, count);
+    }
+    if (occlusion && queries) {
+        stats_.occluded += occluded.size();
+        queryOcclusion(mesh, occluded, tested);
+    }
+}
+
+void OpenGLWidget::queryOcclusion(const MeshData& mesh,
+    const std::vector<std::size_t>& occluded,
+    const std::vector<std::size_t>& tested) {
+    SrsConv conv(mesh.mesh.srs, camera_.srs());
+    const float nearDist = 0.001f * Pvl::norm(camera_.eye() - camera_.target());
+    // returns false if the box cannot be queried, as it is clipped by the near plane
+    auto query = [&](const std::size_t ci) {
+        MeshData::ChunkVisibility& visibility = mesh.visibility[ci];
+        const MeshChunk& chunk = mesh.chunks[ci];
+        const Pvl::Box3f box(conv(chunk.box.lower()), conv(chunk.box.upper()));
+        if (distanceToBox(camera_.eye(), box) <= 2.f * nearDist) {
+            visibility.visible = true;
+            visibility.pending = false;
+            return false;
+        }
+        if (visibility.query == 0) {
+            gl30_->glGenQueries(1, &visibility.query);
+        }
+        gl30_->glBeginQuery(GL_SAMPLES_PASSED, visibility.query);
+        drawBoxFaces(box);
+        gl30_->glEndQuery(GL_SAMPLES_PASSED);
+        visibility.pending = true;
+        return true;
+    };
+
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDepthMask(GL_FALSE);
+    // visible chunks are tested to find out if they got hidden
+    for (const std::size_t ci : tested) {
+        query(ci);
+    }
+    std::vector<bool> queried(occluded.size());
+    for (std::size_t i = 0; i < occluded.size(); ++i) {
+        queried[i] = query(occluded[i]);
+    }
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthMask(GL_TRUE);
+
+    for (std::size_t i = 0; i < occluded.size(); ++i) {
+        const MeshChunk& chunk = mesh.chunks[occluded[i]];
+        if (queried[i]) {
+            // the GPU waits for the query, the CPU does not
+            gl30_->glBeginConditionalRender(mesh.visibility[occluded[i]].query, GL_QUERY_WAIT);
+            drawFaces(mesh, chunk.firstFace, chunk.numFaces);
+            gl30_->glEndConditionalRender();
+        } else {
+            drawFaces(mesh, chunk.firstFace, chunk.numFaces);
+        }
+    }
+}
+
+void OpenGLWidget::deleteQueries(MeshData& data) {
+    if (gl30_) {
+        for (const MeshData::ChunkVisibility& visibility : data.visibility) {
+            if (visibility.query != 0) {
+                gl30_->glDeleteQueries(1, &visibility.query);
+            }
+        }
+    }
+    data.visibility.clear();
+}
+
+Frustum OpenGLWidget::viewFrustum() const {
+    const float dist = Pvl::norm(camera_.eye() - camera_.target());
+    return Frustum(camera_, 0.001f * dist, 1000.f * dist);
+}
+
 void OpenGLWidget::paintGL() {
     // std::cout << "Called paintGL" << std::endl;
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     // glClearColor(0, 0.1, 0.3, 1);
     glClearColor(0.5, 0.5, 0.6, 1);
     glEnable(GL_DEPTH_TEST); // gets disabled by text rendering
-    if (meshes_.empty()) {
+    if (meshes_.empty() && partial_.empty()) {
         glFlush();
         return;
     }
+    ++frame_;
+    terrainLoads_ = TERRAIN_LOADS_PER_FRAME;
+    stats_ = {};
     // updateLights(camera_);
 
     //    glLoadIdentity();
@@ -139,6 +519,16 @@ void OpenGLWidget::paintGL() {
         Pvl::Vec3f eye = camera_.eye();
         Pvl::Vec3f up = camera_.up();
         gluLookAt(eye[0], eye[1], eye[2], target[0], target[1], target[2], up[0], up[1], up[2]);
+        if (program_) {
+            // same transforms for the shader path
+            projection_.setToIdentity();
+            projection_.perspective(
+                fov_ * 180.f / M_PI, float(width()) / height(), 0.001f * dist, 1000.f * dist);
+            modelView_.setToIdentity();
+            modelView_.lookAt(QVector3D(eye[0], eye[1], eye[2]),
+                QVector3D(target[0], target[1], target[2]),
+                QVector3D(up[0], up[1], up[2]));
+        }
     }
     //  updateLights(camera_);
 
@@ -148,117 +538,33 @@ void OpenGLWidget::paintGL() {
     // glEnable(GL_TEXTURE_2D);
     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
     glPointSize(pointSize_);
+    receiveStreamedNodes();
+    const bool streamComplete = selectOctreeNodes();
+    bool terrainComplete = true;
     for (const auto& p : meshes_) {
-        const MeshData& mesh = p.second;
-        if (!mesh.enabled) {
+        if (!p.second.enabled) {
             continue;
         }
-
-        if (vbos_) {
-            glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
-        }
-
-        bool useNormals = mesh.hasNormals();
-        bool useColors;
-        if (mesh.pointCloud()) {
-            // for point clouds, point colors are considered a texture here
-            useColors = mesh.hasColors() && enableTextures_;
-        } else {
-            useColors = mesh.hasColors() || (enableAo_ && mesh.hasAo());
-        }
-        bool useClasses = enableClasses_ && mesh.hasClasses();
-        bool useTexture = enableTextures_ && mesh.hasTexture();
-
-        if (useColors || useTexture || !useNormals) {
-            glDisable(GL_LIGHTING);
-        }
-        if (useNormals) {
-            glEnableClientState(GL_NORMAL_ARRAY);
-        }
-        if (useColors) {
-            glEnableClientState(GL_COLOR_ARRAY);
-            glShadeModel(GL_SMOOTH); // for AO
-        }
-        if (useClasses) {
-            glEnableClientState(GL_COLOR_ARRAY);
-        }
-        if (useTexture) {
-            glBindTexture(GL_TEXTURE_2D, mesh.texture);
-            glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-        }
-        glEnableClientState(GL_VERTEX_ARRAY);
-
-        int numVert = mesh.vis.vertices.size();
-        int numNorm = mesh.vis.normals.size();
-        int numClr = mesh.vis.vertexColors.size();
-        int numCls = mesh.vis.classColors.size();
-        int stride = mesh.pointCloud() ? int(pointStride_) : 0;
-
-        if (!vbos_) {
-            glVertexPointer(3, GL_FLOAT, stride * 3 * sizeof(float), mesh.vis.vertices.data());
-            if (useNormals) {
-                glNormalPointer(GL_FLOAT, stride * 3 * sizeof(float), mesh.vis.normals.data());
-            }
-            if (useClasses && !enableAo_) {
-                glColorPointer(
-                    3, GL_UNSIGNED_BYTE, stride * 3 * sizeof(uint8_t), mesh.vis.classColors.data());
-            } else if (useColors) {
-                glColorPointer(
-                    3, GL_UNSIGNED_BYTE, stride * 3 * sizeof(uint8_t), mesh.vis.vertexColors.data());
+        auto terrain = terrains_.find(p.first);
+        auto stream = streamed_.find(p.first);
+        if (terrain != terrains_.end()) {
+            terrainComplete = drawTerrain(terrain->second) && terrainComplete;
+        } else if (stream != streamed_.end()) {
+            stream->second.numPoints = 0;
+            for (const int index : stream->second.visibleNodes) {
+                const MeshData& node = stream->second.nodes.at(index).data;
+                drawMesh(node);
+                stream->second.numPoints += node.mesh.vertices.size();
             }
-            if (useTexture) {
-                // never used by pc
-                glTexCoordPointer(2, GL_FLOAT, 0, mesh.vis.uv.data());
-            }
-        } else {
-            glVertexPointer(3, GL_FLOAT, stride * 3 * sizeof(float), (void*)0);
-            if (useNormals) {
-                glNormalPointer(GL_FLOAT, stride * 3 * sizeof(float), (void*)(numVert * sizeof(float)));
-            }
-            if (useClasses && !enableAo_) {
-                glColorPointer(3,
-                    GL_UNSIGNED_BYTE,
-                    stride * 3 * sizeof(uint8_t),
-                    (void*)((numVert + numNorm) * sizeof(float) + numClr * sizeof(uint8_t)));
-            } else if (useColors) {
-                glColorPointer(3,
-                    GL_UNSIGNED_BYTE,
-                    stride * 3 * sizeof(uint8_t),
-                    (void*)((numVert + numNorm) * sizeof(float)));
-            }
-            if (useTexture) {
-                glTexCoordPointer(2,
-                    GL_FLOAT,
-                    0,
-                    (void*)((numVert + numNorm) * sizeof(float) + (numClr + numCls) * sizeof(uint8_t)));
-            }
-        }
-
-        if (mesh.pointCloud()) {
-            glDrawArrays(GL_POINTS, 0, mesh.vis.vertices.size() / 3 / stride);
         } else {
-            glDrawArrays(GL_TRIANGLES, 0, mesh.vis.vertices.size() / 3);
-        }
-
-        glDisableClientState(GL_VERTEX_ARRAY);
-        if (useTexture) {
-            glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-            glBindTexture(GL_TEXTURE_2D, 0);
-        }
-        if (useColors) {
-            glDisableClientState(GL_COLOR_ARRAY);
-            glShadeModel(GL_FLAT);
-        }
-        if (useClasses) {
-            glDisableClientState(GL_COLOR_ARRAY);
+            drawMesh(p.second);
         }
-        if (useNormals) {
-            glDisableClientState(GL_NORMAL_ARRAY);
-        }
-        glEnable(GL_LIGHTING);
-
-        if (vbos_) {
-            glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    evictStreamedNodes();
+    // meshes being loaded
+    for (const auto& p : partial_) {
+        for (const MeshData& part : p.second) {
+            drawMesh(part);
         }
     }
 
@@ -276,11 +582,17 @@ void OpenGLWidget::paintGL() {
             }
 
             glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+            if (mesh.vao != 0) {
+                // drawFaces expects the element buffer of the shader path to be bound already
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
+            }
             glEnableClientState(GL_VERTEX_ARRAY);
-            glVertexPointer(3, GL_FLOAT, 0, (void*)0);
-            glDrawArrays(GL_TRIANGLES, 0, mesh.vis.vertices.size() / 3);
+            // positions are interleaved with other attributes in the shader path
+            glVertexPointer(3, GL_FLOAT, mesh.vao != 0 ? sizeof(ShaderVertex) : 0, (void*)0);
+            drawVisibleFaces(mesh, 0, mesh.numFaces(), false);
             glDisableClientState(GL_VERTEX_ARRAY);
             glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
         }
         glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
     }
@@ -373,12 +685,283 @@ void OpenGLWidget::paintGL() {
             numFaces += p.second.mesh.faces.size();
         }
     }
+    for (const auto& p : terrains_) {
+        if (meshes_.at(p.first).enabled) {
+            numVertex += p.second.numVertices;
+            numFaces += p.second.numFaces;
+        }
+    }
+    for (const auto& p : streamed_) {
+        if (meshes_.at(p.first).enabled) {
+            numVertex += p.second.numPoints;
+        }
+    }
+    painter.drawText(30, height() - 90, "Draw calls:");
+    painter.drawText(100, height() - 90, QString("%L1").arg(stats_.drawCalls));
+    painter.drawText(30, height() - 70, "Culled:");
+    painter.drawText(100,
+        height() - 70,
+        QString("%L1 chunks outside view, %L2 occluded").arg(stats_.frustumCulled).arg(stats_.occluded));
     painter.drawText(30, height() - 50, "Vertices:");
     painter.drawText(100, height() - 50, QString("%L1").arg(numVertex));
     painter.drawText(30, height() - 30, "Faces:");
     painter.drawText(100, height() - 30, QString("%L1").arg(numFaces));
     painter.end();
     glPopAttrib();
+
+    if (!terrainComplete || !streamComplete) {
+        // load the missing tiles and nodes in the next frame
+        update();
+    }
+}
+
+bool OpenGLWidget::drawTerrain(TerrainData& terrain) {
+    std::vector<TerrainData::Tile*> selected;
+    bool complete = false;
+    if (TerrainData::Tile* root = terrainTile(terrain, TerrainTileId{})) {
+        complete = selectTerrainTiles(terrain, TerrainTileId{}, *root, selected);
+    }
+    terrain.numVertices = 0;
+    terrain.numFaces = 0;
+    for (TerrainData::Tile* tile : selected) {
+        drawMesh(tile->data);
+        terrain.numVertices += tile->data.mesh.vertices.size();
+        terrain.numFaces += tile->data.mesh.faces.size();
+    }
+    evictTerrainTiles(terrain);
+    return complete;
+}
+
+bool OpenGLWidget::selectTerrainTiles(TerrainData& terrain,
+    const TerrainTileId& id,
+    TerrainData::Tile& tile,
+    std::vector<TerrainData::Tile*>& selected) {
+    const MeshData& data = tile.data;
+    const std::vector<TerrainTileId> children = terrain.source->children(id);
+    if (children.empty() || data.mesh.vertices.empty()) {
+        selected.push_back(&tile);
+        return true;
+    }
+    // distance to the closest point of the tile
+    SrsConv conv(data.mesh.srs, camera_.srs());
+    const Pvl::Box3f box(conv(data.box.lower()), conv(data.box.upper()));
+    const float dist = std::max(distanceToBox(camera_.eye(), box), 1.e-3f);
+    // spacing of the samples projected on the screen, in pixels
+    const float error = terrain.source->error(id.level) * height() / (2.f * dist * std::tan(0.5f * fov_));
+    if (error <= Parameters::global().terrainError) {
+        selected.push_back(&tile);
+        return true;
+    }
+
+    std::vector<TerrainData::Tile*> childTiles;
+    for (const TerrainTileId& child : children) {
+        if (TerrainData::Tile* childTile = terrainTile(terrain, child)) {
+            childTiles.push_back(childTile);
+        }
+    }
+    if (childTiles.size() < children.size()) {
+        // draw the coarse tile until all its children are loaded
+        selected.push_back(&tile);
+        return false;
+    }
+    bool complete = true;
+    for (std::size_t i = 0; i < children.size(); ++i) {
+        complete = selectTerrainTiles(terrain, children[i], *childTiles[i], selected) && complete;
+    }
+    return complete;
+}
+
+OpenGLWidget::TerrainData::Tile* OpenGLWidget::terrainTile(TerrainData& terrain, const TerrainTileId& id) {
+    auto iter = terrain.tiles.find(id);
+    if (iter != terrain.tiles.end()) {
+        iter->second.lastFrame = frame_;
+        return &iter->second;
+    }
+    if (terrainLoads_ <= 0) {
+        return nullptr;
+    }
+    --terrainLoads_;
+    TexturedMesh mesh;
+    try {
+        mesh = terrain.source->loadTile(id);
+    } catch (const std::exception& e) {
+        // keep the tile empty, so that it is not read again in every frame
+        std::cout << "Cannot load terrain tile: " << e.what() << std::endl;
+        mesh.srs = terrain.source->srs();
+    }
+    TerrainData::Tile& tile = terrain.tiles[id];
+    tile.lastFrame = frame_;
+    tile.data.mesh = std::move(mesh);
+    upload(tile.data, camera_.srs(), false);
+    // tiles share the texture of the terrain
+    for (MeshData::Batch& batch : tile.data.batches) {
+        batch.texture = terrain.texture;
+    }
+    return &tile;
+}
+
+void OpenGLWidget::evictTerrainTiles(TerrainData& terrain) {
+    if (terrain.tiles.size() <= TERRAIN_CACHE_SIZE) {
+        return;
+    }
+    // least recently used first; the root is always kept
+    std::vector<std::pair<std::size_t, TerrainTileId>> unused;
+    for (const auto& p : terrain.tiles) {
+        if (p.second.lastFrame < frame_ && p.first.level > 0) {
+            unused.emplace_back(p.second.lastFrame, p.first);
+        }
+    }
+    std::sort(unused.begin(), unused.end());
+    const std::size_t count = std::min(unused.size(), terrain.tiles.size() - TERRAIN_CACHE_SIZE);
+    for (std::size_t i = 0; i < count; ++i) {
+        auto iter = terrain.tiles.find(unused[i].second);
+        deleteBuffers(iter->second.data);
+        terrain.tiles.erase(iter);
+    }
+}
+
+bool OpenGLWidget::selectOctreeNodes() {
+    struct Candidate {
+        float spacing; ///< Spacing of the node points on the screen, in pixels
+        const std::vector<OctreeNode>* nodes;
+        MeshData* data; ///< Cloud with the octree in memory
+        StreamedCloud* stream; ///< Cloud with the octree on disk
+        int index;
+
+        bool operator<(const Candidate& other) const {
+            return spacing < other.spacing;
+        }
+    };
+    const float dist = Pvl::norm(camera_.eye() - camera_.target());
+    const Frustum frustum = viewFrustum();
+    const float pixelsPerUnit = height() / (2.f * std::tan(0.5f * fov_));
+    std::priority_queue<Candidate> queue;
+    auto push = [&](Candidate candidate, const Srs& srs) {
+        const OctreeNode& node = (*candidate.nodes)[candidate.index];
+        SrsConv conv(srs, camera_.srs());
+        const Pvl::Box3f box(conv(node.box.lower()), conv(node.box.upper()));
+        if (!frustum.intersects(box)) {
+            return;
+        }
+        const float nodeDist = std::max(distanceToBox(camera_.eye(), box), 1.e-3f * dist);
+        candidate.spacing = node.spacing * pixelsPerUnit / nodeDist;
+        // nodes adding less than a point per pixel are not visible; the root is always drawn
+        if (candidate.index == 0 || candidate.spacing >= 1.f) {
+            queue.push(candidate);
+        }
+    };
+    for (auto& p : meshes_) {
+        MeshData& data = p.second;
+        data.visibleNodes.clear();
+        if (data.enabled && !data.octree.empty()) {
+            push(Candidate{ 0.f, &data.octree.nodes(), &data, nullptr, 0 }, data.mesh.srs);
+        }
+    }
+    std::size_t numLoads = 0;
+    for (auto& p : streamed_) {
+        StreamedCloud& stream = p.second;
+        stream.visibleNodes.clear();
+        numLoads += stream.pending.size();
+        if (meshes_.at(p.first).enabled && !stream.source->nodes().empty()) {
+            push(Candidate{ 0.f, &stream.source->nodes(), nullptr, &stream, 0 }, stream.source->srs());
+        }
+    }
+    // parents are always selected before their children, so the drawn points are never missing a level
+    const std::size_t budget = Parameters::global().pointBudget / std::size_t(pointStride_);
+    std::size_t numPoints = 0;
+    bool complete = true;
+    while (!queue.empty()) {
+        const Candidate candidate = queue.top();
+        queue.pop();
+        const OctreeNode& node = (*candidate.nodes)[candidate.index];
+        if (numPoints + node.count > budget) {
+            break;
+        }
+        numPoints += node.count;
+        if (candidate.data) {
+            candidate.data->visibleNodes.push_back(candidate.index);
+        } else {
+            StreamedCloud& stream = *candidate.stream;
+            auto iter = stream.nodes.find(candidate.index);
+            if (iter == stream.nodes.end()) {
+                // read the node in the background, its children are selected once it is loaded
+                complete = false;
+                if (stream.pending.find(candidate.index) == stream.pending.end() &&
+                    numLoads < STREAM_LOADS_IN_FLIGHT) {
+                    const CachedOctree* source = stream.source.get();
+                    const int index = candidate.index;
+                    stream.pending[index] =
+                        std::async(std::launch::async, [source, index] { return source->loadNode(index); });
+                    ++numLoads;
+                }
+                continue;
+            }
+            iter->second.lastFrame = frame_;
+            stream.visibleNodes.push_back(candidate.index);
+        }
+        for (const int child : node.children) {
+            if (child >= 0) {
+                Candidate next = candidate;
+                next.index = child;
+                push(next, candidate.data ? candidate.data->mesh.srs : candidate.stream->source->srs());
+            }
+        }
+    }
+    return complete;
+}
+
+void OpenGLWidget::receiveStreamedNodes() {
+    for (auto& p : streamed_) {
+        StreamedCloud& stream = p.second;
+        for (auto iter = stream.pending.begin(); iter != stream.pending.end();) {
+            if (iter->second.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                ++iter;
+                continue;
+            }
+            TexturedMesh mesh;
+            try {
+                mesh = iter->second.get();
+            } catch (const std::exception& e) {
+                // keep the node empty, so that it is not read again in every frame
+                std::cout << "Cannot read octree node: " << e.what() << std::endl;
+                mesh.srs = stream.source->srs();
+            }
+            StreamedCloud::Node& node = stream.nodes[iter->first];
+            node.lastFrame = frame_;
+            node.data.streamedNode = true;
+            node.data.mesh = std::move(mesh);
+            upload(node.data, camera_.srs(), false);
+            iter = stream.pending.erase(iter);
+        }
+    }
+}
+
+void OpenGLWidget::evictStreamedNodes() {
+    const std::size_t limit = STREAM_CACHE_FACTOR * Parameters::global().pointBudget;
+    std::size_t numResident = 0;
+    // least recently used first; the roots are always kept
+    std::vector<std::tuple<std::size_t, StreamedCloud*, int>> unused;
+    for (auto& p : streamed_) {
+        for (const auto& node : p.second.nodes) {
+            numResident += node.second.data.mesh.vertices.size();
+            if (node.second.lastFrame < frame_ && node.first > 0) {
+                unused.emplace_back(node.second.lastFrame, &p.second, node.first);
+            }
+        }
+    }
+    if (numResident <= limit) {
+        return;
+    }
+    std::sort(unused.begin(), unused.end(), [](const auto& t1, const auto& t2) {
+        return std::get<0>(t1) < std::get<0>(t2);
+    });
+    for (std::size_t i = 0; i < unused.size() && numResident > limit; ++i) {
+        StreamedCloud& stream = *std::get<1>(unused[i]);
+        auto iter = stream.nodes.find(std::get<2>(unused[i]));
+        numResident -= iter->second.data.mesh.vertices.size();
+        deleteBuffers(iter->second.data);
+        stream.nodes.erase(iter);
+    }
 }
 
 inline int toGlFormat(const ImageFormat& format) {
@@ -398,16 +981,16 @@ inline int toGlFormat(const ImageFormat& format) {
     }
 }
 
-inline Color classToColor(const TexturedMesh& mesh, int vi) {
-    if (!mesh.classToColor.empty()) {
-        auto iter = mesh.classToColor.find(mesh.classes[vi]);
-        if (iter != mesh.classToColor.end()) {
+inline Color classColor(const std::map<int, Color>& classToColor, const int cls) {
+    if (!classToColor.empty()) {
+        auto iter = classToColor.find(cls);
+        if (iter != classToColor.end()) {
             return iter->second;
         } else {
             return Color(190, 190, 190);
         }
     } else {
-        switch (mesh.classes[vi]) {
+        switch (cls) {
         case 2:
             return Color(220, 220, 50); // interiors
         case 3:
@@ -424,13 +1007,86 @@ inline Color classToColor(const TexturedMesh& mesh, int vi) {
     }
 }
 
+inline Color classToColor(const TexturedMesh& mesh, int vi) {
+    return classColor(mesh.classToColor, mesh.classes[vi]);
+}
+
+GLuint OpenGLWidget::uploadTexture(ITexture& tex) {
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    Pvl::Vec2i size = tex.size();
+    int maxTextureSize;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+    std::cout << "Max texture size = " << maxTextureSize << std::endl;
+    int format = toGlFormat(tex.format());
+    int internal = tex.format() == ImageFormat::GRAY ? GL_LUMINANCE : GL_RGB;
+    glTexImage2D(GL_TEXTURE_2D, 0, internal, size[0], size[1], 0, format, GL_UNSIGNED_BYTE, tex.data());
+    glGenerateMipmap(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return texture;
+}
+
+PreparedMesh OpenGLWidget::prepare(TexturedMesh&& mesh) {
+    PreparedMesh prepared;
+    prepared.mesh = std::move(mesh);
+    // both reorder the mesh, so they have to be built before the mesh is uploaded
+    if (prepared.mesh.faces.empty()) {
+        prepared.octree = PointOctree(prepared.mesh);
+    } else {
+        prepared.chunks = sortIntoChunks(prepared.mesh, CHUNK_SIZE);
+    }
+    return prepared;
+}
+
 void OpenGLWidget::view(const void* handle, std::string basename, TexturedMesh&& mesh) {
-    bool firstMesh = meshes_.empty();
+    if (meshes_.find(handle) != meshes_.end()) {
+        PreparedMesh prepared;
+        prepared.mesh = std::move(mesh);
+        view(handle, basename, std::move(prepared));
+    } else {
+        view(handle, basename, prepare(std::move(mesh)));
+    }
+}
+
+void OpenGLWidget::view(const void* handle, std::string basename, PreparedMesh&& prepared) {
+    bool firstMesh = meshes_.empty() && partial_.empty();
     bool updateOnly = meshes_.find(handle) != meshes_.end();
     MeshData& data = meshes_[handle];
-    data.mesh = std::move(mesh);
+    data.mesh = std::move(prepared.mesh);
     data.basename = basename;
-    data.vis = {};
+    if (!updateOnly) {
+        data.octree = std::move(prepared.octree);
+        data.chunks = std::move(prepared.chunks);
+    }
+
+    Srs refSrs;
+    if (firstMesh) {
+        refSrs = data.mesh.srs;
+    } else {
+        refSrs = camera_.srs();
+    }
+    upload(data, refSrs, updateOnly);
+
+    // complete mesh replaces the parts shown while loading
+    deletePartial(handle);
+
+    if (firstMesh) {
+        resetCamera(refSrs);
+    }
+}
+
+void OpenGLWidget::viewPartial(const void* handle, TexturedMesh&& part) {
+    bool firstMesh = meshes_.empty() && partial_.empty();
+    std::vector<MeshData>& parts = partial_[handle];
+    parts.emplace_back();
+    MeshData& data = parts.back();
+    data.mesh = std::move(part);
 
     Srs refSrs;
     if (firstMesh) {
@@ -438,7 +1094,200 @@ void OpenGLWidget::view(const void* handle, std::string basename, TexturedMesh&&
     } else {
         refSrs = camera_.srs();
     }
+    upload(data, refSrs, false);
+
+    if (firstMesh) {
+        resetCamera(refSrs);
+    }
+    update();
+}
+
+void OpenGLWidget::viewTerrain(const void* handle,
+    std::string basename,
+    std::unique_ptr<DemTerrain>&& terrain) {
+    bool firstMesh = meshes_.empty() && partial_.empty();
+    // placeholder with the extents of the terrain, so that it is listed with other meshes
+    MeshData& data = meshes_[handle];
+    data.basename = basename;
+    data.terrain = true;
+    data.mesh.srs = terrain->srs();
+    data.box = terrain->extents();
+
+    TerrainData& terrainData = terrains_[handle];
+    terrainData.source = std::move(terrain);
+    if (std::unique_ptr<ITexture> texture = terrainData.source->loadTexture()) {
+        terrainData.texture = uploadTexture(*texture);
+    }
+
+    if (firstMesh) {
+        resetCamera(data.mesh.srs);
+    }
+    update();
+}
+
+void OpenGLWidget::viewStreamed(const void* handle,
+    std::string basename,
+    std::unique_ptr<CachedOctree>&& octree) {
+    bool firstMesh = meshes_.empty() && partial_.empty();
+    // placeholder with the extents of the cloud, so that it is listed with other meshes
+    MeshData& data = meshes_[handle];
+    data.basename = basename;
+    data.streamed = true;
+    data.mesh.srs = octree->srs();
+    data.box = octree->extents();
+
+    streamed_[handle].source = std::move(octree);
+
+    if (firstMesh) {
+        resetCamera(data.mesh.srs);
+    }
+    update();
+}
+
+void OpenGLWidget::deletePartial(const void* handle) {
+    auto iter = partial_.find(handle);
+    if (iter == partial_.end()) {
+        return;
+    }
+    for (MeshData& part : iter->second) {
+        deleteBuffers(part);
+    }
+    partial_.erase(iter);
+}
+
+void OpenGLWidget::createIndexedArrays(MeshData& data, const SrsConv& conv) {
+    const TexturedMesh& mesh = data.mesh;
+    const bool hasColors = !mesh.colors.empty();
+    const bool hasTexture = !mesh.uv.empty();
+    const bool hasAo = !mesh.ao.empty();
+    const bool hasClasses = !mesh.classes.empty();
+    const std::size_t numVertices = mesh.vertices.size();
+    const std::size_t numCorners = 3 * mesh.faces.size();
+
+    // corners of each vertex, sorted so that the first corner of a vertex is the first one in the mesh
+    std::vector<std::atomic<uint32_t>> counts(numVertices + 1);
+    tbb::parallel_for(std::size_t(0), numCorners, [&](const std::size_t c) {
+        counts[mesh.faces[c / 3][c % 3] + 1].fetch_add(1, std::memory_order_relaxed);
+    });
+    std::vector<uint32_t> offsets(numVertices + 1);
+    for (std::size_t vi = 0; vi < numVertices; ++vi) {
+        offsets[vi + 1] = offsets[vi] + counts[vi + 1].load(std::memory_order_relaxed);
+        counts[vi + 1].store(offsets[vi], std::memory_order_relaxed);
+    }
+    std::vector<uint32_t> corners(numCorners);
+    tbb::parallel_for(std::size_t(0), numCorners, [&](const std::size_t c) {
+        const uint32_t vi = mesh.faces[c / 3][c % 3];
+        corners[counts[vi + 1].fetch_add(1, std::memory_order_relaxed)] = uint32_t(c);
+    });
+    std::vector<std::atomic<uint32_t>>().swap(counts);
+    tbb::parallel_for(std::size_t(0), numVertices, [&](const std::size_t vi) {
+        std::sort(corners.begin() + offsets[vi], corners.begin() + offsets[vi + 1]);
+    });
+
+    // The first copy of each vertex is created with the uv index and AO of its first corner, other corners
+    // share it unless they need different values. Copies are listed in the order of their first corner.
+    auto key = [&](const uint32_t c) {
+        const uint32_t ti = hasTexture ? mesh.texIds[c / 3][c % 3] : 0;
+        const uint8_t ao = hasAo ? mesh.ao[c] : 0;
+        return std::make_pair(ti, ao);
+    };
+    using Key = std::pair<uint32_t, uint8_t>;
+    auto forEachCorner = [&](const std::size_t vi, std::vector<Key>& keys, auto&& func) {
+        keys.clear();
+        for (uint32_t i = offsets[vi]; i < offsets[vi + 1]; ++i) {
+            const uint32_t c = corners[i];
+            const Key k = key(c);
+            // vertices have few distinct keys, linear search is faster than any map
+            const std::size_t copy = std::find(keys.begin(), keys.end(), k) - keys.begin();
+            const bool created = copy == keys.size();
+            if (created) {
+                keys.push_back(k);
+            }
+            func(c, copy, created);
+        }
+    };
+    tbb::enumerable_thread_specific<std::vector<Key>> localKeys;
+    std::vector<uint32_t> firstCopy(numVertices + 1);
+    tbb::parallel_for(std::size_t(0), numVertices, [&](const std::size_t vi) {
+        std::vector<Key>& keys = localKeys.local();
+        forEachCorner(vi, keys, [](uint32_t, std::size_t, bool) {});
+        firstCopy[vi + 1] = uint32_t(keys.size());
+    });
+    std::size_t numUsed = 0;
+    for (std::size_t vi = 0; vi < numVertices; ++vi) {
+        numUsed += firstCopy[vi + 1] > 0;
+        firstCopy[vi + 1] += firstCopy[vi];
+    }
+    const std::size_t numCopies = firstCopy[numVertices];
+
+    data.vis.vertices.resize(numCopies * 3);
+    data.vis.normals.resize(numCopies * 3);
+    if (hasAo || hasColors) {
+        data.vis.vertexColors.resize(numCopies * 3);
+    }
+    if (hasClasses) {
+        data.vis.classColors.resize(numCopies * 3);
+    }
+    if (hasTexture) {
+        data.vis.uv.resize(numCopies * 2);
+    }
+    if (program_) {
+        data.vis.sources.resize(numCopies);
+    }
+    data.vis.indices.resize(numCorners);
+    tbb::parallel_for(std::size_t(0), numVertices, [&](const std::size_t vi) {
+        if (offsets[vi] == offsets[vi + 1]) {
+            // unused vertex
+            return;
+        }
+        // vertex normal as area-weighted average of the normals of adjacent faces
+        Pvl::Vec3f normal(0.f);
+        for (uint32_t i = offsets[vi]; i < offsets[vi + 1]; ++i) {
+            const TexturedMesh::Face& f = mesh.faces[corners[i] / 3];
+            const Pvl::Vec3f& p0 = mesh.vertices[f[0]];
+            normal += Pvl::crossProd(mesh.vertices[f[1]] - p0, mesh.vertices[f[2]] - p0);
+        }
+        const float length = Pvl::norm(normal);
+        normal = length > 1.e-20f ? normal / length : Pvl::Vec3f(0, 0, 1);
+        const Pvl::Vec3f vertex = conv(mesh.vertices[vi]);
+        const Color color = hasColors ? mesh.colors[vi] : Color(0);
+        const Color clsColor = hasClasses ? classToColor(mesh, vi) : Color(0);
+
+        std::vector<Key>& keys = localKeys.local();
+        forEachCorner(vi, keys, [&](const uint32_t c, const std::size_t copy, const bool created) {
+            const uint32_t index = firstCopy[vi] + uint32_t(copy);
+            data.vis.indices[c] = index;
+            if (!created) {
+                return;
+            }
+            for (int j = 0; j < 3; ++j) {
+                data.vis.vertices[3 * index + j] = vertex[j];
+                data.vis.normals[3 * index + j] = normal[j];
+                if (hasAo) {
+                    data.vis.vertexColors[3 * index + j] = keys[copy].second;
+                } else if (hasColors) {
+                    data.vis.vertexColors[3 * index + j] = color[j];
+                }
+                if (hasClasses) {
+                    data.vis.classColors[3 * index + j] = clsColor[j];
+                }
+            }
+            if (hasTexture) {
+                const Pvl::Vec2f& uv = mesh.uv[keys[copy].first];
+                data.vis.uv[2 * index + 0] = uv[0];
+                data.vis.uv[2 * index + 1] = 1.f - uv[1];
+            }
+            if (program_) {
+                data.vis.sources[index] = uint32_t(vi);
+            }
+        });
+    });
+    std::cout << "Indexed " << mesh.faces.size() << " faces with " << numCopies << " vertices ("
+              << numCopies - numUsed << " duplicated)" << std::endl;
+}
 
+void OpenGLWidget::upload(MeshData& data, const Srs& refSrs, const bool updateOnly) {
+    data.vis = {};
     SrsConv conv(data.mesh.srs, refSrs);
     if (data.pointCloud()) {
         bool hasNormals = !data.mesh.normals.empty();
@@ -486,76 +1335,97 @@ void OpenGLWidget::view(const void* handle, std::string basename, TexturedMesh&&
         bool hasAo = !data.mesh.ao.empty();
         bool hasClasses = !data.mesh.classes.empty();
 
-        data.vis.vertices.reserve(data.mesh.faces.size() * 9);
-        data.vis.normals.reserve(data.mesh.faces.size() * 9);
-        if (hasAo || hasColors) {
-            data.vis.vertexColors.reserve(data.mesh.faces.size() * 9);
-        }
-        if (hasClasses) {
-            data.vis.classColors.reserve(data.mesh.faces.size() * 9);
-        }
-        if (hasTexture) {
-            data.vis.uv.reserve(data.mesh.faces.size() * 6);
-        }
-        for (std::size_t fi = 0; fi < data.mesh.faces.size(); ++fi) {
-            Pvl::Vec3f normal = data.mesh.normal(fi);
-            for (int i = 0; i < 3; ++i) {
-                Pvl::Vec3f vertex = conv(data.mesh.vertices[data.mesh.faces[fi][i]]);
-                data.vis.vertices.push_back(vertex[0]);
-                data.vis.vertices.push_back(vertex[1]);
-                data.vis.vertices.push_back(vertex[2]);
-
-                data.vis.normals.push_back(normal[0]);
-                data.vis.normals.push_back(normal[1]);
-                data.vis.normals.push_back(normal[2]);
-
-                if (hasAo) {
-                    uint8_t ao = data.mesh.ao[3 * fi + i];
-                    data.vis.vertexColors.push_back(ao);
-                    data.vis.vertexColors.push_back(ao);
-                    data.vis.vertexColors.push_back(ao);
-                } else if (hasColors) {
-                    Color c = data.mesh.colors[data.mesh.faces[fi][i]];
-                    data.vis.vertexColors.push_back(c[0]);
-                    data.vis.vertexColors.push_back(c[1]);
-                    data.vis.vertexColors.push_back(c[2]);
-                }
-                if (hasClasses) {
-                    Color c = classToColor(data.mesh, data.mesh.faces[fi][i]);
-                    data.vis.classColors.push_back(c[0]);
-                    data.vis.classColors.push_back(c[1]);
-                    data.vis.classColors.push_back(c[2]);
-                }
-                if (hasTexture) {
-                    Pvl::Vec2f uv = data.mesh.uv[data.mesh.texIds[fi][i]];
-                    data.vis.uv.push_back(uv[0]);
-                    data.vis.uv.push_back(1.f - uv[1]);
+        deleteQueries(data);
+        if (indexed_) {
+            createIndexedArrays(data, conv);
+        } else {
+            data.vis.vertices.reserve(data.mesh.faces.size() * 9);
+            data.vis.normals.reserve(data.mesh.faces.size() * 9);
+            if (hasAo || hasColors) {
+                data.vis.vertexColors.reserve(data.mesh.faces.size() * 9);
+            }
+            if (hasClasses) {
+                data.vis.classColors.reserve(data.mesh.faces.size() * 9);
+            }
+            if (hasTexture) {
+                data.vis.uv.reserve(data.mesh.faces.size() * 6);
+            }
+            for (std::size_t fi = 0; fi < data.mesh.faces.size(); ++fi) {
+                Pvl::Vec3f normal = data.mesh.normal(fi);
+                for (int i = 0; i < 3; ++i) {
+                    Pvl::Vec3f vertex = conv(data.mesh.vertices[data.mesh.faces[fi][i]]);
+                    data.vis.vertices.push_back(vertex[0]);
+                    data.vis.vertices.push_back(vertex[1]);
+                    data.vis.vertices.push_back(vertex[2]);
+
+                    data.vis.normals.push_back(normal[0]);
+                    data.vis.normals.push_back(normal[1]);
+                    data.vis.normals.push_back(normal[2]);
+
+                    if (hasAo) {
+                        uint8_t ao = data.mesh.ao[3 * fi + i];
+                        data.vis.vertexColors.push_back(ao);
+                        data.vis.vertexColors.push_back(ao);
+                        data.vis.vertexColors.push_back(ao);
+                    } else if (hasColors) {
+                        Color c = data.mesh.colors[data.mesh.faces[fi][i]];
+                        data.vis.vertexColors.push_back(c[0]);
+                        data.vis.vertexColors.push_back(c[1]);
+                        data.vis.vertexColors.push_back(c[2]);
+                    }
+                    if (hasClasses) {
+                        Color c = classToColor(data.mesh, data.mesh.faces[fi][i]);
+                        data.vis.classColors.push_back(c[0]);
+                        data.vis.classColors.push_back(c[1]);
+                        data.vis.classColors.push_back(c[2]);
+                    }
+                    if (hasTexture) {
+                        Pvl::Vec2f uv = data.mesh.uv[data.mesh.texIds[fi][i]];
+                        data.vis.uv.push_back(uv[0]);
+                        data.vis.uv.push_back(1.f - uv[1]);
+                    }
+                    if (program_) {
+                        data.vis.sources.push_back(data.mesh.faces[fi][i]);
+                    }
                 }
             }
         }
         if (hasTexture && !updateOnly) {
             /// \todo allow editing texture?
-            glGenTextures(1, &data.texture);
-            glBindTexture(GL_TEXTURE_2D, data.texture);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-            ITexture& tex = *data.mesh.texture;
-            Pvl::Vec2i size = tex.size();
-            int maxTextureSize;
-            glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
-            std::cout << "Max texture size = " << maxTextureSize << std::endl;
-            int format = toGlFormat(tex.format());
-            int internal = tex.format() == ImageFormat::GRAY ? GL_LUMINANCE : GL_RGB;
-            glTexImage2D(
-                GL_TEXTURE_2D, 0, internal, size[0], size[1], 0, format, GL_UNSIGNED_BYTE, tex.data());
-            glGenerateMipmap(GL_TEXTURE_2D);
+            if (data.mesh.materials.empty()) {
+                MeshData::Batch batch;
+                batch.numFaces = data.mesh.faces.size();
+                if (data.mesh.texture) {
+                    batch.texture = uploadTexture(*data.mesh.texture);
+                }
+                data.batches.push_back(batch);
+            } else {
+                for (const Material& material : data.mesh.materials) {
+                    MeshData::Batch batch;
+                    batch.firstFace = material.firstFace;
+                    batch.numFaces = material.numFaces;
+                    if (material.texture) {
+                        batch.texture = uploadTexture(*material.texture);
+                    }
+                    data.batches.push_back(batch);
+                }
+            }
             data.mesh.texture.reset();
+            for (Material& material : data.mesh.materials) {
+                material.texture.reset();
+            }
         }
     }
-    if (vbos_) {
+    data.counts.vertices = data.vis.vertices.size();
+    data.counts.normals = data.vis.normals.size();
+    data.counts.vertexColors = data.vis.vertexColors.size();
+    data.counts.classColors = data.vis.classColors.size();
+    data.counts.uv = data.vis.uv.size();
+    data.counts.indices = data.vis.indices.size();
+    if (program_) {
+        uploadInterleaved(data, updateOnly);
+        data.vis = {};
+    } else if (vbos_) {
         if (!updateOnly) {
             glGenBuffers(1, &data.vbo);
         }
@@ -585,6 +1455,20 @@ void OpenGLWidget::view(const void* handle, std::string basename, TexturedMesh&&
             numTex * sizeof(float),
             data.vis.uv.data());
         glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        if (!data.vis.indices.empty()) {
+            if (data.ibo == 0) {
+                glGenBuffers(1, &data.ibo);
+            }
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, data.ibo);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                data.vis.indices.size() * sizeof(uint32_t),
+                data.vis.indices.data(),
+                GL_STATIC_DRAW);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        }
+        // the arrays are only needed to draw without buffers
+        data.vis = {};
     }
 
     data.box = Pvl::Box3f{};
@@ -593,10 +1477,146 @@ void OpenGLWidget::view(const void* handle, std::string basename, TexturedMesh&&
     }
     std::cout << "Mesh has extents " << data.box.lower()[0] << "," << data.box.lower()[1] << ":"
               << data.box.upper()[0] << "," << data.box.upper()[1] << std::endl;
+}
 
+void OpenGLWidget::uploadInterleaved(MeshData& data, const bool updateOnly) {
+    const TexturedMesh& mesh = data.mesh;
+    const std::size_t numVert = data.vis.vertices.size() / 3;
+    const bool hasNormals = data.vis.normals.size() == 3 * numVert;
+    const bool hasUv = data.vis.uv.size() == 2 * numVert;
+    const bool hasAo = data.hasAo() && data.vis.vertexColors.size() == 3 * numVert;
+    const bool hasColors = data.hasColors();
+    const bool hasClasses = data.hasClasses();
+    // point clouds are uploaded in the order of the mesh vertices
+    const bool hasSources = !data.vis.sources.empty();
+
+    std::vector<ShaderVertex> vertices(numVert);
+    tbb::parallel_for(std::size_t(0), numVert, [&](const std::size_t i) {
+        ShaderVertex& v = vertices[i];
+        const std::size_t source = hasSources ? data.vis.sources[i] : i;
+        for (int j = 0; j < 3; ++j) {
+            v.position[j] = data.vis.vertices[3 * i + j];
+            v.normal[j] = hasNormals ? data.vis.normals[3 * i + j] : 0.f;
+            v.color[j] = hasColors ? mesh.colors[source][j] : 190;
+            v.padding[j] = 0;
+        }
+        v.uv[0] = hasUv ? data.vis.uv[2 * i + 0] : 0.f;
+        v.uv[1] = hasUv ? data.vis.uv[2 * i + 1] : 0.f;
+        v.ao = hasAo ? data.vis.vertexColors[3 * i] : 255;
+        v.cls = hasClasses ? mesh.classes[source] : 0;
+    });
 
-    if (firstMesh) {
-        resetCamera(refSrs);
+    if (!updateOnly || data.vao == 0) {
+        gl33_->glGenVertexArrays(1, &data.vao);
+        glGenBuffers(1, &data.vbo);
+    }
+    gl33_->glBindVertexArray(data.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, data.vbo);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(ShaderVertex), vertices.data(), GL_STATIC_DRAW);
+
+    auto attribute = [this](const ShaderAttribute attr,
+                         const int size,
+                         const GLenum type,
+                         const bool normalize,
+                         const std::size_t offset) {
+        gl33_->glEnableVertexAttribArray(GLuint(attr));
+        gl33_->glVertexAttribPointer(
+            GLuint(attr), size, type, normalize, sizeof(ShaderVertex), (void*)offset);
+    };
+    attribute(ShaderAttribute::POSITION, 3, GL_FLOAT, false, offsetof(ShaderVertex, position));
+    attribute(ShaderAttribute::NORMAL, 3, GL_FLOAT, false, offsetof(ShaderVertex, normal));
+    attribute(ShaderAttribute::UV, 2, GL_FLOAT, false, offsetof(ShaderVertex, uv));
+    // color and AO are read together as a normalized vec4
+    attribute(ShaderAttribute::COLOR_AO, 4, GL_UNSIGNED_BYTE, true, offsetof(ShaderVertex, color));
+    gl33_->glEnableVertexAttribArray(GLuint(ShaderAttribute::CLASS));
+    gl33_->glVertexAttribIPointer(GLuint(ShaderAttribute::CLASS),
+        1,
+        GL_UNSIGNED_BYTE,
+        sizeof(ShaderVertex),
+        (void*)offsetof(ShaderVertex, cls));
+
+    if (!data.vis.indices.empty()) {
+        if (data.ibo == 0) {
+            glGenBuffers(1, &data.ibo);
+        }
+        // element buffer binding is stored in the vertex array
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, data.ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+            data.vis.indices.size() * sizeof(uint32_t),
+            data.vis.indices.data(),
+            GL_STATIC_DRAW);
+    }
+    gl33_->glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    // class colors only change when the mesh is loaded
+    data.palette.clear();
+    if (hasClasses) {
+        data.palette.resize(256);
+        for (int cls = 0; cls < int(data.palette.size()); ++cls) {
+            const Color c = classColor(mesh.classToColor, cls);
+            data.palette[cls] = QVector3D(c[0], c[1], c[2]) / 255.f;
+        }
+    }
+    if (paletteMesh_ == &data) {
+        paletteMesh_ = nullptr;
+    }
+}
+
+void OpenGLWidget::drawMeshShaded(const MeshData& mesh) {
+    const bool useAo = enableAo_ && mesh.hasAo();
+    const bool useClasses = enableClasses_ && mesh.hasClasses() && !enableAo_;
+    // for point clouds, point colors are considered a texture here
+    const bool useColors = mesh.hasColors() && (!mesh.pointCloud() || enableTextures_);
+    const bool useTexture = enableTextures_ && mesh.hasTexture();
+    const bool lighting = mesh.hasNormals() && !useColors && !useAo && !useTexture;
+
+    ShaderColor colorSource = ShaderColor::CONSTANT;
+    if (useClasses) {
+        colorSource = ShaderColor::CLASS;
+    } else if (useColors) {
+        colorSource = ShaderColor::VERTEX;
+    }
+
+    program_->bind();
+    program_->setUniformValue("modelView", modelView_);
+    program_->setUniformValue("projection", projection_);
+    program_->setUniformValue("normalMatrix", modelView_.normalMatrix());
+    program_->setUniformValue("colorSource", int(colorSource));
+    program_->setUniformValue("useAo", int(useAo));
+    program_->setUniformValue("useTexture", int(useTexture));
+    program_->setUniformValue("lighting", int(lighting));
+    program_->setUniformValue("tex", 0);
+    if (useClasses && paletteMesh_ != &mesh) {
+        program_->setUniformValueArray("palette", mesh.palette.data(), int(mesh.palette.size()));
+        paletteMesh_ = &mesh;
+    }
+
+    gl33_->glBindVertexArray(mesh.vao);
+    // point stride is not applied, the attributes are interleaved
+    drawPrimitives(mesh, useTexture, 1);
+    gl33_->glBindVertexArray(0);
+    if (useTexture) {
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    program_->release();
+}
+
+void OpenGLWidget::deleteBuffers(MeshData& data) {
+    deleteQueries(data);
+    if (paletteMesh_ == &data) {
+        paletteMesh_ = nullptr;
+    }
+    if (gl33_ && data.vao != 0) {
+        gl33_->glDeleteVertexArrays(1, &data.vao);
+        data.vao = 0;
+    }
+    if (vbos_) {
+        glDeleteBuffers(1, &data.vbo);
+        glDeleteBuffers(1, &data.ibo);
+        data.vbo = 0;
+        data.ibo = 0;
     }
 }
 
@@ -605,12 +1625,38 @@ void OpenGLWidget::deleteMesh(const void* handle) {
         // nothing?
         return;
     }
-    MeshData& mesh = meshes_.at(handle);
-    if (vbos_) {
-        glDeleteBuffers(1, &mesh.vbo);
+    deletePartial(handle);
+    if (meshes_.find(handle) == meshes_.end()) {
+        // loading has been cancelled
+        update();
+        return;
     }
-    if (meshes_.at(handle).hasTexture()) {
-        glDeleteTextures(1, &mesh.texture);
+    auto terrain = terrains_.find(handle);
+    if (terrain != terrains_.end()) {
+        for (auto& p : terrain->second.tiles) {
+            deleteBuffers(p.second.data);
+        }
+        if (terrain->second.texture != 0) {
+            glDeleteTextures(1, &terrain->second.texture);
+        }
+        terrains_.erase(terrain);
+    }
+    auto stream = streamed_.find(handle);
+    if (stream != streamed_.end()) {
+        for (auto& p : stream->second.pending) {
+            p.second.wait();
+        }
+        for (auto& p : stream->second.nodes) {
+            deleteBuffers(p.second.data);
+        }
+        streamed_.erase(stream);
+    }
+    MeshData& mesh = meshes_.at(handle);
+    deleteBuffers(mesh);
+    for (const MeshData::Batch& batch : mesh.batches) {
+        if (batch.texture != 0) {
+            glDeleteTextures(1, &batch.texture);
+        }
     }
     meshes_.erase(handle);
     update();
@@ -630,8 +1676,15 @@ void OpenGLWidget::resetCamera() {
 
 void OpenGLWidget::resetCamera(const Srs& srs) {
     // find first enabled
+    std::vector<const MeshData*> candidates;
     for (const auto& p : meshes_) {
-        const MeshData& mesh = p.second;
+        candidates.push_back(&p.second);
+    }
+    for (const auto& p : partial_) {
+        candidates.push_back(&p.second.front());
+    }
+    for (const MeshData* candidate : candidates) {
+        const MeshData& mesh = *candidate;
         if (!mesh.enabled) {
             continue;
         }
@@ -690,15 +1743,27 @@ void OpenGLWidget::screenshot(const QString& file) {
     writer.write(std::move(image).mirrored().rgbSwapped());
 }
 
-void OpenGLWidget::saveAsMesh(const QString& file,
+bool OpenGLWidget::saveAsMesh(const QString& file,
     const std::vector<const void*>& handles,
-    std::function<bool(float)> progress) {
-    std::ofstream ofs(file.toStdString());
+    std::function<bool(float)> progress,
+    PlyFormat format) {
     std::vector<const TexturedMesh*> meshes;
     for (auto handle : handles) {
         meshes.push_back(&meshes_[handle].mesh);
     }
-    savePly(ofs, meshes, progress);
+    bool saved = false;
+    try {
+        std::ofstream ofs(file.toStdString(), std::ios::binary);
+        saved = savePly(ofs, meshes, progress, format);
+    } catch (...) {
+        std::remove(file.toStdString().c_str());
+        throw;
+    }
+    if (!saved) {
+        // do not leave incomplete files behind
+        std::remove(file.toStdString().c_str());
+    }
+    return saved;
 }
 
 void OpenGLWidget::wheelEvent(QWheelEvent* event) {
@@ -753,15 +1818,50 @@ void OpenGLWidget::mouseDoubleClickEvent(QMouseEvent* event) {
     float mesh_min = t_inf;
     float pc_min = t_inf;
     tbb::mutex mutex;
+    auto intersectMesh = [&](const TexturedMesh& mesh) {
+        SrsConv conv(camera_.srs(), mesh.srs);
+        CameraRay localRay{ conv(ray.origin), ray.dir };
+        tbb::parallel_for<std::size_t>(0, mesh.faces.size(), [&](std::size_t fi) {
+            Triangle tri;
+            for (int i = 0; i < 3; ++i) {
+                tri[i] = mesh.vertices[mesh.faces[fi][i]];
+            }
+            float t;
+            if (intersection(localRay, tri, t) && t > 0 && t < mesh_min) {
+                tbb::mutex::scoped_lock lock(mutex);
+                mesh_min = t;
+            }
+        });
+    };
     for (const auto& p : meshes_) {
         if (!p.second.enabled) {
             continue;
         }
         const TexturedMesh& mesh = p.second.mesh;
-        if (p.second.pointCloud()) {
-            std::vector<float> zs(mesh.vertices.size());
-            for (std::size_t i = 0; i < zs.size(); ++i) {
-                zs[i] = mesh.vertices[i][2];
+        if (p.second.terrain) {
+            // tiles used in the last frame
+            for (const auto& tile : terrains_.at(p.first).tiles) {
+                if (tile.second.lastFrame == frame_) {
+                    intersectMesh(tile.second.data.mesh);
+                }
+            }
+        } else if (p.second.pointCloud()) {
+            std::vector<float> zs;
+            if (p.second.streamed) {
+                // nodes drawn in the last frame
+                const StreamedCloud& stream = streamed_.at(p.first);
+                for (const int index : stream.visibleNodes) {
+                    for (const Pvl::Vec3f& v : stream.nodes.at(index).data.mesh.vertices) {
+                        zs.push_back(v[2]);
+                    }
+                }
+            } else {
+                for (const Pvl::Vec3f& v : mesh.vertices) {
+                    zs.push_back(v[2]);
+                }
+            }
+            if (zs.empty()) {
+                continue;
             }
             int q10 = zs.size() / 10;
             std::nth_element(zs.begin(), zs.begin() + q10, zs.end());
@@ -771,19 +1871,7 @@ void OpenGLWidget::mouseDoubleClickEvent(QMouseEvent* event) {
                 pc_min = t;
             }
         } else {
-            SrsConv conv(camera_.srs(), mesh.srs);
-            CameraRay localRay{ conv(ray.origin), ray.dir };
-            tbb::parallel_for<std::size_t>(0, mesh.faces.size(), [&](std::size_t fi) {
-                Triangle tri;
-                for (int i = 0; i < 3; ++i) {
-                    tri[i] = mesh.vertices[mesh.faces[fi][i]];
-                }
-                float t;
-                if (intersection(localRay, tri, t) && t > 0 && t < mesh_min) {
-                    tbb::mutex::scoped_lock lock(mutex);
-                    mesh_min = t;
-                }
-            });
+            intersectMesh(mesh);
         }
     }
     float t_min = (mesh_min < t_inf) ? mesh_min : pc_min;
@@ -1010,7 +2098,7 @@ void OpenGLWidget::estimateNormals(const QString& trajectory, std::function<bool
     std::vector<std::pair<const void*, MeshData*>> meshData;
     // cannot erase from meshes_ while iterating, so add it to a vector
     for (auto& p : meshes_) {
-        if (p.second.pointCloud()) {
+        if (p.second.pointCloud() && !p.second.terrain && !p.second.streamed) {
             meshData.emplace_back(p.first, &p.second);
         }
     }
@@ -1103,7 +2191,7 @@ void OpenGLWidget::computeAmbientOcclusion(std::function<bool(float)> progress)
     std::map<const void*, int> handleIndexMap;
     for (auto& p : meshes_) {
         const void* handle = p.first;
-        if (p.second.pointCloud() || !p.second.enabled || !p.second.vis.vertexColors.empty()) {
+        if (p.second.pointCloud() || !p.second.enabled || p.second.counts.vertexColors > 0) {
             // pc, not visible or already computed
             continue;
         }
@@ -1,8 +1,12 @@
 #pragma once
 
+#include "cache.h"
 #include "camera.h"
 #include "coordinates.h"
+#include "dem.h"
 #include "mesh.h"
+#include "octree.h"
+#include "ply.h"
 #include "pvl/Box.hpp"
 #include "pvl/Optional.hpp"
 #include "quaternion.h"
@@ -10,10 +14,27 @@
 #include <GL/glu.h>
 #include <QFileInfo>
 #include <QImageWriter>
+#include <QMatrix4x4>
 #include <QMouseEvent>
 #include <QOpenGLFunctions>
+#include <QOpenGLFunctions_3_0>
+#include <QOpenGLFunctions_3_3_Core>
+#include <QOpenGLShaderProgram>
 #include <QOpenGLWidget>
+#include <QVector3D>
 #include <QWheelEvent>
+#include <future>
+
+/// Mesh with the structures used to draw it, built by OpenGLWidget::prepare outside of the GUI thread.
+struct PreparedMesh {
+    Mpcv::TexturedMesh mesh;
+
+    ///< Level-of-detail hierarchy, only for point clouds
+    Mpcv::PointOctree octree;
+
+    ///< Spatially coherent chunks of faces, only for meshes
+    std::vector<Mpcv::MeshChunk> chunks;
+};
 
 class OpenGLWidget : public QOpenGLWidget, public QOpenGLFunctions {
     Q_OBJECT
@@ -24,20 +45,73 @@ class OpenGLWidget : public QOpenGLWidget, public QOpenGLFunctions {
         Pvl::Box3f box;
         bool enabled = true;
 
+        ///< Placeholder of a terrain, drawn by the tiles in terrains_
+        bool terrain = false;
+
+        ///< Placeholder of a streamed point cloud, drawn by the nodes in streamed_
+        bool streamed = false;
+
+        ///< Node of a streamed point cloud, already thinned by the point budget
+        bool streamedNode = false;
+
         struct {
             std::vector<float> vertices;
             std::vector<float> normals;
             std::vector<float> uv;
             std::vector<uint8_t> vertexColors;
             std::vector<uint8_t> classColors;
+            std::vector<uint32_t> indices; ///< Empty if the vertices are unrolled per face
+            std::vector<uint32_t> sources; ///< Mesh vertex of each vertex, only for the shader path
         } vis;
 
-        GLuint texture;
-        GLuint vbo;
+        ///< Sizes of the vis arrays, kept after the arrays are released
+        struct {
+            std::size_t vertices = 0;
+            std::size_t normals = 0;
+            std::size_t vertexColors = 0;
+            std::size_t classColors = 0;
+            std::size_t uv = 0;
+            std::size_t indices = 0;
+        } counts;
+
+        ///< Faces drawn with the same texture, sorted by face ranges
+        struct Batch {
+            GLuint texture = 0;
+            std::size_t firstFace = 0;
+            std::size_t numFaces = 0;
+        };
+        std::vector<Batch> batches;
+
+        ///< Ranges of faces culled by the view frustum, sorted by face ranges
+        std::vector<Mpcv::MeshChunk> chunks;
+
+        struct ChunkVisibility {
+            GLuint query = 0;
+            bool pending = false; ///< Query issued, result not read yet
+            bool visible = true;  ///< Result of the last query read
+        };
+        ///< Occlusion state of the chunks, updated while drawing
+        mutable std::vector<ChunkVisibility> visibility;
+
+        GLuint vbo = 0;
+        GLuint ibo = 0; ///< Element buffer of indexed meshes
+        GLuint vao = 0; ///< Vertex array of the shader path, the buffer holds interleaved ShaderVertex
+
+        ///< Colors of classes 0-255 for the shader path; empty if the mesh has no classes
+        std::vector<QVector3D> palette;
+
+        ///< Level-of-detail hierarchy of point clouds, empty for meshes and parts being loaded
+        Mpcv::PointOctree octree;
+
+        ///< Octree nodes drawn in the current frame
+        std::vector<int> visibleNodes;
 
         bool pointCloud() const {
             return mesh.faces.empty();
         }
+        std::size_t numFaces() const {
+            return counts.indices > 0 ? counts.indices / 3 : counts.vertices / 9;
+        }
         bool hasNormals() const {
             // mesh always has (face) normals
             return !pointCloud() || !mesh.normals.empty();
@@ -56,6 +130,41 @@ class OpenGLWidget : public QOpenGLWidget, public QOpenGLFunctions {
             return !pointCloud() && !mesh.uv.empty();
         }
     };
+    /// DEM drawn as a quadtree of tiles, refined where the screen-space error of the tiles is too large.
+    struct TerrainData {
+        std::unique_ptr<Mpcv::DemTerrain> source;
+        GLuint texture = 0;
+
+        struct Tile {
+            MeshData data;
+            std::size_t lastFrame = 0; ///< Last frame the tile was needed, used to evict unused tiles
+        };
+        std::map<Mpcv::TerrainTileId, Tile> tiles;
+
+        ///< Drawn in the last frame
+        std::size_t numVertices = 0;
+        std::size_t numFaces = 0;
+    };
+    /// Point cloud streamed from an on-disk octree; only the nodes needed for the view are kept in memory.
+    struct StreamedCloud {
+        std::unique_ptr<Mpcv::CachedOctree> source;
+
+        struct Node {
+            MeshData data;
+            std::size_t lastFrame = 0; ///< Last frame the node was needed, used to evict unused nodes
+        };
+        std::map<int, Node> nodes;
+
+        ///< Nodes being read by background threads; declared after the source, so that the reads finish
+        /// before the source is closed
+        std::map<int, std::future<Mpcv::TexturedMesh>> pending;
+
+        ///< Nodes drawn in the current frame
+        std::vector<int> visibleNodes;
+
+        ///< Drawn in the last frame
+        std::size_t numPoints = 0;
+    };
     // Pvl::Optional<Triangle> selected;
 
     Mpcv::Camera camera_;
@@ -70,11 +179,46 @@ class OpenGLWidget : public QOpenGLWidget, public QOpenGLFunctions {
     bool enableClasses_ = false;
 
     std::map<const void*, MeshData> meshes_;
+
+    ///< Parts of meshes being loaded, each in a separate buffer
+    std::map<const void*, std::vector<MeshData>> partial_;
+
+    std::map<const void*, TerrainData> terrains_;
+    std::map<const void*, StreamedCloud> streamed_;
+    std::size_t frame_ = 0;
+
+    ///< Number of terrain tiles that can still be loaded in the current frame
+    int terrainLoads_ = 0;
+
     bool wireframe_ = false;
     bool dots_ = false;
     bool bboxes_ = false;
     bool vbos_ = true;
 
+    ///< Functions of occlusion queries and conditional rendering; nullptr if not supported by the context
+    QOpenGLFunctions_3_0* gl30_ = nullptr;
+
+    ///< Functions and program of the shader render path; nullptr if the fixed-function pipeline is used
+    QOpenGLFunctions_3_3_Core* gl33_ = nullptr;
+    std::unique_ptr<QOpenGLShaderProgram> program_;
+
+    ///< Mesh whose palette is currently set in the program, to skip uploading the same palette again
+    const MeshData* paletteMesh_ = nullptr;
+
+    ///< Matrices of the current frame, used by the shader path
+    QMatrix4x4 projection_;
+    QMatrix4x4 modelView_;
+
+    ///< Statistics of the current frame, shown in the overlay
+    struct {
+        std::size_t drawCalls = 0;
+        std::size_t frustumCulled = 0;
+        std::size_t occluded = 0; ///< Chunks hidden in the last frame, drawn only if they got visible
+    } stats_;
+
+    ///< Draws meshes by shared vertices and element buffers instead of unrolling the vertices of each face
+    bool indexed_ = true;
+
     struct {
         QPoint pos0;
         Mpcv::ArcBall ab;
@@ -97,8 +241,29 @@ public:
 
     virtual void paintGL() override;
 
+    /// Builds the octree of point clouds or the chunks of meshes, reordering the mesh. Takes long for large
+    /// meshes, so loaders call it on their worker threads. Thread-safe.
+    static PreparedMesh prepare(Mpcv::TexturedMesh&& mesh);
+
+    /// Shows the mesh. If a mesh with the same handle is already shown, it is only re-uploaded with new
+    /// attributes; its geometry must not have changed, the octree or chunks built before are kept.
+    void view(const void* handle, std::string basename, PreparedMesh&& prepared);
+
+    /// Prepares and shows the mesh on the calling thread.
     void view(const void* handle, std::string basename, Mpcv::TexturedMesh&& mesh);
 
+    /// \brief Shows a part of the mesh that is still being loaded.
+    ///
+    /// The parts are drawn until the complete mesh with the same handle is passed to view() or the mesh
+    /// is deleted.
+    void viewPartial(const void* handle, Mpcv::TexturedMesh&& part);
+
+    /// Shows the DEM as a level-of-detail terrain, loading the tiles while drawing.
+    void viewTerrain(const void* handle, std::string basename, std::unique_ptr<Mpcv::DemTerrain>&& terrain);
+
+    /// Shows the point cloud stored in the octree, reading the nodes in the background while drawing.
+    void viewStreamed(const void* handle, std::string basename, std::unique_ptr<Mpcv::CachedOctree>&& octree);
+
     void toggle(const void* handle, bool on) {
         meshes_[handle].enabled = on;
         update();
@@ -167,9 +332,11 @@ public:
 
     void screenshot(const QString& file);
 
-    void saveAsMesh(const QString& file,
+    /// Saves given meshes into a single .ply file, returns false if cancelled.
+    bool saveAsMesh(const QString& file,
                     const std::vector<const void*>& handles,
-                    std::function<bool(float)> progress);
+                    std::function<bool(float)> progress,
+                    Mpcv::PlyFormat format = Mpcv::PlyFormat::BINARY_LITTLE_ENDIAN);
 
     void setRenderSettings(const Mpcv::RenderSettings& settings) {
         renderSettings_ = settings;
@@ -188,6 +355,76 @@ public:
 private:
     void updateCamera();
 
+    GLuint uploadTexture(Mpcv::ITexture& tex);
+
+    /// Creates the vertex arrays (and buffers) from the mesh, converting it into given SRS.
+    void upload(MeshData& data, const Mpcv::Srs& refSrs, bool updateOnly);
+
+    /// Creates the arrays of shared vertices and the faces indexing them. Vertices are duplicated only if
+    /// the faces need different uv coordinates or AO values.
+    void createIndexedArrays(MeshData& data, const Mpcv::SrsConv& conv);
+
+    void drawMesh(const MeshData& mesh);
+
+    /// Draws the mesh with the shader program, from the vertex array created by uploadInterleaved.
+    void drawMeshShaded(const MeshData& mesh);
+
+    /// Issues the draw calls of the points or faces of the mesh, with the vertex attributes already set up.
+    void drawPrimitives(const MeshData& mesh, bool useTexture, int stride);
+
+    /// Uploads the vertex arrays as interleaved ShaderVertex buffer and creates the vertex array object.
+    void uploadInterleaved(MeshData& data, bool updateOnly);
+
+    void drawFaces(const MeshData& mesh, std::size_t firstFace, std::size_t numFaces);
+
+    /// Draws the chunks of given faces intersecting the view frustum. With occlusion culling, the chunks
+    /// hidden in the last frame are drawn conditionally on their occlusion queries, and queries are issued
+    /// if the queries flag is set.
+    void drawVisibleFaces(const MeshData& mesh, std::size_t firstFace, std::size_t numFaces, bool queries);
+
+    /// Issues occlusion queries of the chunk bounding boxes against the current depth buffer. Chunks hidden
+    /// in the last frame are then drawn only if their boxes passed the depth test, without waiting for the
+    /// query results on the CPU.
+    void queryOcclusion(const MeshData& mesh,
+        const std::vector<std::size_t>& occluded,
+        const std::vector<std::size_t>& tested);
+
+    void deleteQueries(MeshData& data);
+
+    /// Frustum of the perspective projection used by paintGL.
+    Mpcv::Frustum viewFrustum() const;
+
+    void deleteBuffers(MeshData& data);
+
+    void deletePartial(const void* handle);
+
+    /// Selects the octree nodes of all point clouds drawn in this frame, refining the nodes with the largest
+    /// projected point spacing first until the point budget is reached. Missing nodes of streamed clouds are
+    /// requested in the same order; returns false if some of them are still being read.
+    bool selectOctreeNodes();
+
+    /// Uploads the nodes of streamed clouds read since the last frame.
+    void receiveStreamedNodes();
+
+    /// Deletes the streamed nodes not needed in the last frames, keeping the memory usage bounded.
+    void evictStreamedNodes();
+
+    /// Draws the tiles of the terrain, returns false if some tiles are still missing.
+    bool drawTerrain(TerrainData& terrain);
+
+    /// Collects the tiles with sufficiently small screen-space error, starting from the given tile. Returns
+    /// false if the tile needs to be refined but its children are not loaded yet.
+    bool selectTerrainTiles(TerrainData& terrain,
+        const Mpcv::TerrainTileId& id,
+        TerrainData::Tile& tile,
+        std::vector<TerrainData::Tile*>& selected);
+
+    /// Returns the tile, loading it if the frame budget allows; returns nullptr otherwise.
+    TerrainData::Tile* terrainTile(TerrainData& terrain, const Mpcv::TerrainTileId& id);
+
+    /// Deletes the tiles not needed in the last frames, keeping the memory usage bounded.
+    void evictTerrainTiles(TerrainData& terrain);
+
     template <typename MeshFunc>
     void meshOperation(const MeshFunc& meshFunc);
 };
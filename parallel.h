@@ -0,0 +1,79 @@
+#pragma once
+
+#include "mesh.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+namespace Mpcv {
+
+/// Thread-safe counter of processed work, shared by the worker threads.
+class ProgressCounter {
+    std::atomic<std::size_t> done_{ 0 };
+    std::atomic<bool> cancelled_{ false };
+    std::size_t total_;
+
+public:
+    explicit ProgressCounter(const std::size_t total)
+        : total_(total) {}
+
+    void add(const std::size_t count) {
+        done_ += count;
+    }
+
+    void cancel() {
+        cancelled_ = true;
+    }
+
+    bool cancelled() const {
+        return cancelled_;
+    }
+
+    float value() const {
+        return total_ > 0 ? std::min(100.f * done_ / total_, 100.f) : 0.f;
+    }
+};
+
+/// \brief Executes the function on a background thread and reports its progress from the calling thread.
+///
+/// The function is free to use TBB algorithms; the progress callback (which usually pumps the Qt event
+/// loop) is only ever called from the calling thread. Exceptions thrown by the function are rethrown.
+/// Returns false if the operation has been cancelled.
+template <typename Func>
+bool runWithProgress(ProgressCounter& counter, const Progress& prog, const Func& func) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool finished = false;
+    std::exception_ptr error;
+    std::thread worker([&] {
+        try {
+            func();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        finished = true;
+        cv.notify_one();
+    });
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (cv.wait_for(lock, std::chrono::milliseconds(50), [&finished] { return finished; })) {
+                break;
+            }
+        }
+        if (!counter.cancelled() && prog(counter.value())) {
+            counter.cancel();
+        }
+    }
+    worker.join();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return !counter.cancelled();
+}
+
+} // namespace Mpcv
@@ -2,7 +2,9 @@
 
 #include "coordinates.h"
 #include "pvl/Box.hpp"
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 namespace Mpcv {
 
@@ -12,20 +14,113 @@ enum class CloudSubset {
     STREET_ONLY,
 };
 
+enum class StrideMode {
+    EXACT,       ///< Loads exactly every n-th point
+    APPROXIMATE, ///< Loads about 1/n of the points, allowing to skip LAZ chunks without decoding them
+};
+
+/// Rule telling street (mobile mapping) points from aerial points in mixed point clouds.
+struct SubsetRule {
+    enum class Attribute {
+        SCAN_ANGLE,   ///< Absolute value of the scan angle in degrees
+        POINT_SOURCE, ///< Point source ID in LAS files, scan index in E57 files
+        CLASS,        ///< Point classification
+    };
+    Attribute attribute = Attribute::SCAN_ANGLE;
+
+    ///< Points with the attribute within [from, to] are street points; the default scan angles assume
+    /// that aerial scanners stay within +-30 degrees, while mobile scanners sweep the whole profile
+    double from = 35.;
+    double to = 180.;
+
+    bool isStreet(const double value) const {
+        return value >= from && value <= to;
+    }
+};
+
+/// Returns true if street or aerial points (depending on the flag) belong to the subset.
+inline bool selects(const CloudSubset subset, const bool street) {
+    return subset == CloudSubset::ALL || street == (subset == CloudSubset::STREET_ONLY);
+}
+
+/// Per-point attributes loaded in addition to the positions, used as bit flags.
+enum class PointAttribute {
+    COLOR = 1 << 0,
+    CLASS = 1 << 1,
+    TIME = 1 << 2,
+    NORMAL = 1 << 3,
+    SCALAR = 1 << 4, ///< Other per-vertex properties, stored as named scalar channels
+    ALL = (1 << 5) - 1,
+};
+
 struct Parameters {
     Pvl::BoundingBox<Coords> extents;
     int pointStride;
+    StrideMode strideMode;
     CloudSubset subset;
+    SubsetRule subsetRule;
+
+    ///< Combination of PointAttribute flags; attributes not listed are never allocated by the loaders
+    int attributes;
+
     float textureScale;
     int dsmResolution;
 
+    ///< Screen-space error (in pixels) of DEMs shown as level-of-detail terrain; 0 loads DEMs as a single
+    /// mesh with the DSM resolution
+    float terrainError;
+
+    ///< Maximum number of points of the octree-based clouds drawn in a frame
+    std::size_t pointBudget;
+
+    ///< Point clouds larger than this (in bytes) are converted to on-disk octrees and streamed; 0 loads all
+    /// point clouds into memory
+    std::size_t outOfCoreSize;
+
+    ///< Skips the mesh chunks hidden in the last frame, using hardware occlusion queries
+    bool occlusionCulling;
+
+    ///< Draws meshes and point clouds with GLSL shaders instead of the fixed-function pipeline
+    bool shaders;
+
+    ///< Indices of scans loaded from E57 files; empty means all scans
+    std::vector<int> scans;
+
+    ///< Number of points read from E57 files at once by each thread
+    int e57BlockSize;
+
+    ///< Directory of cached meshes; empty string means ~/.cache/mpcv, "source" stores the cache next to
+    /// the loaded file and "off" disables the cache
+    std::string cacheDir;
+
+    ///< Size (in bytes) of the cache directory, least recently used files are removed above it; 0 means
+    /// no limit. Not applied to caches stored next to the loaded files.
+    std::size_t cacheSizeLimit;
+
+    ///< Memory (in bytes) the concurrently loaded files may take; 0 means half of the physical memory
+    std::size_t loadMemoryLimit;
+
     Parameters() {
         extents.lower() = Coords(std::numeric_limits<double>::lowest());
         extents.upper() = Coords(std::numeric_limits<double>::max());
         pointStride = 1;
+        strideMode = StrideMode::EXACT;
         subset = CloudSubset::ALL;
+        attributes = int(PointAttribute::ALL);
         textureScale = 1.f;
         dsmResolution = 1000;
+        terrainError = 0.f;
+        pointBudget = 20000000;
+        outOfCoreSize = 0;
+        occlusionCulling = false;
+        shaders = false;
+        e57BlockSize = 1 << 20;
+        loadMemoryLimit = 0;
+        cacheSizeLimit = std::size_t(20) << 30;
+    }
+
+    bool loads(const PointAttribute attribute) const {
+        return (attributes & int(attribute)) != 0;
     }
 
     static Parameters& global() {
@@ -41,4 +136,71 @@ inline Pvl::BoundingBox<Coords> parseExtents(const std::string& s) {
         Coords(urx, ury, std::numeric_limits<double>::max()));
 }
 
+/// Parses the subset rule in format "attribute:from-to", where attribute is "angle", "source" or "class".
+inline SubsetRule parseSubsetRule(const std::string& s) {
+    SubsetRule rule;
+    const std::size_t colon = s.find(':');
+    const std::string attribute = s.substr(0, colon);
+    if (attribute == "angle") {
+        rule.attribute = SubsetRule::Attribute::SCAN_ANGLE;
+    } else if (attribute == "source") {
+        rule.attribute = SubsetRule::Attribute::POINT_SOURCE;
+    } else if (attribute == "class") {
+        rule.attribute = SubsetRule::Attribute::CLASS;
+    } else {
+        throw std::runtime_error("Unknown subset attribute '" + attribute + "'");
+    }
+    if (colon == std::string::npos || sscanf(s.c_str() + colon + 1, "%lf-%lf", &rule.from, &rule.to) != 2) {
+        throw std::runtime_error("Missing range of subset rule '" + s + "'");
+    }
+    return rule;
+}
+
+/// Parses comma-separated list of indices or index ranges, for example "0-9,12".
+inline std::vector<int> parseIndices(const std::string& s) {
+    std::vector<int> indices;
+    std::size_t begin = 0;
+    while (begin < s.size()) {
+        const std::size_t end = std::min(s.find(',', begin), s.size());
+        int from, to;
+        const std::string item = s.substr(begin, end - begin);
+        const int count = sscanf(item.c_str(), "%d-%d", &from, &to);
+        if (count < 1 || from < 0 || (count == 2 && to < from)) {
+            throw std::runtime_error("Invalid index range '" + item + "'");
+        }
+        for (int i = from; i <= (count == 2 ? to : from); ++i) {
+            indices.push_back(i);
+        }
+        begin = end + 1;
+    }
+    return indices;
+}
+
+/// Parses comma-separated list of attributes, for example "xyz,rgb,class". Positions are always loaded.
+inline int parseAttributes(const std::string& s) {
+    int attributes = 0;
+    std::size_t begin = 0;
+    while (begin <= s.size()) {
+        const std::size_t end = std::min(s.find(',', begin), s.size());
+        const std::string name = s.substr(begin, end - begin);
+        if (name == "rgb") {
+            attributes |= int(PointAttribute::COLOR);
+        } else if (name == "class") {
+            attributes |= int(PointAttribute::CLASS);
+        } else if (name == "time") {
+            attributes |= int(PointAttribute::TIME);
+        } else if (name == "normal") {
+            attributes |= int(PointAttribute::NORMAL);
+        } else if (name == "scalar") {
+            attributes |= int(PointAttribute::SCALAR);
+        } else if (name == "all") {
+            attributes |= int(PointAttribute::ALL);
+        } else if (name != "xyz") {
+            throw std::runtime_error("Unknown attribute '" + name + "'");
+        }
+        begin = end + 1;
+    }
+    return attributes;
+}
+
 } // namespace Mpcv
@@ -0,0 +1,1292 @@
+#include "ply.h"
+#include "mappedfile.h"
+#include "parallel.h"
+#include "parameters.h"
+#include "scanner.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <tbb/tbb.h>
+
+namespace Mpcv {
+
+inline std::vector<int> faceAoToVertexAo(const TexturedMesh& mesh) {
+    std::vector<int> ao(mesh.vertices.size(), 0);
+    std::vector<int> counts(mesh.vertices.size(), 0);
+    for (std::size_t fi = 0; fi < mesh.faces.size(); ++fi) {
+        for (int i = 0; i < 3; ++i) {
+            const int vi = mesh.faces[fi][i];
+            ao[vi] += mesh.ao[3 * fi + i];
+            counts[vi]++;
+        }
+    }
+    for (std::size_t vi = 0; vi < mesh.vertices.size(); ++vi) {
+        if (counts[vi] > 0) {
+            ao[vi] /= counts[vi];
+        }
+    }
+    return ao;
+}
+
+namespace {
+
+using Buffer = std::vector<char>;
+
+/// Attributes written for each vertex, common for all saved meshes.
+struct PlyVertexLayout {
+    PlyFormat format;
+    bool normals;
+    bool colors;
+
+    std::size_t vertexSize() const {
+        return 3 * sizeof(float) + (normals ? 3 * sizeof(float) : 0) + (colors ? 3 : 0);
+    }
+
+    std::size_t faceSize() const {
+        return 1 + 3 * sizeof(int32_t);
+    }
+};
+
+template <typename T>
+inline char* put(char* ptr, const T value) {
+    memcpy(ptr, &value, sizeof(T));
+    return ptr + sizeof(T);
+}
+
+/// Encodes a single mesh into .ply records.
+class PlyMeshEncoder {
+    const TexturedMesh& mesh_;
+    const PlyVertexLayout& layout_;
+    SrsConv conv_;
+    std::size_t indexOffset_;
+    std::vector<int> ao_;
+
+public:
+    PlyMeshEncoder(const TexturedMesh& mesh, const PlyVertexLayout& layout, const Srs& srs, std::size_t indexOffset)
+        : mesh_(mesh)
+        , layout_(layout)
+        , conv_(mesh.srs, srs)
+        , indexOffset_(indexOffset) {
+        if (layout.colors && mesh.colors.empty() && !mesh.ao.empty()) {
+            // .ply format does not support per-face colors
+            ao_ = faceAoToVertexAo(mesh);
+        }
+    }
+
+    /// Appends vertices [from, to) to the buffer.
+    void encodeVertices(Buffer& buffer, const std::size_t from, const std::size_t to) const {
+        if (layout_.format == PlyFormat::ASCII) {
+            encodeVerticesAscii(buffer, from, to);
+        } else {
+            encodeVerticesBinary(buffer, from, to);
+        }
+    }
+
+    /// Appends faces [from, to) to the buffer.
+    void encodeFaces(Buffer& buffer, const std::size_t from, const std::size_t to) const {
+        if (layout_.format == PlyFormat::ASCII) {
+            std::ostringstream out;
+            for (std::size_t fi = from; fi < to; ++fi) {
+                const TexturedMesh::Face& f = mesh_.faces[fi];
+                out << "3 " << indexOffset_ + f[0] << " " << indexOffset_ + f[1] << " " << indexOffset_ + f[2]
+                    << "\n";
+            }
+            append(buffer, out.str());
+        } else {
+            const std::size_t size = buffer.size();
+            buffer.resize(size + (to - from) * layout_.faceSize());
+            char* ptr = buffer.data() + size;
+            for (std::size_t fi = from; fi < to; ++fi) {
+                const TexturedMesh::Face& f = mesh_.faces[fi];
+                ptr = put<uint8_t>(ptr, 3);
+                for (int i = 0; i < 3; ++i) {
+                    ptr = put<int32_t>(ptr, int32_t(indexOffset_ + f[i]));
+                }
+            }
+        }
+    }
+
+private:
+    Color color(const std::size_t vi) const {
+        if (!mesh_.colors.empty()) {
+            return mesh_.colors[vi];
+        } else if (!ao_.empty()) {
+            return Color(ao_[vi], ao_[vi], ao_[vi]);
+        } else {
+            return Color(255, 255, 255);
+        }
+    }
+
+    Pvl::Vec3f normal(const std::size_t vi) const {
+        return !mesh_.normals.empty() ? mesh_.normals[vi] : Pvl::Vec3f(0.f); /// \todo or z-up?
+    }
+
+    void encodeVerticesAscii(Buffer& buffer, const std::size_t from, const std::size_t to) const {
+        std::ostringstream out;
+        for (std::size_t vi = from; vi < to; ++vi) {
+            const Pvl::Vec3f p = conv_(mesh_.vertices[vi]);
+            out << p[0] << " " << p[1] << " " << p[2];
+            if (layout_.normals) {
+                const Pvl::Vec3f n = normal(vi);
+                out << " " << n[0] << " " << n[1] << " " << n[2];
+            }
+            if (layout_.colors) {
+                const Color c = color(vi);
+                out << " " << int(c[0]) << " " << int(c[1]) << " " << int(c[2]);
+            }
+            out << "\n";
+        }
+        append(buffer, out.str());
+    }
+
+    void encodeVerticesBinary(Buffer& buffer, const std::size_t from, const std::size_t to) const {
+        const std::size_t size = buffer.size();
+        buffer.resize(size + (to - from) * layout_.vertexSize());
+        char* ptr = buffer.data() + size;
+        for (std::size_t vi = from; vi < to; ++vi) {
+            const Pvl::Vec3f p = conv_(mesh_.vertices[vi]);
+            for (int i = 0; i < 3; ++i) {
+                ptr = put<float>(ptr, p[i]);
+            }
+            if (layout_.normals) {
+                const Pvl::Vec3f n = normal(vi);
+                for (int i = 0; i < 3; ++i) {
+                    ptr = put<float>(ptr, n[i]);
+                }
+            }
+            if (layout_.colors) {
+                const Color c = color(vi);
+                for (int i = 0; i < 3; ++i) {
+                    ptr = put<uint8_t>(ptr, c[i]);
+                }
+            }
+        }
+    }
+
+    static void append(Buffer& buffer, const std::string& data) {
+        buffer.insert(buffer.end(), data.begin(), data.end());
+    }
+};
+
+void writeHeader(std::ostream& out,
+    const PlyVertexLayout& layout,
+    const std::size_t numVertices,
+    const std::size_t numFaces) {
+    out << "ply\n";
+    if (layout.format == PlyFormat::ASCII) {
+        out << "format ascii 1.0\n";
+    } else {
+        out << "format binary_little_endian 1.0\n";
+    }
+    out << "comment Created by MPCV\n";
+    out << "element vertex " << numVertices << "\n";
+    out << "property float x\n";
+    out << "property float y\n";
+    out << "property float z\n";
+    if (layout.normals) {
+        out << "property float nx\n";
+        out << "property float ny\n";
+        out << "property float nz\n";
+    }
+    if (layout.colors) {
+        out << "property uchar red\n";
+        out << "property uchar green\n";
+        out << "property uchar blue\n";
+    }
+    out << "element face " << numFaces << "\n";
+    out << "property list uchar int vertex_index\n";
+    out << "end_header\n";
+}
+
+/// \brief Writes encoded batches to the stream on a separate thread.
+///
+/// Batches are double-buffered: the next batch is encoded while the previous one is being flushed, so
+/// that formatting overlaps with the disk I/O and at most two batches are held in memory.
+class AsyncPlyWriter {
+    std::ostream& out_;
+    std::vector<Buffer> batches_[2];
+    int current_ = 0;
+    std::future<void> flush_;
+
+public:
+    explicit AsyncPlyWriter(std::ostream& out)
+        : out_(out) {}
+
+    ~AsyncPlyWriter() {
+        if (flush_.valid()) {
+            flush_.wait();
+        }
+    }
+
+    /// Returns the block buffers of the batch being encoded.
+    std::vector<Buffer>& batch() {
+        return batches_[current_];
+    }
+
+    /// Starts writing the current batch and switches to the other one.
+    void flush() {
+        wait();
+        const std::vector<Buffer>& batch = batches_[current_];
+        flush_ = std::async(std::launch::async, [this, &batch] {
+            for (const Buffer& buffer : batch) {
+                out_.write(buffer.data(), buffer.size());
+            }
+            if (!out_) {
+                throw std::runtime_error("Cannot write .ply file");
+            }
+        });
+        current_ = 1 - current_;
+    }
+
+    /// Waits until the pending batch is written, rethrowing write errors.
+    void wait() {
+        if (flush_.valid()) {
+            flush_.get();
+        }
+    }
+};
+
+/// \brief Encodes records [0, count) in parallel and passes them to the writer.
+///
+/// Records are processed in batches; each batch is split into blocks encoded concurrently into separate
+/// buffers, which are then written sequentially. Returns false if cancelled.
+template <typename Encode>
+bool encodeParallel(AsyncPlyWriter& writer, const std::size_t count, const Encode& encode, ProgressCounter& counter) {
+    const std::size_t BLOCK = 1 << 14;
+    const std::size_t BATCH = 64 * BLOCK;
+    for (std::size_t batch = 0; batch < count; batch += BATCH) {
+        if (counter.cancelled()) {
+            return false;
+        }
+        const std::size_t batchEnd = std::min(batch + BATCH, count);
+        const std::size_t numBlocks = (batchEnd - batch + BLOCK - 1) / BLOCK;
+        std::vector<Buffer>& buffers = writer.batch();
+        buffers.resize(numBlocks);
+        tbb::parallel_for(std::size_t(0), numBlocks, [&](std::size_t bi) {
+            const std::size_t from = batch + bi * BLOCK;
+            const std::size_t to = std::min(from + BLOCK, batchEnd);
+            buffers[bi].clear();
+            encode(buffers[bi], from, to);
+        });
+        writer.flush();
+        counter.add(batchEnd - batch);
+    }
+    return !counter.cancelled();
+}
+
+} // namespace
+
+bool savePly(std::ostream& out, const TexturedMesh& mesh, const PlyFormat format) {
+    return savePly(out, { &mesh }, [](float) { return false; }, format);
+}
+
+bool savePly(std::ostream& out,
+    const std::vector<const TexturedMesh*>& meshes,
+    const Progress& progress,
+    const PlyFormat format) {
+    if (format == PlyFormat::BINARY_BIG_ENDIAN) {
+        throw std::runtime_error("Saving big endian .ply files is not supported");
+    }
+    std::size_t totalVertices = 0;
+    std::size_t totalFaces = 0;
+    PlyVertexLayout layout{ format, false, false };
+    for (const TexturedMesh* mesh : meshes) {
+        totalVertices += mesh->vertices.size();
+        totalFaces += mesh->faces.size();
+        layout.colors |= !mesh->colors.empty();
+        layout.colors |= !mesh->ao.empty();
+        layout.normals |= !mesh->normals.empty();
+    }
+    writeHeader(out, layout, totalVertices, totalFaces);
+    if (meshes.empty()) {
+        return true;
+    }
+
+    // encode and write on a worker thread, the progress callback keeps the event loop of the caller running
+    ProgressCounter counter(totalVertices + totalFaces);
+    return runWithProgress(counter, progress, [&meshes, &layout, &counter, &out] {
+        AsyncPlyWriter writer(out);
+
+        // translate to the SRS of the first mesh
+        const Srs srs = meshes[0]->srs;
+        for (const TexturedMesh* mesh : meshes) {
+            PlyMeshEncoder encoder(*mesh, layout, srs, 0);
+            auto encode = [&encoder](Buffer& buffer, std::size_t from, std::size_t to) {
+                encoder.encodeVertices(buffer, from, to);
+            };
+            if (!encodeParallel(writer, mesh->vertices.size(), encode, counter)) {
+                return;
+            }
+        }
+
+        std::size_t offset = 0;
+        for (const TexturedMesh* mesh : meshes) {
+            PlyMeshEncoder encoder(*mesh, layout, srs, offset);
+            auto encode = [&encoder](Buffer& buffer, std::size_t from, std::size_t to) {
+                encoder.encodeFaces(buffer, from, to);
+            };
+            if (!encodeParallel(writer, mesh->faces.size(), encode, counter)) {
+                return;
+            }
+            offset += mesh->vertices.size();
+        }
+        writer.wait();
+    });
+}
+
+
+namespace {
+
+enum class PlyType {
+    INT8,
+    UINT8,
+    INT16,
+    UINT16,
+    INT32,
+    UINT32,
+    FLOAT32,
+    FLOAT64,
+};
+
+struct PlyProperty {
+    std::string name;
+    PlyType type;
+
+    ///< Type declared in the header; differs from type if the values are converted when parsing ASCII files
+    PlyType declaredType;
+
+    ///< Only used by list properties
+    bool list = false;
+    PlyType countType;
+
+    ///< Offset in bytes from the start of the record; only valid for fixed-size elements
+    std::size_t offset = 0;
+};
+
+struct PlyElement {
+    std::string name;
+    std::size_t count = 0;
+    std::vector<PlyProperty> properties;
+
+    ///< Size of a record in bytes, or 0 if the element contains a list property
+    std::size_t stride = 0;
+
+    const PlyProperty* find(const std::string& name) const {
+        for (const PlyProperty& prop : properties) {
+            if (prop.name == name) {
+                return &prop;
+            }
+        }
+        return nullptr;
+    }
+};
+
+struct PlyHeader {
+    PlyFormat format = PlyFormat::ASCII;
+    std::vector<PlyElement> elements;
+
+    ///< Size of the header in bytes, including the end_header line
+    std::size_t size = 0;
+};
+
+std::size_t typeSize(const PlyType type) {
+    switch (type) {
+    case PlyType::INT8:
+    case PlyType::UINT8:
+        return 1;
+    case PlyType::INT16:
+    case PlyType::UINT16:
+        return 2;
+    case PlyType::INT32:
+    case PlyType::UINT32:
+    case PlyType::FLOAT32:
+        return 4;
+    case PlyType::FLOAT64:
+        return 8;
+    default:
+        throw std::runtime_error("Invalid property type");
+    }
+}
+
+PlyType parseType(const std::string& name) {
+    if (name == "char" || name == "int8") {
+        return PlyType::INT8;
+    } else if (name == "uchar" || name == "uint8") {
+        return PlyType::UINT8;
+    } else if (name == "short" || name == "int16") {
+        return PlyType::INT16;
+    } else if (name == "ushort" || name == "uint16") {
+        return PlyType::UINT16;
+    } else if (name == "int" || name == "int32") {
+        return PlyType::INT32;
+    } else if (name == "uint" || name == "uint32") {
+        return PlyType::UINT32;
+    } else if (name == "float" || name == "float32") {
+        return PlyType::FLOAT32;
+    } else if (name == "double" || name == "float64") {
+        return PlyType::FLOAT64;
+    } else {
+        throw std::runtime_error("Unknown .ply property type '" + name + "'");
+    }
+}
+
+PlyHeader parseHeader(const char* data, const std::size_t size) {
+    PlyHeader header;
+    const char* end = data + size;
+    const char* pos = data;
+    bool magic = true;
+    while (pos < end) {
+        const char* eol = static_cast<const char*>(memchr(pos, '\n', end - pos));
+        if (!eol) {
+            break;
+        }
+        std::string line(pos, eol);
+        pos = eol + 1;
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (magic) {
+            if (line != "ply") {
+                throw std::runtime_error("Not a .ply file");
+            }
+            magic = false;
+            continue;
+        }
+
+        std::stringstream ss(line);
+        std::string keyword;
+        ss >> keyword;
+        if (keyword == "format") {
+            std::string format;
+            ss >> format;
+            if (format == "ascii") {
+                header.format = PlyFormat::ASCII;
+            } else if (format == "binary_little_endian") {
+                header.format = PlyFormat::BINARY_LITTLE_ENDIAN;
+            } else if (format == "binary_big_endian") {
+                header.format = PlyFormat::BINARY_BIG_ENDIAN;
+            } else {
+                throw std::runtime_error("Unknown .ply format '" + format + "'");
+            }
+        } else if (keyword == "element") {
+            PlyElement element;
+            ss >> element.name >> element.count;
+            header.elements.push_back(element);
+        } else if (keyword == "property") {
+            if (header.elements.empty()) {
+                throw std::runtime_error("Property '" + line + "' does not belong to any element");
+            }
+            PlyProperty prop;
+            std::string type;
+            ss >> type;
+            if (type == "list") {
+                std::string countType, itemType;
+                ss >> countType >> itemType;
+                prop.list = true;
+                prop.countType = parseType(countType);
+                prop.type = parseType(itemType);
+            } else {
+                prop.type = parseType(type);
+            }
+            prop.declaredType = prop.type;
+            ss >> prop.name;
+            header.elements.back().properties.push_back(prop);
+        } else if (keyword == "end_header") {
+            header.size = pos - data;
+            break;
+        }
+        // comments and obj_info are ignored
+    }
+    if (header.size == 0) {
+        throw std::runtime_error("Missing end_header in .ply file");
+    }
+
+    for (PlyElement& element : header.elements) {
+        std::size_t offset = 0;
+        bool fixed = true;
+        for (PlyProperty& prop : element.properties) {
+            prop.offset = offset;
+            if (prop.list) {
+                fixed = false;
+            } else {
+                offset += typeSize(prop.type);
+            }
+        }
+        element.stride = fixed ? offset : 0;
+    }
+    return header;
+}
+
+bool bigEndianHost() {
+    const uint16_t value = 1;
+    uint8_t first;
+    memcpy(&first, &value, 1);
+    return first == 0;
+}
+
+template <typename T>
+inline T byteSwap(const T value) {
+    char bytes[sizeof(T)];
+    memcpy(bytes, &value, sizeof(T));
+    std::reverse(bytes, bytes + sizeof(T));
+    T result;
+    memcpy(&result, bytes, sizeof(T));
+    return result;
+}
+
+template <typename T, bool Swap>
+inline T loadValue(const char* ptr) {
+    T value;
+    memcpy(&value, ptr, sizeof(T));
+    return Swap ? byteSwap(value) : value;
+}
+
+/// Copies one property of consecutive fixed-size records into a strided destination array.
+template <typename Src, bool Swap, typename Dst, bool Transform>
+void gatherImpl(const char* src,
+    const std::size_t count,
+    const std::size_t srcStride,
+    void* dstPtr,
+    const std::size_t dstStride,
+    const double shift,
+    const double scale) {
+    Dst* dst = static_cast<Dst*>(dstPtr);
+    for (std::size_t i = 0; i < count; ++i) {
+        const Src value = loadValue<Src, Swap>(src + i * srcStride);
+        if (Transform) {
+            dst[i * dstStride] = Dst((double(value) - shift) * scale);
+        } else {
+            dst[i * dstStride] = Dst(value);
+        }
+    }
+}
+
+/// Copies three consecutive float coordinates as a whole, in bulk if the records are tightly packed.
+void gatherPackedVec3f(const char* src,
+    const std::size_t count,
+    const std::size_t srcStride,
+    void* dstPtr,
+    const std::size_t,
+    const double,
+    const double) {
+    char* dst = static_cast<char*>(dstPtr);
+    if (srcStride == sizeof(Pvl::Vec3f)) {
+        memcpy(dst, src, count * sizeof(Pvl::Vec3f));
+    } else {
+        for (std::size_t i = 0; i < count; ++i) {
+            memcpy(dst + i * sizeof(Pvl::Vec3f), src + i * srcStride, sizeof(Pvl::Vec3f));
+        }
+    }
+}
+
+using GatherFunc = void (*)(const char*, std::size_t, std::size_t, void*, std::size_t, double, double);
+
+template <typename Src, typename Dst>
+GatherFunc selectGather(const bool swap, const bool transform) {
+    if (swap) {
+        return transform ? &gatherImpl<Src, true, Dst, true> : &gatherImpl<Src, true, Dst, false>;
+    } else {
+        return transform ? &gatherImpl<Src, false, Dst, true> : &gatherImpl<Src, false, Dst, false>;
+    }
+}
+
+template <typename Dst>
+GatherFunc selectGather(const PlyType type, const bool swap, const bool transform) {
+    switch (type) {
+    case PlyType::INT8:
+        return selectGather<int8_t, Dst>(swap, transform);
+    case PlyType::UINT8:
+        return selectGather<uint8_t, Dst>(swap, transform);
+    case PlyType::INT16:
+        return selectGather<int16_t, Dst>(swap, transform);
+    case PlyType::UINT16:
+        return selectGather<uint16_t, Dst>(swap, transform);
+    case PlyType::INT32:
+        return selectGather<int32_t, Dst>(swap, transform);
+    case PlyType::UINT32:
+        return selectGather<uint32_t, Dst>(swap, transform);
+    case PlyType::FLOAT32:
+        return selectGather<float, Dst>(swap, transform);
+    case PlyType::FLOAT64:
+        return selectGather<double, Dst>(swap, transform);
+    default:
+        throw std::runtime_error("Invalid property type");
+    }
+}
+
+/// Returns the scale factor converting color values of given type to 8-bit colors.
+double colorScale(const PlyType type) {
+    switch (type) {
+    case PlyType::FLOAT32:
+    case PlyType::FLOAT64:
+        return 255.;
+    case PlyType::INT16:
+    case PlyType::UINT16:
+        return 1. / 256.;
+    default:
+        return 1.;
+    }
+}
+
+/// \brief Vertex layout compiled into a list of extraction routines.
+///
+/// The header is resolved once: each property gets a gather loop specialized for its source type, byte
+/// order and destination array, so decoding a block of records runs one tight loop per property with no
+/// branching on the layout. Properties not known to the viewer are kept as named scalar channels.
+class VertexDecoder {
+    struct Op {
+        GatherFunc func;
+        std::size_t offset;
+        char* dst;
+        std::size_t dstSize;
+        std::size_t dstStride;
+        double shift = 0.;
+        double scale = 1.;
+    };
+    std::vector<Op> ops_;
+
+public:
+    /// \param element Vertex element; property offsets and types describe the decoded records.
+    /// \param swap Whether the records need to be byte-swapped.
+    /// \param center Origin of the local coordinates, subtracted from the vertex positions.
+    /// \param mesh Mesh receiving the attributes; the arrays are resized to the number of vertices.
+    VertexDecoder(const PlyElement& element, const bool swap, const Coords& center, TexturedMesh& mesh) {
+        const std::size_t count = element.count;
+        const PlyProperty* position[] = { element.find("x"), element.find("y"), element.find("z") };
+        if (!position[0] || !position[1] || !position[2]) {
+            throw std::runtime_error("Missing vertex coordinates in .ply file");
+        }
+        const PlyProperty* normal[] = { findAny(element, { "nx", "normal_x" }),
+            findAny(element, { "ny", "normal_y" }),
+            findAny(element, { "nz", "normal_z" }) };
+        const PlyProperty* color[] = { findAny(element, { "red", "r", "diffuse_red" }),
+            findAny(element, { "green", "g", "diffuse_green" }),
+            findAny(element, { "blue", "b", "diffuse_blue" }) };
+        const PlyProperty* cls = findAny(element, { "class", "classification", "scalar_Classification" });
+        const bool hasNormals = normal[0] && normal[1] && normal[2];
+        const bool hasColors = color[0] && color[1] && color[2];
+        const Parameters& globals = Parameters::global();
+
+        static_assert(sizeof(Pvl::Vec3f) == 3 * sizeof(float), "Unexpected vector padding");
+        static_assert(sizeof(Color) == 3, "Unexpected color padding");
+        mesh.vertices.resize(count);
+        const bool packed = !swap && center == Coords(0) && position[0]->type == PlyType::FLOAT32 &&
+                            position[1]->type == PlyType::FLOAT32 && position[2]->type == PlyType::FLOAT32 &&
+                            position[1]->offset == position[0]->offset + 4 &&
+                            position[2]->offset == position[0]->offset + 8;
+        if (packed) {
+            ops_.push_back(Op{ &gatherPackedVec3f,
+                position[0]->offset,
+                reinterpret_cast<char*>(mesh.vertices.data()),
+                sizeof(Pvl::Vec3f),
+                1 });
+        } else {
+            // base pointers from data(), the vectors are empty for elements with no vertices
+            float* vertices = reinterpret_cast<float*>(mesh.vertices.data());
+            for (int i = 0; i < 3; ++i) {
+                add<float>(*position[i], swap, vertices + i, 3, center[i], 1.);
+            }
+        }
+        if (hasNormals && globals.loads(PointAttribute::NORMAL)) {
+            mesh.normals.resize(count);
+            float* normals = reinterpret_cast<float*>(mesh.normals.data());
+            for (int i = 0; i < 3; ++i) {
+                add<float>(*normal[i], swap, normals + i, 3, 0., 1.);
+            }
+        }
+        if (hasColors && globals.loads(PointAttribute::COLOR)) {
+            mesh.colors.resize(count);
+            uint8_t* colors = reinterpret_cast<uint8_t*>(mesh.colors.data());
+            for (int i = 0; i < 3; ++i) {
+                add<uint8_t>(*color[i], swap, colors + i, 3, 0., colorScale(color[i]->declaredType));
+            }
+        }
+        if (cls && globals.loads(PointAttribute::CLASS)) {
+            mesh.classes.resize(count);
+            add<uint8_t>(*cls, swap, mesh.classes.data(), 1, 0., 1.);
+        }
+
+        for (const PlyProperty& prop : element.properties) {
+            const PlyProperty* p = &prop;
+            if (std::find(std::begin(position), std::end(position), p) != std::end(position) ||
+                (hasNormals && std::find(std::begin(normal), std::end(normal), p) != std::end(normal)) ||
+                (hasColors && std::find(std::begin(color), std::end(color), p) != std::end(color)) ||
+                p == cls || !globals.loads(PointAttribute::SCALAR)) {
+                continue;
+            }
+            std::cout << "Keeping vertex property '" << prop.name << "' as scalar channel" << std::endl;
+            std::vector<float>& channel = mesh.scalars[prop.name];
+            channel.resize(count);
+            add<float>(prop, swap, channel.data(), 1, 0., 1.);
+        }
+    }
+
+    /// Decodes consecutive records into vertices [first, first + count).
+    void decode(const char* records, const std::size_t stride, const std::size_t first, const std::size_t count)
+        const {
+        for (const Op& op : ops_) {
+            op.func(records + op.offset,
+                count,
+                stride,
+                op.dst + first * op.dstStride * op.dstSize,
+                op.dstStride,
+                op.shift,
+                op.scale);
+        }
+    }
+
+private:
+    static const PlyProperty* findAny(const PlyElement& element, std::initializer_list<const char*> names) {
+        for (const char* name : names) {
+            if (const PlyProperty* prop = element.find(name)) {
+                return prop;
+            }
+        }
+        return nullptr;
+    }
+
+    template <typename Dst>
+    void add(const PlyProperty& prop,
+        const bool swap,
+        Dst* dst,
+        const std::size_t dstStride,
+        const double shift,
+        const double scale) {
+        const bool transform = shift != 0. || scale != 1.;
+        ops_.push_back(Op{ selectGather<Dst>(prop.type, swap, transform),
+            prop.offset,
+            reinterpret_cast<char*>(dst),
+            sizeof(Dst),
+            dstStride,
+            shift,
+            scale });
+    }
+};
+
+/// Files with double precision coordinates are usually georeferenced, their vertices are shifted to
+/// local coordinates to keep the precision of floats.
+bool hasDoubleCoordinates(const PlyElement& element) {
+    const PlyProperty* x = element.find("x");
+    return x && x->type == PlyType::FLOAT64;
+}
+
+Coords localOrigin(const Coords& firstVertex) {
+    return Coords(std::round(firstVertex[0]), std::round(firstVertex[1]), 0.);
+}
+
+/// Returns the vertex position stored in a single record.
+Coords recordPosition(const PlyElement& element, const char* record, const bool swap) {
+    const char* names[] = { "x", "y", "z" };
+    Coords position;
+    for (int i = 0; i < 3; ++i) {
+        const PlyProperty* prop = element.find(names[i]);
+        double value;
+        selectGather<double>(prop->type, swap, false)(record + prop->offset, 1, 0, &value, 1, 0., 1.);
+        position[i] = value;
+    }
+    return position;
+}
+
+template <bool Swap>
+uint32_t loadIndex(const char* ptr, const PlyType type) {
+    switch (type) {
+    case PlyType::INT8:
+        return uint32_t(loadValue<int8_t, Swap>(ptr));
+    case PlyType::UINT8:
+        return loadValue<uint8_t, Swap>(ptr);
+    case PlyType::INT16:
+        return uint32_t(loadValue<int16_t, Swap>(ptr));
+    case PlyType::UINT16:
+        return loadValue<uint16_t, Swap>(ptr);
+    case PlyType::INT32:
+        return uint32_t(loadValue<int32_t, Swap>(ptr));
+    case PlyType::UINT32:
+        return loadValue<uint32_t, Swap>(ptr);
+    default:
+        throw std::runtime_error("Invalid type of .ply list");
+    }
+}
+
+/// Returns the size of a variable-size record in bytes.
+template <bool Swap>
+std::size_t recordSize(const char* record, const PlyElement& element) {
+    std::size_t size = 0;
+    for (const PlyProperty& prop : element.properties) {
+        if (prop.list) {
+            const std::size_t count = loadIndex<Swap>(record + size, prop.countType);
+            size += typeSize(prop.countType) + count * typeSize(prop.type);
+        } else {
+            size += typeSize(prop.type);
+        }
+    }
+    return size;
+}
+
+class BinaryPlyReader {
+    const char* pos_;
+    const char* end_;
+    bool swap_;
+    const Progress& prog_;
+    std::size_t totalRecords_;
+    std::size_t doneRecords_ = 0;
+
+    // number of records processed between progress updates
+    static constexpr std::size_t BLOCK = 1 << 20;
+
+public:
+    BinaryPlyReader(const MappedFile& file, const PlyHeader& header, const Progress& prog)
+        : pos_(file.data() + header.size)
+        , end_(file.end())
+        , prog_(prog) {
+        swap_ = (header.format == PlyFormat::BINARY_BIG_ENDIAN) != bigEndianHost();
+        totalRecords_ = 0;
+        for (const PlyElement& element : header.elements) {
+            totalRecords_ += element.count;
+        }
+    }
+
+    /// Reads vertex attributes directly into mesh arrays, returns false if cancelled.
+    bool readVertices(const PlyElement& element, TexturedMesh& mesh) {
+        if (element.stride == 0) {
+            throw std::runtime_error("List properties of vertices are not supported");
+        }
+        checkSize(element.count * element.stride);
+
+        Coords origin(0.);
+        if (hasDoubleCoordinates(element) && element.count > 0) {
+            origin = localOrigin(recordPosition(element, pos_, swap_));
+            mesh.srs = Srs(origin);
+        }
+        VertexDecoder decoder(element, swap_, origin, mesh);
+        const std::size_t stride = element.stride;
+        for (std::size_t i = 0; i < element.count; i += BLOCK) {
+            const std::size_t count = std::min(BLOCK, element.count - i);
+            decoder.decode(pos_ + i * stride, stride, i, count);
+            if (advance(count)) {
+                return false;
+            }
+        }
+        pos_ += element.count * stride;
+        return true;
+    }
+
+    /// Reads faces, polygons are triangulated as fans; returns false if cancelled.
+    bool readFaces(const PlyElement& element, TexturedMesh& mesh) {
+        const PlyProperty* indices = element.find("vertex_indices");
+        if (!indices) {
+            indices = element.find("vertex_index");
+        }
+        if (!indices || !indices->list) {
+            throw std::runtime_error("Missing vertex indices in .ply file");
+        }
+        mesh.faces.reserve(element.count);
+        // the common case of a single list of triangles has fixed record size
+        const bool triangles = element.properties.size() == 1 && indices->countType == PlyType::UINT8;
+        if (swap_) {
+            return readFaces<true>(element, *indices, triangles, mesh);
+        } else {
+            return readFaces<false>(element, *indices, triangles, mesh);
+        }
+    }
+
+    /// Skips an element not used by the viewer.
+    void skip(const PlyElement& element) {
+        if (element.stride > 0) {
+            checkSize(element.count * element.stride);
+            pos_ += element.count * element.stride;
+        } else {
+            for (std::size_t i = 0; i < element.count; ++i) {
+                pos_ += swap_ ? recordSize<true>(pos_, element) : recordSize<false>(pos_, element);
+            }
+            checkSize(0);
+        }
+    }
+
+private:
+    template <bool Swap>
+    bool readFaces(const PlyElement& element,
+        const PlyProperty& indices,
+        const bool triangles,
+        TexturedMesh& mesh) {
+        const std::size_t countSize = typeSize(indices.countType);
+        const std::size_t indexSize = typeSize(indices.type);
+        const std::size_t triangleSize = countSize + 3 * indexSize;
+        for (std::size_t i = 0; i < element.count; ++i) {
+            if (triangles && pos_ + triangleSize <= end_ && uint8_t(*pos_) == 3) {
+                const char* ptr = pos_ + countSize;
+                mesh.faces.push_back(TexturedMesh::Face{
+                    loadIndex<Swap>(ptr, indices.type),
+                    loadIndex<Swap>(ptr + indexSize, indices.type),
+                    loadIndex<Swap>(ptr + 2 * indexSize, indices.type),
+                });
+                pos_ += triangleSize;
+            } else {
+                readPolygon<Swap>(element, indices, mesh);
+            }
+            if ((i + 1) % BLOCK == 0 && advance(BLOCK)) {
+                return false;
+            }
+        }
+        doneRecords_ += element.count % BLOCK;
+        return true;
+    }
+
+    template <bool Swap>
+    void readPolygon(const PlyElement& element, const PlyProperty& indices, TexturedMesh& mesh) {
+        checkSize(recordSize<Swap>(pos_, element));
+        for (const PlyProperty& prop : element.properties) {
+            if (!prop.list) {
+                pos_ += typeSize(prop.type);
+                continue;
+            }
+            const std::size_t count = loadIndex<Swap>(pos_, prop.countType);
+            pos_ += typeSize(prop.countType);
+            const std::size_t indexSize = typeSize(prop.type);
+            if (&prop == &indices && count >= 3) {
+                const uint32_t i0 = loadIndex<Swap>(pos_, prop.type);
+                for (std::size_t j = 2; j < count; ++j) {
+                    mesh.faces.push_back(TexturedMesh::Face{
+                        i0,
+                        loadIndex<Swap>(pos_ + (j - 1) * indexSize, prop.type),
+                        loadIndex<Swap>(pos_ + j * indexSize, prop.type),
+                    });
+                }
+            }
+            pos_ += count * indexSize;
+        }
+    }
+
+    void checkSize(const std::size_t size) const {
+        if (pos_ + size > end_) {
+            throw std::runtime_error("Unexpected end of .ply file");
+        }
+    }
+
+    bool advance(const std::size_t count) {
+        doneRecords_ += count;
+        return prog_(doneRecords_ * 100.f / std::max(totalRecords_, std::size_t(1)));
+    }
+};
+
+TexturedMesh loadPlyBinary(const MappedFile& file, const PlyHeader& header, const Progress& prog) {
+    BinaryPlyReader reader(file, header, prog);
+    TexturedMesh mesh;
+    for (const PlyElement& element : header.elements) {
+        bool completed = true;
+        if (element.name == "vertex") {
+            completed = reader.readVertices(element, mesh);
+        } else if (element.name == "face") {
+            completed = reader.readFaces(element, mesh);
+        } else {
+            std::cout << "Skipping element '" << element.name << "'" << std::endl;
+            reader.skip(element);
+        }
+        if (!completed) {
+            return {};
+        }
+    }
+    return mesh;
+}
+
+struct AsciiChunk {
+    const char* begin;
+    const char* end;
+
+    ///< Index of the first non-empty line of the chunk, counted from the end of the header
+    std::size_t firstRecord = 0;
+    std::size_t numRecords = 0;
+
+    ///< Faces are stored per chunk, as the number of triangles is only known after parsing
+    std::vector<TexturedMesh::Face> faces;
+};
+
+std::vector<AsciiChunk> splitToChunks(const char* begin, const char* end) {
+    std::vector<AsciiChunk> chunks;
+    for (const auto& range : splitLines(begin, end, 16 * tbb::this_task_arena::max_concurrency(), 1 << 20)) {
+        AsciiChunk chunk;
+        chunk.begin = range.first;
+        chunk.end = range.second;
+        chunks.push_back(std::move(chunk));
+    }
+    return chunks;
+}
+
+/// Returns the layout of vertex records after tokenization: every property is parsed into a double.
+PlyElement asciiLayout(const PlyElement& element) {
+    PlyElement layout = element;
+    for (std::size_t i = 0; i < layout.properties.size(); ++i) {
+        if (layout.properties[i].list) {
+            throw std::runtime_error("List properties of vertices are not supported");
+        }
+        layout.properties[i].type = PlyType::FLOAT64;
+        layout.properties[i].offset = i * sizeof(double);
+    }
+    layout.stride = layout.properties.size() * sizeof(double);
+    return layout;
+}
+
+/// Tokenizes a single record into the row of doubles.
+inline void tokenize(const char* p, const char* eol, double* row, const std::size_t numValues) {
+    for (std::size_t i = 0; i < numValues; ++i) {
+        p = scanDouble(p, eol, row[i]);
+    }
+}
+
+class AsciiPlyParser {
+    const PlyHeader& header_;
+    const PlyElement* vertexElement_ = nullptr;
+    PlyElement vertexLayout_;
+    std::unique_ptr<VertexDecoder> decoder_;
+    const PlyElement* faceElement_ = nullptr;
+    std::size_t faceIndicesProp_ = 0;
+
+    ///< Index of the first record of each element
+    std::vector<std::size_t> elementOffsets_;
+
+    // number of tokenized vertices decoded at once
+    static constexpr std::size_t BLOCK = 4096;
+
+public:
+    explicit AsciiPlyParser(const PlyHeader& header)
+        : header_(header) {
+        std::size_t offset = 0;
+        for (const PlyElement& element : header.elements) {
+            elementOffsets_.push_back(offset);
+            offset += element.count;
+            if (element.name == "vertex") {
+                vertexElement_ = &element;
+            } else if (element.name == "face") {
+                for (std::size_t i = 0; i < element.properties.size(); ++i) {
+                    const PlyProperty& prop = element.properties[i];
+                    if (prop.list && (prop.name == "vertex_indices" || prop.name == "vertex_index")) {
+                        faceElement_ = &element;
+                        faceIndicesProp_ = i;
+                    }
+                }
+            }
+        }
+        elementOffsets_.push_back(offset);
+        if (!vertexElement_) {
+            throw std::runtime_error("Missing vertices in .ply file");
+        }
+        vertexLayout_ = asciiLayout(*vertexElement_);
+    }
+
+    /// Returns the global index of the first vertex record.
+    std::size_t firstVertexRecord() const {
+        return elementOffsets_[vertexElement_ - &header_.elements[0]];
+    }
+
+    /// Returns the origin of local coordinates, given the line of the first vertex.
+    Coords origin(const char* line, const char* end) const {
+        if (!hasDoubleCoordinates(*vertexElement_) || line == nullptr) {
+            return Coords(0.);
+        }
+        std::vector<double> row(vertexLayout_.properties.size());
+        tokenize(line, nextLine(line, end), row.data(), row.size());
+        return localOrigin(recordPosition(vertexLayout_, reinterpret_cast<const char*>(row.data()), false));
+    }
+
+    /// Resizes the mesh arrays, must be called before parsing.
+    void prepare(const Coords& origin, TexturedMesh& mesh) {
+        decoder_ = std::make_unique<VertexDecoder>(vertexLayout_, false, origin, mesh);
+    }
+
+    /// Parses all records in the chunk, can be called concurrently for different chunks.
+    void parse(AsciiChunk& chunk) const {
+        const std::size_t numValues = vertexLayout_.properties.size();
+        std::vector<double> rows(BLOCK * numValues);
+        std::size_t firstVertex = 0;
+        std::size_t numRows = 0;
+        auto flush = [&] {
+            if (numRows > 0) {
+                decoder_->decode(
+                    reinterpret_cast<const char*>(rows.data()), vertexLayout_.stride, firstVertex, numRows);
+                numRows = 0;
+            }
+        };
+
+        std::size_t record = chunk.firstRecord;
+        std::size_t elementIdx = 0;
+        for (const char* p = chunk.begin; p < chunk.end;) {
+            const char* eol = nextLine(p, chunk.end);
+            if (isEmptyLine(p, eol)) {
+                p = eol;
+                continue;
+            }
+            while (elementIdx < header_.elements.size() && record >= elementOffsets_[elementIdx + 1]) {
+                ++elementIdx;
+            }
+            if (elementIdx == header_.elements.size()) {
+                // trailing data after the last element
+                break;
+            }
+            const PlyElement& element = header_.elements[elementIdx];
+            const std::size_t index = record - elementOffsets_[elementIdx];
+            if (&element == vertexElement_) {
+                if (numRows == BLOCK) {
+                    flush();
+                }
+                if (numRows == 0) {
+                    firstVertex = index;
+                }
+                tokenize(p, eol, &rows[numRows * numValues], numValues);
+                ++numRows;
+            } else if (&element == faceElement_) {
+                parseFace(p, eol, chunk.faces);
+            }
+            ++record;
+            p = eol;
+        }
+        flush();
+    }
+
+private:
+    void parseFace(const char* p, const char* eol, std::vector<TexturedMesh::Face>& faces) const {
+        const std::vector<PlyProperty>& props = faceElement_->properties;
+        for (std::size_t i = 0; i < props.size(); ++i) {
+            uint32_t count = 1;
+            if (props[i].list) {
+                p = scanUnsigned(p, eol, count);
+            }
+            if (i != faceIndicesProp_ || count < 3) {
+                // other properties and degenerate polygons are skipped
+                double dummy;
+                for (uint32_t j = 0; j < count; ++j) {
+                    p = scanDouble(p, eol, dummy);
+                }
+                continue;
+            }
+            uint32_t i0, i1, i2;
+            p = scanUnsigned(p, eol, i0);
+            p = scanUnsigned(p, eol, i1);
+            for (uint32_t j = 2; j < count; ++j) {
+                p = scanUnsigned(p, eol, i2);
+                faces.push_back(TexturedMesh::Face{ i0, i1, i2 });
+                i1 = i2;
+            }
+        }
+    }
+};
+
+/// Returns the line containing the record with given index, or nullptr if there is no such record.
+const char* findRecord(const std::vector<AsciiChunk>& chunks, const std::size_t record) {
+    for (const AsciiChunk& chunk : chunks) {
+        if (record >= chunk.firstRecord + chunk.numRecords) {
+            continue;
+        }
+        std::size_t index = chunk.firstRecord;
+        for (const char* p = chunk.begin; p < chunk.end;) {
+            const char* eol = nextLine(p, chunk.end);
+            if (!isEmptyLine(p, eol)) {
+                if (index == record) {
+                    return p;
+                }
+                ++index;
+            }
+            p = eol;
+        }
+    }
+    return nullptr;
+}
+
+TexturedMesh loadPlyAscii(const MappedFile& file, const PlyHeader& header, const Progress& prog) {
+    const char* begin = file.data() + header.size;
+    std::vector<AsciiChunk> chunks = splitToChunks(begin, file.end());
+    TexturedMesh mesh;
+    AsciiPlyParser parser(header);
+    // both passes go through the whole file
+    ProgressCounter counter(2 * (file.end() - begin));
+    bool completed = runWithProgress(counter, prog, [&] {
+        // first pass counts the records in each chunk to find out where the elements start
+        tbb::parallel_for(std::size_t(0), chunks.size(), [&](std::size_t ci) {
+            if (counter.cancelled()) {
+                return;
+            }
+            AsciiChunk& chunk = chunks[ci];
+            for (const char* p = chunk.begin; p < chunk.end;) {
+                const char* eol = nextLine(p, chunk.end);
+                chunk.numRecords += !isEmptyLine(p, eol);
+                p = eol;
+            }
+            counter.add(chunk.end - chunk.begin);
+        });
+        for (std::size_t ci = 1; ci < chunks.size(); ++ci) {
+            chunks[ci].firstRecord = chunks[ci - 1].firstRecord + chunks[ci - 1].numRecords;
+        }
+
+        // second pass parses the chunks into presized arrays
+        const Coords origin = parser.origin(findRecord(chunks, parser.firstVertexRecord()), file.end());
+        mesh.srs = Srs(origin);
+        parser.prepare(origin, mesh);
+        tbb::parallel_for(std::size_t(0), chunks.size(), [&](std::size_t ci) {
+            if (counter.cancelled()) {
+                return;
+            }
+            parser.parse(chunks[ci]);
+            counter.add(chunks[ci].end - chunks[ci].begin);
+        });
+        if (counter.cancelled()) {
+            return;
+        }
+
+        // merge faces
+        std::vector<std::size_t> faceOffsets(chunks.size() + 1, 0);
+        for (std::size_t ci = 0; ci < chunks.size(); ++ci) {
+            faceOffsets[ci + 1] = faceOffsets[ci] + chunks[ci].faces.size();
+        }
+        mesh.faces.resize(faceOffsets.back());
+        tbb::parallel_for(std::size_t(0), chunks.size(), [&](std::size_t ci) {
+            std::copy(chunks[ci].faces.begin(), chunks[ci].faces.end(), mesh.faces.begin() + faceOffsets[ci]);
+            chunks[ci].faces = {};
+        });
+    });
+    if (!completed) {
+        return {};
+    }
+    return mesh;
+}
+
+/// Throws if any face refers to a vertex that does not exist.
+void checkFaceIndices(const TexturedMesh& mesh) {
+    const uint32_t maxIndex = tbb::parallel_reduce(
+        tbb::blocked_range<std::size_t>(0, mesh.faces.size()),
+        uint32_t(0),
+        [&mesh](const tbb::blocked_range<std::size_t>& range, uint32_t result) {
+            for (std::size_t fi = range.begin(); fi < range.end(); ++fi) {
+                const TexturedMesh::Face& f = mesh.faces[fi];
+                result = std::max({ result, f[0], f[1], f[2] });
+            }
+            return result;
+        },
+        [](const uint32_t a, const uint32_t b) { return std::max(a, b); });
+    if (!mesh.faces.empty() && maxIndex >= mesh.vertices.size()) {
+        throw std::runtime_error("Invalid vertex index " + std::to_string(maxIndex) + " in .ply file");
+    }
+}
+
+} // namespace
+
+TexturedMesh loadPly(const QString& file, const Progress& prog) {
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    MappedFile mapped(file.toStdString());
+    PlyHeader header = parseHeader(mapped.data(), mapped.size());
+    TexturedMesh mesh;
+    if (header.format == PlyFormat::ASCII) {
+        mesh = loadPlyAscii(mapped, header, prog);
+    } else {
+        mesh = loadPlyBinary(mapped, header, prog);
+    }
+    checkFaceIndices(mesh);
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    std::cout << "Ply mesh with " << mesh.vertices.size() << " vertices and " << mesh.faces.size()
+              << " faces loaded in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "ms"
+              << std::endl;
+    return mesh;
+}
+
+} // namespace Mpcv
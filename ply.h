@@ -0,0 +1,26 @@
+#pragma once
+
+#include "mesh.h"
+
+namespace Mpcv {
+
+enum class PlyFormat {
+    ASCII,
+    BINARY_LITTLE_ENDIAN,
+    BINARY_BIG_ENDIAN,
+};
+
+/// Saves the mesh as .ply file. Big endian files are only supported by the loader.
+bool savePly(std::ostream& out, const TexturedMesh& mesh, PlyFormat format = PlyFormat::ASCII);
+
+/// Saves all meshes into a single .ply file, converting them to the SRS of the first mesh.
+/// Returns false if cancelled by the progress callback.
+bool savePly(std::ostream& out,
+    const std::vector<const TexturedMesh*>& meshes,
+    const Progress& progress,
+    PlyFormat format = PlyFormat::ASCII);
+
+/// Loads ASCII or binary (both little and big endian) .ply file.
+TexturedMesh loadPly(const QString& file, const Progress& prog);
+
+} // namespace Mpcv
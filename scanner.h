@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Mpcv {
+
+/// Helpers for parsing numbers from memory buffers. Unlike sscanf or streams, they do not depend on the
+/// current locale and never allocate, so they can be used from many threads at once.
+
+inline bool isBlank(const char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline const char* skipBlanks(const char* p, const char* end) {
+    while (p < end && isBlank(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+/// Returns the pointer past the end of the current line (including the newline character).
+inline const char* nextLine(const char* p, const char* end) {
+    const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+    return eol ? eol + 1 : end;
+}
+
+/// Returns true if the line [p, end) contains only whitespaces.
+inline bool isEmptyLine(const char* p, const char* end) {
+    p = skipBlanks(p, end);
+    return p == end || *p == '\n';
+}
+
+/// Splits the buffer into ranges of roughly equal size (but at least minSize bytes), aligned to the starts
+/// of lines, so that they can be parsed independently.
+inline std::vector<std::pair<const char*, const char*>> splitLines(const char* begin,
+    const char* end,
+    const std::size_t numRanges,
+    const std::size_t minSize) {
+    const std::size_t size = end - begin;
+    const std::size_t rangeSize = std::max(size / numRanges + 1, minSize);
+    std::vector<std::pair<const char*, const char*>> ranges;
+    for (const char* p = begin; p < end;) {
+        const char* next = std::size_t(end - p) > rangeSize ? nextLine(p + rangeSize, end) : end;
+        ranges.emplace_back(p, next);
+        p = next;
+    }
+    return ranges;
+}
+
+/// Parses a decimal number and returns the pointer past the last parsed character. If there is no
+/// number at the current position, the value is set to zero and the returned pointer is p.
+inline const char* scanDouble(const char* p, const char* end, double& value) {
+    static const double powers[] = { 1.e0, 1.e1, 1.e2, 1.e3, 1.e4, 1.e5, 1.e6, 1.e7, 1.e8, 1.e9, 1.e10, 1.e11,
+        1.e12, 1.e13, 1.e14, 1.e15, 1.e16, 1.e17, 1.e18, 1.e19, 1.e20, 1.e21, 1.e22 };
+    const char* start = skipBlanks(p, end);
+    p = start;
+    value = 0.;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        ++p;
+    }
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    const char* digitsBegin = p;
+    for (; p < end && unsigned(*p - '0') < 10; ++p) {
+        if (digits < 19) {
+            mantissa = 10 * mantissa + (*p - '0');
+            digits += mantissa > 0;
+        } else {
+            ++exponent;
+        }
+    }
+    if (p < end && *p == '.') {
+        ++p;
+        for (; p < end && unsigned(*p - '0') < 10; ++p) {
+            if (digits < 19) {
+                mantissa = 10 * mantissa + (*p - '0');
+                digits += mantissa > 0;
+                --exponent;
+            }
+        }
+    }
+    if (p == digitsBegin || (p == digitsBegin + 1 && *digitsBegin == '.')) {
+        // not a plain number, let the C library handle nan, inf and similar
+        char buffer[64];
+        const std::size_t length = std::min<std::size_t>(end - start, sizeof(buffer) - 1);
+        memcpy(buffer, start, length);
+        buffer[length] = '\0';
+        char* last;
+        value = std::strtod(buffer, &last);
+        return start + (last - buffer);
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char* e = p + 1;
+        bool negativeExp = false;
+        if (e < end && (*e == '-' || *e == '+')) {
+            negativeExp = *e == '-';
+            ++e;
+        }
+        if (e < end && unsigned(*e - '0') < 10) {
+            int exp = 0;
+            for (; e < end && unsigned(*e - '0') < 10; ++e) {
+                exp = std::min(10 * exp + (*e - '0'), 100000);
+            }
+            exponent += negativeExp ? -exp : exp;
+            p = e;
+        }
+    }
+    value = double(mantissa);
+    if (mantissa != 0) {
+        if (exponent < 0 && exponent >= -22) {
+            value /= powers[-exponent];
+        } else if (exponent > 0 && exponent <= 22) {
+            value *= powers[exponent];
+        } else if (exponent != 0) {
+            value *= std::pow(10., exponent);
+        }
+    }
+    if (negative) {
+        value = -value;
+    }
+    return p;
+}
+
+inline const char* scanFloat(const char* p, const char* end, float& value) {
+    double d;
+    p = scanDouble(p, end, d);
+    value = float(d);
+    return p;
+}
+
+/// Parses a non-negative integer, returns p if there is no integer at the current position.
+inline const char* scanUnsigned(const char* p, const char* end, uint32_t& value) {
+    p = skipBlanks(p, end);
+    if (p < end && *p == '+') {
+        ++p;
+    }
+    uint64_t result = 0;
+    for (; p < end && unsigned(*p - '0') < 10; ++p) {
+        result = 10 * result + (*p - '0');
+    }
+    value = uint32_t(result);
+    return p;
+}
+
+} // namespace Mpcv
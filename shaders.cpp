@@ -0,0 +1,71 @@
+#include "shaders.h"
+
+namespace Mpcv {
+
+const char* const MESH_VERTEX_SHADER = R"(
+#version 330 core
+
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 normal;
+layout(location = 2) in vec2 uv;
+layout(location = 3) in vec4 colorAo;
+layout(location = 4) in uint cls;
+
+uniform mat4 modelView;
+uniform mat4 projection;
+uniform mat3 normalMatrix;
+
+// 0 = constant gray, 1 = vertex colors, 2 = class colors
+uniform int colorSource;
+uniform bool useAo;
+uniform vec3 palette[256];
+
+out vec3 vNormal;
+out vec2 vUv;
+out vec3 vColor;
+
+void main() {
+    gl_Position = projection * modelView * vec4(position, 1.0);
+    vNormal = normalMatrix * normal;
+    vUv = uv;
+    vec3 color = vec3(0.75);
+    if (colorSource == 1) {
+        color = colorAo.rgb;
+    } else if (colorSource == 2) {
+        color = palette[cls];
+    }
+    if (useAo) {
+        color *= colorAo.a;
+    }
+    vColor = color;
+}
+)";
+
+const char* const MESH_FRAGMENT_SHADER = R"(
+#version 330 core
+
+in vec3 vNormal;
+in vec2 vUv;
+in vec3 vColor;
+
+uniform bool useTexture;
+uniform bool lighting;
+uniform sampler2D tex;
+
+out vec4 fragColor;
+
+void main() {
+    vec3 color = vColor;
+    if (useTexture) {
+        color *= texture(tex, vUv).rgb;
+    }
+    if (lighting) {
+        // same as the fixed pipeline: directional light along the view direction, little ambient light
+        float diffuse = max(dot(normalize(vNormal), vec3(0.0, 0.0, 1.0)), 0.0);
+        color *= 0.04 + 0.9 * diffuse;
+    }
+    fragColor = vec4(color, 1.0);
+}
+)";
+
+} // namespace Mpcv
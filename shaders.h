@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+
+namespace Mpcv {
+
+/// Vertex of the interleaved buffers drawn by the shader render path.
+struct ShaderVertex {
+    float position[3];
+    float normal[3];
+    float uv[2];
+    uint8_t color[3];
+    uint8_t ao;
+    uint8_t cls;
+    uint8_t padding[3];
+};
+
+static_assert(sizeof(ShaderVertex) == 40, "Unexpected padding of the shader vertex");
+
+/// Attribute locations of ShaderVertex members in the mesh shaders
+enum class ShaderAttribute {
+    POSITION = 0,
+    NORMAL = 1,
+    UV = 2,
+    COLOR_AO = 3,
+    CLASS = 4,
+};
+
+/// Sources of the vertex colors in the mesh shaders, must match the values used in the shader code
+enum class ShaderColor {
+    CONSTANT = 0,
+    VERTEX = 1,
+    CLASS = 2,
+};
+
+extern const char* const MESH_VERTEX_SHADER;
+
+extern const char* const MESH_FRAGMENT_SHADER;
+
+} // namespace Mpcv
@@ -71,6 +71,10 @@ uint8_t* JpegTexture::data() {
     return data_;
 }
 
+std::size_t JpegTexture::dataSize() const {
+    return width_ * height_ * channels_;
+}
+
 #endif
 
 #ifdef HAS_PNG
@@ -111,6 +115,10 @@ uint8_t* PngTexture::data() {
     return data_;
 }
 
+std::size_t PngTexture::dataSize() const {
+    return width_ * height_ * channels_;
+}
+
 #endif
 
 std::unique_ptr<ITexture> makeTexture(const QString& filename) {
@@ -4,6 +4,7 @@
 #include <QImage>
 #include <cstdint>
 #include <memory>
+#include <vector>
 
 namespace Mpcv {
 
@@ -24,6 +25,9 @@ public:
     virtual ImageFormat format() const = 0;
 
     virtual uint8_t* data() = 0;
+
+    /// Returns the size of the image data in bytes, including the padding of rows (if any).
+    virtual std::size_t dataSize() const = 0;
 };
 
 class QtTexture : public ITexture {
@@ -57,6 +61,39 @@ public:
     virtual uint8_t* data() override {
         return image_.bits();
     }
+
+    virtual std::size_t dataSize() const override {
+        return std::size_t(image_.bytesPerLine()) * image_.height();
+    }
+};
+
+/// Texture owning a copy of the image data, for instance read from a cache file.
+class RawTexture : public ITexture {
+    Pvl::Vec2i size_;
+    ImageFormat format_;
+    std::vector<uint8_t> data_;
+
+public:
+    RawTexture(const Pvl::Vec2i& size, const ImageFormat format, std::vector<uint8_t>&& data)
+        : size_(size)
+        , format_(format)
+        , data_(std::move(data)) {}
+
+    virtual Pvl::Vec2i size() const override {
+        return size_;
+    }
+
+    virtual ImageFormat format() const override {
+        return format_;
+    }
+
+    virtual uint8_t* data() override {
+        return data_.data();
+    }
+
+    virtual std::size_t dataSize() const override {
+        return data_.size();
+    }
 };
 
 #ifdef HAS_JPEG
@@ -76,6 +113,8 @@ public:
     virtual ImageFormat format() const override;
 
     virtual uint8_t* data() override;
+
+    virtual std::size_t dataSize() const override;
 };
 
 #endif
@@ -97,6 +136,8 @@ public:
     virtual ImageFormat format() const override;
 
     virtual uint8_t* data() override;
+
+    virtual std::size_t dataSize() const override;
 };
 
 #endif